@@ -1426,51 +1426,12 @@ impl<R: Runtime> TorClient<R> {
                 hostname,
                 port,
             } => {
-                self.wait_for_bootstrap().await?;
-                let netdir = self.netdir(Timeliness::Timely, "connect to a hidden service")?;
-
-                let mut hs_client_secret_keys_builder = HsClientSecretKeysBuilder::default();
-
-                if let Some(keymgr) = &self.inert_client.keymgr {
-                    let desc_enc_key_spec = HsClientDescEncKeypairSpecifier::new(hsid);
-
-                    // TODO hs: refactor to reduce code duplication.
-                    //
-                    // The code that reads ks_hsc_desc_enc and ks_hsc_intro_auth and builds the
-                    // HsClientSecretKeys is very repetitive and should be refactored.
-                    let ks_hsc_desc_enc =
-                        keymgr.get::<HsClientDescEncKeypair>(&desc_enc_key_spec)?;
-
-                    if let Some(ks_hsc_desc_enc) = ks_hsc_desc_enc {
-                        debug!("Found descriptor decryption key for {hsid}");
-                        hs_client_secret_keys_builder.ks_hsc_desc_enc(ks_hsc_desc_enc);
-                    }
-                };
-
-                let hs_client_secret_keys = hs_client_secret_keys_builder
-                    .build()
-                    .map_err(ErrorDetail::Configuration)?;
-
-                let circ = self
-                    .hsclient
-                    .get_or_launch_circuit(
-                        &netdir,
-                        hsid,
-                        hs_client_secret_keys,
-                        self.isolation(prefs),
-                    )
-                    .await
-                    .map_err(|cause| ErrorDetail::ObtainHsCircuit {
-                        cause,
-                        hsid: hsid.into(),
-                    })?;
+                let circ = self.get_or_launch_hs_circ(hsid, prefs).await?;
                 // On connections to onion services, we have to suppress
-                // everything except the port from the BEGIN message.  We also
-                // disable optimistic data.
-                stream_parameters
-                    .suppress_hostname()
-                    .suppress_begin_flags()
-                    .optimistic(false);
+                // everything except the port from the BEGIN message.  We keep
+                // optimistic data if the caller asked for it: the service
+                // queues data that arrives behind the BEGIN, as an exit does.
+                stream_parameters.suppress_hostname().suppress_begin_flags();
                 (circ, hostname, port)
             }
         };
@@ -1490,6 +1451,28 @@ impl<R: Runtime> TorClient<R> {
         Ok(stream)
     }
 
+    /// Obtain the descriptor of the onion service `hsid` and a rendezvous
+    /// circuit to it, without opening a stream.
+    ///
+    /// The onion service client keeps both, so a later
+    /// [`connect_with_prefs`](Self::connect_with_prefs) to the service with
+    /// the same isolation can begin its stream right away. Circuits that go
+    /// unused are closed after a few minutes, so call this again to keep a
+    /// service ready for longer.
+    #[cfg(all(feature = "onion-service-client", feature = "experimental-api"))]
+    #[cfg_attr(
+        docsrs,
+        doc(cfg(all(feature = "onion-service-client", feature = "experimental-api")))
+    )]
+    pub async fn prefetch_onion_service(
+        &self,
+        hsid: HsId,
+        prefs: &StreamPrefs,
+    ) -> crate::Result<()> {
+        self.get_or_launch_hs_circ(hsid, prefs).await?;
+        Ok(())
+    }
+
     /// Sets the default preferences for future connections made with this client.
     ///
     /// The preferences set with this function will be inherited by clones of this client, but
@@ -1655,6 +1638,52 @@ impl<R: Runtime> TorClient<R> {
         }
     }
 
+    /// Get or launch a rendezvous circuit to the onion service `hsid`,
+    /// isolated according to `prefs`.
+    ///
+    /// The circuit (and the service's descriptor) are remembered by the
+    /// onion service client, so later calls with the same isolation reuse them.
+    #[cfg(feature = "onion-service-client")]
+    async fn get_or_launch_hs_circ(
+        &self,
+        hsid: tor_hscrypto::pk::HsId,
+        prefs: &StreamPrefs,
+    ) -> crate::Result<Arc<ClientCirc>> {
+        self.wait_for_bootstrap().await?;
+        let netdir = self.netdir(Timeliness::Timely, "connect to a hidden service")?;
+
+        let mut hs_client_secret_keys_builder = HsClientSecretKeysBuilder::default();
+
+        if let Some(keymgr) = &self.inert_client.keymgr {
+            let desc_enc_key_spec = HsClientDescEncKeypairSpecifier::new(hsid);
+
+            // TODO hs: refactor to reduce code duplication.
+            //
+            // The code that reads ks_hsc_desc_enc and ks_hsc_intro_auth and builds the
+            // HsClientSecretKeys is very repetitive and should be refactored.
+            let ks_hsc_desc_enc = keymgr.get::<HsClientDescEncKeypair>(&desc_enc_key_spec)?;
+
+            if let Some(ks_hsc_desc_enc) = ks_hsc_desc_enc {
+                debug!("Found descriptor decryption key for {hsid}");
+                hs_client_secret_keys_builder.ks_hsc_desc_enc(ks_hsc_desc_enc);
+            }
+        };
+
+        let hs_client_secret_keys = hs_client_secret_keys_builder
+            .build()
+            .map_err(ErrorDetail::Configuration)?;
+
+        let circ = self
+            .hsclient
+            .get_or_launch_circuit(&netdir, hsid, hs_client_secret_keys, self.isolation(prefs))
+            .await
+            .map_err(|cause| ErrorDetail::ObtainHsCircuit {
+                cause,
+                hsid: hsid.into(),
+            })?;
+        Ok(circ)
+    }
+
     /// Get or launch an exit-suitable circuit with a given set of
     /// exit ports.
     async fn get_or_launch_exit_circ(
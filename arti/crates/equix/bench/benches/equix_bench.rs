@@ -112,7 +112,7 @@ fn runtimes_bench_solve(group: &mut BenchmarkGroup<'_, WallTime>, runtimes: &[Ru
         });
 
         // Use this Rust implementation, and reuse the SolverMemory.
-        // Doesn't support reusing the HashX program memory yet.
+        // HashX program memory is recycled internally on x86_64.
         let solver_cell = std::cell::RefCell::new(SolverMemory::new());
         bench_solve(group, &format!("{}-solve-reuse", r.name), |challenge| {
             EquiXBuilder::new()
@@ -122,6 +122,12 @@ fn runtimes_bench_solve(group: &mut BenchmarkGroup<'_, WallTime>, runtimes: &[Ru
                 .solve_with_memory(&mut solver_cell.borrow_mut())
         });
 
+        // Reuse the SolverMemory, and build each next instance on a helper
+        // thread while the current one is being solved. Unlike the other
+        // solve benchmarks, challenges come straight from the pipeline, so
+        // the occasional failed program generation is skipped in-line.
+        bench_solve_pipeline(group, &format!("{}-solve-pipeline", r.name), r.option);
+
         // Comparison with original C implementation of both HashX and Equi-X.
         // Mo memory reuse.
         let ctx_solve = tor_c_equix::EquiXFlags::EQUIX_CTX_SOLVE;
@@ -178,6 +184,30 @@ fn bench_solve<F: FnMut([u8; 4]) -> T + Copy, T>(
     });
 }
 
+fn bench_solve_pipeline(
+    group: &mut BenchmarkGroup<'_, WallTime>,
+    name: &str,
+    option: RuntimeOption,
+) {
+    // Benchmark the steady state of a solver that tries one challenge after
+    // another, with hash function generation overlapped with solving.
+
+    let mut rng = StdRng::from_entropy();
+    let challenges = std::iter::repeat_with(move || rng.next_u32().to_le_bytes());
+    let mut pipeline = EquiXBuilder::new().runtime(option).pipeline(challenges, 2);
+    let mut mem = SolverMemory::new();
+
+    group.bench_function(name, |b| {
+        b.iter(|| loop {
+            match pipeline.next().unwrap() {
+                (_, Ok(instance)) => break instance.solve_with_memory(&mut mem),
+                (_, Err(Error::Hash(HashError::ProgramConstraints))) => (),
+                (_, Err(_)) => unreachable!(),
+            }
+        });
+    });
+}
+
 fn bench_verify<F: FnMut(([u8; 4], [u8; 16])) -> T + Copy, T>(
     group: &mut BenchmarkGroup<'_, WallTime>,
     name: &str,
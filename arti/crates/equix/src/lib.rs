@@ -54,7 +54,7 @@ mod solver;
 #[cfg(feature = "bucket-array")]
 pub use bucket_array::mem::{BucketArray, BucketArrayMemory, BucketArrayPair, Count, Uninit};
 
-use hashx::{HashX, HashXBuilder};
+use hashx::{HashX, HashXBuilder, HashXPipeline};
 
 pub use hashx::{Runtime, RuntimeOption};
 
@@ -199,6 +199,54 @@ impl EquiXBuilder {
     pub fn verify_bytes(&self, challenge: &[u8], array: &SolutionByteArray) -> Result<(), Error> {
         self.verify(challenge, &Solution::try_from_bytes(array)?)
     }
+
+    /// Build [`EquiX`] instances for a series of challenges on a helper thread.
+    ///
+    /// Solvers that try challenge after challenge (one per nonce) can use
+    /// this to generate and compile the next hash program while the current
+    /// one is being solved. See [`HashXBuilder::pipeline()`] for the meaning
+    /// of `depth`.
+    pub fn pipeline<S, I>(&self, challenges: I, depth: usize) -> EquiXPipeline<S>
+    where
+        S: AsRef<[u8]> + Send + 'static,
+        I: IntoIterator<Item = S>,
+        I::IntoIter: Send + 'static,
+    {
+        EquiXPipeline {
+            inner: self.hash.pipeline(challenges, depth),
+        }
+    }
+}
+
+/// Iterator over [`EquiX`] instances built in the background
+///
+/// Created with [`EquiXBuilder::pipeline()`]. Each item pairs a challenge
+/// with the result of building an instance for it, in the order the
+/// challenges were supplied.
+#[derive(Debug)]
+pub struct EquiXPipeline<S> {
+    /// Pipeline building the underlying hash functions
+    inner: HashXPipeline<S>,
+}
+
+impl<S> EquiXPipeline<S> {
+    /// Time the helper thread spent building the item most recently
+    /// returned, as in [`HashXPipeline::last_build_time()`].
+    pub fn last_build_time(&self) -> std::time::Duration {
+        self.inner.last_build_time()
+    }
+}
+
+impl<S> Iterator for EquiXPipeline<S> {
+    type Item = (S, Result<EquiX, Error>);
+
+    fn next(&mut self) -> Option<Self::Item> {
+        let (challenge, result) = self.inner.next()?;
+        Some((
+            challenge,
+            result.map(|hash| EquiX { hash }).map_err(Error::Hash),
+        ))
+    }
 }
 
 impl Default for EquiXBuilder {
@@ -47,7 +47,8 @@ fn hashx_bench(c: &mut Criterion) {
 
 fn runtimes_bench_generate(group: &mut BenchmarkGroup<'_, WallTime>, runtimes: &[Runtime]) {
     for r in runtimes {
-        // Normal program generation in our Rust implementation
+        // Normal program generation in our Rust implementation.
+        // On x86_64 this recycles executable pages from dropped programs.
         bench_generate(
             group,
             |seed| HashXBuilder::new().runtime(r.option).build(&seed),
@@ -55,14 +56,15 @@ fn runtimes_bench_generate(group: &mut BenchmarkGroup<'_, WallTime>, runtimes: &
         );
 
         // Compare with the original C implementation.
-        // For fair comparison with HashX::build, doesn't reuse memory.
+        // Allocates a new context each time, without any memory reuse.
         bench_generate(
             group,
             |seed| tor_c_equix::HashX::new(r.c_type).make(&seed),
             &format!("generate-{}-c", r.name),
         );
 
-        // Measure program generation with memory reuse (not supported in Rust yet)
+        // Measure C program generation with memory reuse, the closest
+        // equivalent to our recycled executable pages
         let ctx_cell = std::cell::RefCell::new(tor_c_equix::HashX::new(r.c_type));
         bench_generate(
             group,
@@ -27,11 +27,13 @@ pub(crate) struct Executable {
     ///
     /// On platforms with compiler support, this item is present.
     /// If the compiler is unavailable, Executable will be empty.
+    /// It's only taken out of the `ManuallyDrop` when the Executable
+    /// itself is dropped and the buffer goes back to the reuse pool.
     #[cfg(all(
         feature = "compiler",
         any(target_arch = "x86_64", target_arch = "aarch64")
     ))]
-    buffer: util::ExecutableBuffer,
+    buffer: std::mem::ManuallyDrop<util::ExecutableBuffer>,
 }
 
 /// Default implementation for [`Architecture`], used
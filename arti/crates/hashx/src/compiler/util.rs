@@ -9,9 +9,57 @@ use dynasmrt::{
     DynasmLabelApi,
 };
 use std::marker::PhantomData;
+use std::mem::ManuallyDrop;
+use std::sync::Mutex;
 
 pub(crate) use dynasmrt::mmap::ExecutableBuffer;
 
+/// Upper limit on the number of idle buffers kept in [`BUFFER_POOL`]
+///
+/// Each buffer is a single page in practice, so this bounds the pool's
+/// memory at a few hundred kilobytes even after a burst of concurrent
+/// programs.
+const BUFFER_POOL_CAPACITY: usize = 64;
+
+/// Executable buffers from dropped programs, kept for reuse
+///
+/// Mapping, protecting, and unmapping a fresh region for every program
+/// costs several system calls and a page fault. Workloads like Equi-X
+/// solvers build a new program per nonce, so recycling the mapping and
+/// only flipping its protection is a measurable share of build time.
+static BUFFER_POOL: Mutex<Vec<ExecutableBuffer>> = Mutex::new(Vec::new());
+
+/// Get a writable buffer with room for at least `len` bytes of code.
+///
+/// Prefers a recycled buffer from [`BUFFER_POOL`], and maps a new one if
+/// the pool is empty or the recycled buffer can't be made writable.
+fn take_buffer(len: usize) -> Result<MutableBuffer, CompilerError> {
+    let recycled = BUFFER_POOL.lock().ok().and_then(|mut pool| pool.pop());
+    if let Some(buffer) = recycled {
+        if buffer.size() >= len {
+            if let Ok(buffer) = buffer.make_mut() {
+                return Ok(buffer);
+            }
+        }
+    }
+    Ok(MutableBuffer::new(len)?)
+}
+
+/// Return a buffer from a dropped [`Executable`] to [`BUFFER_POOL`].
+///
+/// Only x86_64 recycles buffers. Its instruction cache is coherent with
+/// data writes, whereas other targets would need an explicit icache flush
+/// before running new code from a previously executed page.
+fn recycle_buffer(buffer: ExecutableBuffer) {
+    if cfg!(target_arch = "x86_64") {
+        if let Ok(mut pool) = BUFFER_POOL.lock() {
+            if pool.len() < BUFFER_POOL_CAPACITY {
+                pool.push(buffer);
+            }
+        }
+    }
+}
+
 /// Our own simple replacement for [`dynasmrt::Assembler`]
 ///
 /// The default assembler in [`dynasmrt`] has a ton of features we don't need,
@@ -67,17 +115,16 @@ impl<R: Relocation, const S: usize> Assembler<R, S> {
     /// copy by only passing a reference.
     #[inline(always)]
     pub(crate) fn finalize(&self) -> Result<Executable, CompilerError> {
-        // We never execute code from the buffer until it's complete, and we use
-        // a freshly mmap'ed buffer for each program. Because of this, we don't
-        // need to explicitly clear the icache even on platforms that would
-        // normally want this. If we reuse buffers in the future, this will need
-        // architecture-specific support for icache clearing when a new program
-        // is finalized into a buffer we previously ran.
-        let mut mut_buf = MutableBuffer::new(self.buffer.len())?;
+        // We never execute code from the buffer until it's complete. Buffers
+        // are only recycled on x86_64 (see `recycle_buffer`), so on every other
+        // target this is a freshly mmap'ed buffer and we don't need to
+        // explicitly clear the icache even on platforms that would normally
+        // want this.
+        let mut mut_buf = take_buffer(self.buffer.len())?;
         mut_buf.set_len(self.buffer.len());
         mut_buf[..].copy_from_slice(&self.buffer);
         Ok(Executable {
-            buffer: mut_buf.make_exec()?,
+            buffer: ManuallyDrop::new(mut_buf.make_exec()?),
         })
     }
 }
@@ -94,6 +141,15 @@ impl std::fmt::Debug for Executable {
     }
 }
 
+impl Drop for Executable {
+    /// Hand the mapped memory back to [`BUFFER_POOL`] for a later program.
+    fn drop(&mut self) {
+        // SAFETY: The buffer is never accessed again after this point.
+        let buffer = unsafe { ManuallyDrop::take(&mut self.buffer) };
+        recycle_buffer(buffer);
+    }
+}
+
 // Reluctantly implement just enough of [`DynasmLabelApi`] for our single backward label.
 impl<R: Relocation, const S: usize> DynasmLabelApi for Assembler<R, S> {
     type Relocation = R;
@@ -47,6 +47,7 @@ mod compiler;
 mod constraints;
 mod err;
 mod generator;
+mod pipeline;
 mod program;
 mod rand;
 mod register;
@@ -58,6 +59,7 @@ use crate::program::Program;
 use rand_core::RngCore;
 
 pub use crate::err::{CompilerError, Error};
+pub use crate::pipeline::HashXPipeline;
 pub use crate::rand::SipRand;
 pub use crate::siphash::SipState;
 
@@ -0,0 +1,83 @@
+//! Building [`HashX`] instances ahead of use, on a helper thread
+//!
+//! Callers that walk through a long series of seeds, like an Equi-X solver
+//! trying one nonce after another, otherwise pay for program generation and
+//! compilation serially between hash runs. A pipeline overlaps that work with
+//! whatever the caller does with the previous instance.
+
+use crate::{Error, HashX, HashXBuilder};
+use std::sync::mpsc::{sync_channel, Receiver};
+use std::thread;
+use std::time::{Duration, Instant};
+
+/// Iterator over [`HashX`] instances built in the background from a series of seeds
+///
+/// Created with [`HashXBuilder::pipeline()`]. Each item pairs a seed with
+/// the result of building it, in the same order the seeds were supplied.
+/// Dropping the pipeline stops the helper thread after its current build.
+#[derive(Debug)]
+pub struct HashXPipeline<S> {
+    /// Finished builds from the helper thread, in seed order, with the time
+    /// each took to build
+    results: Receiver<(S, Result<HashX, Error>, Duration)>,
+    /// Build time of the item most recently returned
+    last_build_time: Duration,
+}
+
+impl<S> HashXPipeline<S> {
+    /// Time the helper thread spent building the item most recently
+    /// returned by [`Iterator::next()`], or zero before the first.
+    ///
+    /// This is the full cost of program generation and compilation,
+    /// whether or not the consumer had to wait for it.
+    pub fn last_build_time(&self) -> Duration {
+        self.last_build_time
+    }
+}
+
+impl<S> Iterator for HashXPipeline<S> {
+    type Item = (S, Result<HashX, Error>);
+
+    fn next(&mut self) -> Option<Self::Item> {
+        let (seed, result, build_time) = self.results.recv().ok()?;
+        self.last_build_time = build_time;
+        Some((seed, result))
+    }
+}
+
+impl HashXBuilder {
+    /// Build [`HashX`] instances for every seed in `seeds` on a helper thread.
+    ///
+    /// At most `depth` finished instances are queued ahead of the consumer,
+    /// plus the one currently being built. A depth of one or two is enough
+    /// to hide build latency whenever hashing takes longer than building.
+    ///
+    /// Panics if the helper thread can't be spawned.
+    pub fn pipeline<S, I>(&self, seeds: I, depth: usize) -> HashXPipeline<S>
+    where
+        S: AsRef<[u8]> + Send + 'static,
+        I: IntoIterator<Item = S>,
+        I::IntoIter: Send + 'static,
+    {
+        let (sender, results) = sync_channel(depth);
+        let builder = self.clone();
+        let seeds = seeds.into_iter();
+        thread::Builder::new()
+            .name("hashx-pipeline".into())
+            .spawn(move || {
+                for seed in seeds {
+                    let build_start = Instant::now();
+                    let result = builder.build(seed.as_ref());
+                    let build_time = build_start.elapsed();
+                    if sender.send((seed, result, build_time)).is_err() {
+                        break;
+                    }
+                }
+            })
+            .expect("failed to spawn HashX pipeline thread");
+        HashXPipeline {
+            results,
+            last_build_time: Duration::ZERO,
+        }
+    }
+}
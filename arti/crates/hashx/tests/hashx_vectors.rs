@@ -140,3 +140,26 @@ fn bad_seeds() {
     ));
     assert!(HashX::new(b"\x5e\x93\x02\x00").is_ok());
 }
+
+#[test]
+fn pipeline_matches_build() {
+    let seeds = vec![SEED1, SEED2, SEED1];
+    let results: Vec<_> = HashXBuilder::new().pipeline(seeds.clone(), 1).collect();
+    assert_eq!(results.len(), seeds.len());
+    for ((seed, func), expected) in results.into_iter().zip(seeds) {
+        assert_eq!(seed, expected);
+        let func = func.unwrap();
+        assert_eq!(
+            func.hash_to_bytes(123456),
+            HashX::new(expected).unwrap().hash_to_bytes(123456)
+        );
+    }
+}
+
+#[test]
+fn pipeline_reports_build_time() {
+    let mut pipeline = HashXBuilder::new().pipeline(vec![SEED1, SEED2], 1);
+    assert!(pipeline.last_build_time().is_zero());
+    let _ = pipeline.next().unwrap();
+    assert!(!pipeline.last_build_time().is_zero());
+}
@@ -0,0 +1,119 @@
+//! Count heap allocations per megabyte of DATA cells, and per SENDME,
+//! for the general relay message encoder and decoder and for the
+//! allocation-free paths.
+//!
+//! Run with `cargo bench -p tor-cell --bench data_alloc`.
+
+use std::alloc::{GlobalAlloc, Layout, System};
+use std::hint::black_box;
+use std::sync::atomic::{AtomicUsize, Ordering};
+
+use tor_cell::chancell::{BoxedCellBody, CELL_DATA_LEN};
+use tor_cell::relaycell::msg::{AnyRelayMsg, Data, Sendme};
+use tor_cell::relaycell::{AnyRelayMsgOuter, RelayCellFormat, StreamId, UnparsedRelayMsg};
+
+/// A global allocator that counts the allocations it makes.
+struct Counting;
+
+/// Number of allocations made so far.
+static ALLOCATIONS: AtomicUsize = AtomicUsize::new(0);
+
+unsafe impl GlobalAlloc for Counting {
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        ALLOCATIONS.fetch_add(1, Ordering::Relaxed);
+        System.alloc(layout)
+    }
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        System.dealloc(ptr, layout);
+    }
+}
+
+#[global_allocator]
+static GLOBAL: Counting = Counting;
+
+/// Number of full DATA cells it takes to carry one megabyte.
+const CELLS_PER_MB: usize = (1 << 20) / Data::MAXLEN + 1;
+
+/// Return the number of allocations that `f` makes.
+fn count_allocations(f: impl FnOnce()) -> usize {
+    let before = ALLOCATIONS.load(Ordering::Relaxed);
+    f();
+    ALLOCATIONS.load(Ordering::Relaxed) - before
+}
+
+/// Encode `msg` as a relay cell body on stream 1.
+fn encode(msg: AnyRelayMsg) -> BoxedCellBody {
+    AnyRelayMsgOuter::new(StreamId::new(1), msg)
+        .encode(&mut rand::thread_rng())
+        .expect("encoding failed")
+}
+
+/// Wrap `body` as an unparsed relay message.
+fn unparsed(body: &BoxedCellBody) -> UnparsedRelayMsg {
+    UnparsedRelayMsg::from_singleton_body(RelayCellFormat::V0, body.clone())
+        .expect("decoding failed")
+}
+
+fn main() {
+    let payload = [0x5a_u8; Data::MAXLEN];
+    let data_cell = encode(Data::new(&payload).expect("bad data").into());
+    let sendme_cell = encode(Sendme::new_tag([7; 20]).into());
+
+    // Copying the cell bodies allocates, so do that up front.
+    let data_msgs: Vec<_> = (0..CELLS_PER_MB).map(|_| unparsed(&data_cell)).collect();
+    let data_msgs_owned = data_msgs.clone();
+    let sendme_msgs: Vec<_> = (0..1000).map(|_| unparsed(&sendme_cell)).collect();
+
+    let encode_data = count_allocations(|| {
+        for _ in 0..CELLS_PER_MB {
+            black_box(encode(Data::new(&payload).expect("bad data").into()));
+        }
+    });
+    let mut cell_body = [0_u8; CELL_DATA_LEN];
+    let mut rng = rand::thread_rng();
+    let encode_data_into = count_allocations(|| {
+        for _ in 0..CELLS_PER_MB {
+            Data::encode_into(
+                StreamId::new(1).expect("zero stream"),
+                &payload,
+                &mut rng,
+                &mut cell_body,
+            )
+            .expect("encoding failed");
+            black_box(&cell_body);
+        }
+    });
+
+    let mut buf = Vec::with_capacity(Data::MAXLEN);
+    let decode_data = count_allocations(|| {
+        for m in data_msgs_owned {
+            let msg = m.decode::<AnyRelayMsg>().expect("decoding failed");
+            let AnyRelayMsg::Data(d) = msg.into_msg() else {
+                panic!("not a DATA message")
+            };
+            buf.clear();
+            buf.extend_from_slice(d.as_ref());
+        }
+    });
+    let borrow_data = count_allocations(|| {
+        for m in &data_msgs {
+            buf.clear();
+            buf.extend_from_slice(m.data_body().expect("bad data").expect("not data"));
+        }
+    });
+    black_box(&buf);
+
+    let decode_sendme = count_allocations(|| {
+        for m in sendme_msgs {
+            let msg = m.decode::<Sendme>().expect("decoding failed");
+            black_box(msg.into_msg().tag().map(<[u8]>::len));
+        }
+    });
+
+    println!("Allocations per MB of DATA cells ({CELLS_PER_MB} cells):");
+    println!("  encode (Data::new + encode):      {encode_data}");
+    println!("  Data::encode_into():              {encode_data_into}");
+    println!("  decode::<AnyRelayMsg>():          {decode_data}");
+    println!("  UnparsedRelayMsg::data_body():    {borrow_data}");
+    println!("Allocations per 1000 SENDME decodes: {decode_sendme}");
+}
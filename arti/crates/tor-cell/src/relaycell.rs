@@ -2,7 +2,8 @@
 
 use std::num::NonZeroU16;
 
-use crate::chancell::{BoxedCellBody, CELL_DATA_LEN};
+use crate::chancell::{BoxedCellBody, RawCellBody, CELL_DATA_LEN};
+use crate::slicewriter::SliceWriter;
 use derive_deftly::Deftly;
 use smallvec::{smallvec, SmallVec};
 use tor_bytes::{EncodeError, EncodeResult, Error, Result};
@@ -460,6 +461,35 @@ impl UnparsedRelayMsg {
             )),
         }
     }
+    /// If this is a DATA message, return its body, borrowed from the cell.
+    ///
+    /// This is a fast path for the most common relay message: unlike
+    /// `decode::<msg::Data>()`, it doesn't copy the body into a new allocation.
+    ///
+    /// Returns `Ok(None)` if this is not a DATA message, and an error if it is
+    /// one that `decode` would reject.
+    pub fn data_body(&self) -> Result<Option<&[u8]>> {
+        if self.cmd() != RelayCmd::DATA {
+            return Ok(None);
+        }
+        match &self.internal {
+            UnparsedRelayMsgInternal::V0(body) => {
+                /// The position of the length field within a relay cell.
+                const LEN_POS: usize = 9;
+                /// The position of the body a relay cell.
+                const BODY_POS: usize = 11;
+
+                let len = u16::from_be_bytes([body[LEN_POS], body[LEN_POS + 1]]) as usize;
+                if len == 0 {
+                    return Err(Error::InvalidMessage("Empty DATA message".into()));
+                }
+                body.get(BODY_POS..BODY_POS + len)
+                    .map(Some)
+                    .ok_or_else(|| Error::InvalidMessage("Insufficient data in relay cell".into()))
+            }
+        }
+    }
+
     /// Decode this unparsed cell into a given cell type.
     pub fn decode<M: RelayMsg>(self) -> Result<RelayMsgOuter<M>> {
         match self.internal {
@@ -510,6 +540,69 @@ pub struct RelayMsgOuter<M> {
     msg: M,
 }
 
+/// Encode a relay message with command `cmd` on `streamid`, whose body
+/// `write_body` writes, into the 509-byte cell body `body`, and pad it.
+///
+/// Return the length of the message before padding.
+pub(crate) fn encode_msg_into<R: Rng + CryptoRng>(
+    cmd: RelayCmd,
+    streamid: Option<StreamId>,
+    write_body: impl FnOnce(&mut SliceWriter<&mut RawCellBody>) -> EncodeResult<()>,
+    rng: &mut R,
+    body: &mut RawCellBody,
+) -> crate::Result<usize> {
+    // NOTE: This implementation is a bit optimized, since it happens to
+    // literally every relay cell that we produce.
+
+    /// The position of the length field within a relay cell.
+    const LEN_POS: usize = 9;
+    /// The position of the body a relay cell.
+    const BODY_POS: usize = 11;
+    /// We skip this much space before adding any random padding to the
+    /// end of the cell
+    const MIN_SPACE_BEFORE_PADDING: usize = 4;
+
+    let mut w = SliceWriter::new(body);
+    w.write_u8(cmd.into());
+    w.write_u16(0); // "Recognized"
+    debug_assert_eq!(
+        w.offset().expect("Overflowed a cell with just the header!"),
+        STREAM_ID_OFFSET
+    );
+    w.write_u16(StreamId::get_or_zero(streamid));
+    w.write_u32(0); // Digest
+                    // (It would be simpler to use NestedWriter at this point, but it uses an internal Vec that we are trying to avoid.)
+    debug_assert_eq!(
+        w.offset().expect("Overflowed a cell with just the header!"),
+        LEN_POS
+    );
+    w.write_u16(0); // Length.
+    debug_assert_eq!(
+        w.offset().expect("Overflowed a cell with just the header!"),
+        BODY_POS
+    );
+    write_body(&mut w)?; // body
+    let (body, written) = w.try_unwrap().map_err(|_| {
+        EncodeError::Bug(internal!(
+            "Encoding of relay message was too long to fit into a cell!"
+        ))
+    })?;
+    let payload_len = written - BODY_POS;
+    debug_assert!(payload_len < u16::MAX as usize);
+    *(<&mut [u8; 2]>::try_from(&mut body[LEN_POS..LEN_POS + 2])
+        .expect("Two-byte slice was not two bytes long!?")) = (payload_len as u16).to_be_bytes();
+
+    // The buffer may hold an earlier cell, so clear the zero bytes that
+    // start the padding (and any padding too short to randomize).
+    debug_assert!(written <= CELL_DATA_LEN);
+    body[written..].fill(0);
+    if written < CELL_DATA_LEN - MIN_SPACE_BEFORE_PADDING {
+        rng.fill_bytes(&mut body[written + MIN_SPACE_BEFORE_PADDING..]);
+    }
+
+    Ok(written)
+}
+
 /// A deprecated name for RelayMsgOuter.
 #[deprecated(note = "Use RelayMsgOuter instead.")]
 pub type RelayCell<M> = RelayMsgOuter<M>;
@@ -542,73 +635,24 @@ impl<M: RelayMsg> RelayMsgOuter<M> {
     /// Consume this relay message and encode it as a 509-byte padded cell
     /// body.
     pub fn encode<R: Rng + CryptoRng>(self, rng: &mut R) -> crate::Result<BoxedCellBody> {
-        /// We skip this much space before adding any random padding to the
-        /// end of the cell
-        const MIN_SPACE_BEFORE_PADDING: usize = 4;
-
-        let (mut body, enc_len) = self.encode_to_cell()?;
-        debug_assert!(enc_len <= CELL_DATA_LEN);
-        if enc_len < CELL_DATA_LEN - MIN_SPACE_BEFORE_PADDING {
-            rng.fill_bytes(&mut body[enc_len + MIN_SPACE_BEFORE_PADDING..]);
-        }
-
+        let mut body = Box::new([0_u8; CELL_DATA_LEN]);
+        self.encode_into(rng, &mut body)?;
         Ok(body)
     }
 
-    /// Consume a relay cell and return its contents, encoded for use
-    /// in a RELAY or RELAY_EARLY cell.
-    fn encode_to_cell(self) -> EncodeResult<(BoxedCellBody, usize)> {
-        // NOTE: This implementation is a bit optimized, since it happens to
-        // literally every relay cell that we produce.
-
-        // TODO -NM: Add a specialized implementation for making a DATA cell from
-        // a body?
-
-        /// Wrap a BoxedCellBody and implement AsMut<[u8]>
-        struct BodyWrapper(BoxedCellBody);
-        impl AsMut<[u8]> for BodyWrapper {
-            fn as_mut(&mut self) -> &mut [u8] {
-                self.0.as_mut()
-            }
-        }
-        /// The position of the length field within a relay cell.
-        const LEN_POS: usize = 9;
-        /// The position of the body a relay cell.
-        const BODY_POS: usize = 11;
-
-        let body = BodyWrapper(Box::new([0_u8; 509]));
-
-        let mut w = crate::slicewriter::SliceWriter::new(body);
-        w.write_u8(self.msg.cmd().into());
-        w.write_u16(0); // "Recognized"
-        debug_assert_eq!(
-            w.offset().expect("Overflowed a cell with just the header!"),
-            STREAM_ID_OFFSET
-        );
-        w.write_u16(StreamId::get_or_zero(self.streamid));
-        w.write_u32(0); // Digest
-                        // (It would be simpler to use NestedWriter at this point, but it uses an internal Vec that we are trying to avoid.)
-        debug_assert_eq!(
-            w.offset().expect("Overflowed a cell with just the header!"),
-            LEN_POS
-        );
-        w.write_u16(0); // Length.
-        debug_assert_eq!(
-            w.offset().expect("Overflowed a cell with just the header!"),
-            BODY_POS
-        );
-        self.msg.encode_onto(&mut w)?; // body
-        let (mut body, written) = w.try_unwrap().map_err(|_| {
-            EncodeError::Bug(internal!(
-                "Encoding of relay message was too long to fit into a cell!"
-            ))
-        })?;
-        let payload_len = written - BODY_POS;
-        debug_assert!(payload_len < u16::MAX as usize);
-        *(<&mut [u8; 2]>::try_from(&mut body.0[LEN_POS..LEN_POS + 2])
-            .expect("Two-byte slice was not two bytes long!?")) =
-            (payload_len as u16).to_be_bytes();
-        Ok((body.0, written))
+    /// Consume this relay message and encode it as a 509-byte padded cell
+    /// body, into `body`.
+    ///
+    /// Everything in `body` is overwritten, so a caller can reuse one buffer
+    /// for cell after cell without allocating.
+    pub fn encode_into<R: Rng + CryptoRng>(
+        self,
+        rng: &mut R,
+        body: &mut RawCellBody,
+    ) -> crate::Result<()> {
+        let RelayMsgOuter { streamid, msg } = self;
+        encode_msg_into(msg.cmd(), streamid, |w| msg.encode_onto(w), rng, body)?;
+        Ok(())
     }
 
     /// Parse a RELAY or RELAY_EARLY cell body into a RelayMsgOuter.
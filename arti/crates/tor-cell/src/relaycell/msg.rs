@@ -19,6 +19,7 @@ use tor_llcrypto::pk::rsa::RsaIdentity;
 use tor_memquota::{derive_deftly_template_HasMemoryCost, memory_cost_structural_copy};
 
 use bitflags::bitflags;
+use smallvec::SmallVec;
 
 #[cfg(feature = "hs")]
 #[cfg_attr(docsrs, doc(cfg(feature = "hs")))]
@@ -347,6 +348,38 @@ impl Data {
         Some((Self::new_unchecked(data.into()), remainder))
     }
 
+    /// Encode a DATA message on `streamid` carrying as much of `inp` as fits,
+    /// straight into the cell body `body`, padded as
+    /// [`RelayMsgOuter::encode`](super::RelayMsgOuter::encode) would pad it.
+    ///
+    /// Unlike building a [`Data`] and encoding it, this copies `inp` only
+    /// once and doesn't allocate. Return the number of bytes of `inp` that
+    /// the message carries.
+    ///
+    /// Returns an error if `inp` is empty.
+    pub fn encode_into<R: rand::Rng + rand::CryptoRng>(
+        streamid: super::StreamId,
+        inp: &[u8],
+        rng: &mut R,
+        body: &mut crate::chancell::RawCellBody,
+    ) -> crate::Result<usize> {
+        if inp.is_empty() {
+            return Err(crate::Error::CantEncode("Empty data message"));
+        }
+        let len = std::cmp::min(inp.len(), Data::MAXLEN);
+        super::encode_msg_into(
+            RelayCmd::DATA,
+            Some(streamid),
+            |w| {
+                w.write_all(&inp[..len]);
+                Ok(())
+            },
+            rng,
+            body,
+        )?;
+        Ok(len)
+    }
+
     /// Construct a new data cell from a provided vector of bytes.
     ///
     /// The vector _must_ not have more than [`Data::MAXLEN`] bytes, and must
@@ -630,7 +663,10 @@ impl Body for Connected {
 #[derive_deftly(HasMemoryCost)]
 pub struct Sendme {
     /// A tag value authenticating the previously received data.
-    digest: Option<Vec<u8>>,
+    ///
+    /// Tags are 20 bytes long in practice, so we store them inline.
+    #[deftly(has_memory_cost(indirect_size = "0"))]
+    digest: Option<SmallVec<[u8; 20]>>,
 }
 impl Sendme {
     /// Return a new empty sendme cell
@@ -643,12 +679,18 @@ impl Sendme {
     /// This format is used on circuits with sendme authentication.
     pub fn new_tag(x: [u8; 20]) -> Self {
         Sendme {
-            digest: Some(x.into()),
+            digest: Some(SmallVec::from_buf(x)),
         }
     }
     /// Consume this cell and return its authentication tag, if any
     pub fn into_tag(self) -> Option<Vec<u8>> {
-        self.digest
+        self.digest.map(SmallVec::into_vec)
+    }
+    /// Return this cell's authentication tag, if any.
+    ///
+    /// Unlike [`Sendme::into_tag`], this doesn't allocate.
+    pub fn tag(&self) -> Option<&[u8]> {
+        self.digest.as_deref()
     }
 }
 impl Body for Sendme {
@@ -661,7 +703,7 @@ impl Body for Sendme {
                 0 => None,
                 1 => {
                     let dlen = r.take_u16()?;
-                    Some(r.take(dlen as usize)?.into())
+                    Some(SmallVec::from_slice(r.take(dlen as usize)?))
                 }
                 _ => {
                     return Err(Error::InvalidMessage("Unrecognized SENDME version.".into()));
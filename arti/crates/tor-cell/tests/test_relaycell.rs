@@ -119,6 +119,62 @@ fn test_cells() {
     assert_eq!(s, StreamId::new(0x9999));
 }
 
+#[test]
+fn test_data_body() {
+    let unparsed = |body: &str| {
+        UnparsedRelayMsg::from_singleton_body(RelayCellFormat::V0, decode(body)).unwrap()
+    };
+
+    let m = unparsed("02 0000 9999 12345678 000c 6e6565642d746f2d6b6e6f77 00000000");
+    assert_eq!(m.data_body().unwrap(), Some(&b"need-to-know"[..]));
+
+    // Not a DATA message.
+    let m = unparsed("05 0000 9999 12345678 0000");
+    assert_eq!(m.data_body().unwrap(), None);
+
+    // Same errors as the general decoder.
+    let m = unparsed("02 0000 9999 12345678 01f3 6e6565642d746f2d6b6e6f77 00000000");
+    assert_eq!(
+        m.data_body().err(),
+        Some(Error::InvalidMessage(
+            "Insufficient data in relay cell".into()
+        ))
+    );
+    let m = unparsed("02 0000 9999 12345678 0000");
+    assert_eq!(
+        m.data_body().err(),
+        Some(Error::InvalidMessage("Empty DATA message".into()))
+    );
+}
+
+#[test]
+fn test_encode_into() {
+    let id = StreamId::new(0x9999).unwrap();
+    let expected = decode("02 0000 9999 00000000 000c 6e6565642d746f2d6b6e6f77 00000000");
+
+    // A reused buffer is overwritten entirely, padding included.
+    let mut body = [0x77_u8; CELL_BODY_LEN];
+    let n = msg::Data::encode_into(id, b"need-to-know", &mut BadRng, &mut body).unwrap();
+    assert_eq!(n, 12);
+    assert_eq!(&body[..], &expected[..]);
+
+    let mut body = [0x77_u8; CELL_BODY_LEN];
+    let data = msg::Data::new(b"need-to-know").unwrap();
+    AnyRelayMsgOuter::new(Some(id), data.into())
+        .encode_into(&mut BadRng, &mut body)
+        .unwrap();
+    assert_eq!(&body[..], &expected[..]);
+
+    // Only as much as fits goes in.
+    let long = [0x5a_u8; msg::Data::MAXLEN + 10];
+    let n = msg::Data::encode_into(id, &long, &mut BadRng, &mut body).unwrap();
+    assert_eq!(n, msg::Data::MAXLEN);
+    let m = UnparsedRelayMsg::from_singleton_body(RelayCellFormat::V0, Box::new(body)).unwrap();
+    assert_eq!(m.data_body().unwrap(), Some(&long[..msg::Data::MAXLEN]));
+
+    assert!(msg::Data::encode_into(id, b"", &mut BadRng, &mut body).is_err());
+}
+
 #[test]
 fn test_streamid() {
     let zero: Option<StreamId> = StreamId::new(0);
@@ -10,7 +10,9 @@ use std::time::Instant;
 
 use async_trait::async_trait;
 use educe::Educe;
-use futures::{AsyncRead, AsyncWrite};
+use futures::future::{self, FutureExt as _};
+use futures::stream::{FuturesUnordered, StreamExt as _};
+use futures::{select_biased, AsyncRead, AsyncWrite};
 use itertools::Itertools;
 use rand::Rng;
 use tor_bytes::Writeable;
@@ -24,7 +26,6 @@ use tor_proto::circuit::handshake::hs_ntor;
 use tracing::{debug, trace};
 
 use retry_error::RetryError;
-use safelog::Sensitive;
 use tor_cell::relaycell::hs::{
     AuthKeyType, EstablishRendezvous, IntroduceAck, RendezvousEstablished,
 };
@@ -35,15 +36,16 @@ use tor_circmgr::timeouts::Action as TimeoutsAction;
 use tor_dirclient::request::Requestable as _;
 use tor_error::{internal, into_internal};
 use tor_error::{HasRetryTime as _, RetryTime};
-use tor_hscrypto::pk::{HsBlindId, HsId, HsIdKey};
+use tor_hscrypto::pk::{HsBlindId, HsId};
 use tor_hscrypto::RendCookie;
 use tor_linkspec::{CircTarget, HasRelayIds, OwnedCircTarget, RelayId};
-use tor_llcrypto::pk::ed25519::Ed25519Identity;
 use tor_netdir::{NetDir, Relay};
 use tor_netdoc::doc::hsdesc::{HsDesc, IntroPointDesc};
 use tor_proto::circuit::{CircParameters, ClientCirc, MetaCellDisposition, MsgHandler};
 use tor_rtcompat::{Runtime, SleepProviderExt as _, TimeoutError};
 
+use crate::hedging::{self, HsDescFetchHedging};
+use crate::keycache;
 use crate::pow::HsPowClient;
 use crate::proto_oneshot;
 use crate::relay_info::ipt_to_circtarget;
@@ -365,17 +367,7 @@ impl<'c, R: Runtime, M: MocksForConnect<R>> Context<'c, R, M> {
         secret_keys: HsClientSecretKeys,
         mocks: M,
     ) -> Result<Self, ConnError> {
-        let time_period = netdir.hs_time_period();
-        let (hs_blind_id_key, subcredential) = HsIdKey::try_from(hsid)
-            .map_err(|_| CE::InvalidHsId)?
-            .compute_blinded_key(time_period)
-            .map_err(
-                // TODO HS what on earth do these errors mean, in practical terms ?
-                // In particular, we'll want to convert them to a ConnError variant,
-                // but what ErrorKind should they have ?
-                into_internal!("key blinding error, don't know how to handle"),
-            )?;
-        let hs_blind_id = hs_blind_id_key.id();
+        let (hs_blind_id, subcredential) = keycache::blinded_id(hsid, netdir.hs_time_period())?;
 
         Ok(Context {
             netdir,
@@ -468,9 +460,9 @@ impl<'c, R: Runtime, M: MocksForConnect<R>> Context<'c, R, M> {
             // Seems to be not valid now.  Try to fetch a fresh one.
         }
 
-        let hs_dirs = self.netdir.hs_dirs_download(
+        let hs_dirs = keycache::hs_dirs_download(
+            &self.netdir,
             self.hs_blind_id,
-            self.netdir.hs_time_period(),
             &mut self.mocks.thread_rng(),
         )?;
 
@@ -486,39 +478,75 @@ impl<'c, R: Runtime, M: MocksForConnect<R>> Context<'c, R, M> {
         //   https://gitlab.torproject.org/tpo/core/arti/-/issues/913#note_2914436
         // (Additionally, making multiple HSDir requests at once may make us
         // more vulnerable to traffic analysis.)
-        let mut attempts = hs_dirs.iter().cycle().take(max_total_attempts);
+        // So by default we only do so if asked to, via HsDescFetchHedging.
+        // Then, we query another HsDir whenever the requests in flight have
+        // taken longer than fetches usually do, and take the first good answer.
+        // We go round the HsDirs in order, but never ask one that is still
+        // working on an earlier request.
+        let parallel = HsDescFetchHedging::get().min(hs_dirs.len());
+        let hedge_delay = hedging::hedge_delay(each_timeout);
+        let mut attempts = HsDirAttempts {
+            hs_dirs: &hs_dirs,
+            next: 0,
+            left: max_total_attempts,
+            asking: Vec::new(),
+        };
+        let mut in_flight = FuturesUnordered::new();
         let mut errors = RetryError::in_attempt_to("retrieve hidden service descriptor");
         let desc = loop {
-            let relay = match attempts.next() {
-                Some(relay) => relay,
-                None => {
-                    return Err(if errors.is_empty() {
-                        CE::NoHsDirs
-                    } else {
-                        CE::DescriptorDownload(errors)
-                    })
+            if in_flight.is_empty() {
+                match attempts.next() {
+                    Some(relay) => {
+                        in_flight.push(self.descriptor_fetch_timed(relay, each_timeout));
+                    }
+                    None => {
+                        return Err(if errors.is_empty() {
+                            CE::NoHsDirs
+                        } else {
+                            CE::DescriptorDownload(errors)
+                        })
+                    }
                 }
-            };
-            let hsdir_for_error: Sensitive<Ed25519Identity> = (*relay.id()).into();
-            match self
-                .runtime
-                .timeout(each_timeout, self.descriptor_fetch_attempt(relay))
-                .await
-                .unwrap_or(Err(DescriptorErrorDetail::Timeout))
-            {
-                Ok(desc) => break desc,
-                Err(error) => {
-                    debug_report!(
-                        &error,
-                        "failed hsdir desc fetch for {} from {}",
-                        &self.hsid,
-                        &relay.id(),
-                    );
-                    errors.push(tor_error::Report(DescriptorError {
-                        hsdir: hsdir_for_error,
-                        error,
-                    }));
+            }
+
+            let can_hedge = in_flight.len() < parallel && attempts.left > 0;
+            let hedge = async {
+                if can_hedge {
+                    self.runtime.sleep(hedge_delay).await;
+                } else {
+                    future::pending::<()>().await;
                 }
+            };
+
+            select_biased! {
+                (relay, result) = in_flight.select_next_some() => match result {
+                    // Dropping `in_flight` cancels any other outstanding requests.
+                    Ok(desc) => break desc,
+                    Err(error) => {
+                        attempts.finished(relay);
+                        debug_report!(
+                            &error,
+                            "failed hsdir desc fetch for {} from {}",
+                            &self.hsid,
+                            &relay.id(),
+                        );
+                        errors.push(tor_error::Report(DescriptorError {
+                            hsdir: (*relay.id()).into(),
+                            error,
+                        }));
+                    }
+                },
+                () = hedge.fuse() => {
+                    if let Some(relay) = attempts.next() {
+                        debug!(
+                            "HS desc fetch for {} slow after {:?}, also asking {}",
+                            &self.hsid,
+                            hedge_delay,
+                            &relay.id(),
+                        );
+                        in_flight.push(self.descriptor_fetch_timed(relay, each_timeout));
+                    }
+                },
             }
         };
 
@@ -535,6 +563,35 @@ impl<'c, R: Runtime, M: MocksForConnect<R>> Context<'c, R, M> {
         Ok(ret.as_ref().dangerously_assume_timely())
     }
 
+    /// Make one attempt to fetch the descriptor from a specific hsdir, within `timeout`
+    ///
+    /// Returns `hsdir` along with the outcome. For [`hedging::hedge_delay`],
+    /// records how long a successful fetch took, or `timeout` if the fetch
+    /// timed out, so that unresponsive HsDirs count too.
+    async fn descriptor_fetch_timed<'h, 'r>(
+        &self,
+        hsdir: &'h Relay<'r>,
+        timeout: Duration,
+    ) -> (
+        &'h Relay<'r>,
+        Result<TimerangeBound<HsDesc>, DescriptorErrorDetail>,
+    ) {
+        let started = self.runtime.now();
+        let result = self
+            .runtime
+            .timeout(timeout, self.descriptor_fetch_attempt(hsdir))
+            .await
+            .unwrap_or(Err(DescriptorErrorDetail::Timeout));
+        match &result {
+            Ok(_) => {
+                hedging::note_fetch_latency(self.runtime.now().saturating_duration_since(started));
+            }
+            Err(DescriptorErrorDetail::Timeout) => hedging::note_fetch_latency(timeout),
+            Err(_) => {}
+        }
+        (hsdir, result)
+    }
+
     /// Make one attempt to fetch the descriptor from a specific hsdir
     ///
     /// No timeout
@@ -1330,6 +1387,47 @@ impl<'c, R: Runtime, M: MocksForConnect<R>> Context<'c, R, M> {
     }
 }
 
+/// The HsDirs to ask for a descriptor, in turn, within an attempt budget
+struct HsDirAttempts<'h, 'r> {
+    /// Every HsDir we may ask, in the order to ask them
+    hs_dirs: &'h [Relay<'r>],
+    /// Index in `hs_dirs` of the HsDir to ask next, if it's free
+    next: usize,
+    /// Number of requests we may still make
+    left: usize,
+    /// HsDirs with a request outstanding
+    asking: Vec<&'h Relay<'r>>,
+}
+
+impl<'h, 'r> HsDirAttempts<'h, 'r> {
+    /// Return the next HsDir to ask, and count the request against our budget
+    ///
+    /// Skips any HsDir that is still working on an earlier request; returns
+    /// `None` if every HsDir is, or if the budget is spent.
+    fn next(&mut self) -> Option<&'h Relay<'r>> {
+        if self.left == 0 {
+            return None;
+        }
+        let n_dirs = self.hs_dirs.len();
+        let index = (0..n_dirs)
+            .map(|offset| (self.next + offset) % n_dirs)
+            .find(|&i| {
+                let id = self.hs_dirs[i].id();
+                !self.asking.iter().any(|relay| relay.id() == id)
+            })?;
+        let relay = &self.hs_dirs[index];
+        self.next = (index + 1) % n_dirs;
+        self.left -= 1;
+        self.asking.push(relay);
+        Some(relay)
+    }
+
+    /// Note that the request to `relay` has finished, so it may be asked again
+    fn finished(&mut self, relay: &Relay<'_>) {
+        self.asking.retain(|asking| asking.id() != relay.id());
+    }
+}
+
 /// Mocks used for testing `connect.rs`
 ///
 /// This is different to `MockableConnectorData`,
@@ -1519,7 +1617,7 @@ mod test {
     use tokio_crate as tokio;
     use tor_async_utils::JoinReadWrite;
     use tor_basic_utils::test_rng::{testing_rng, TestingRng};
-    use tor_hscrypto::pk::{HsClientDescEncKey, HsClientDescEncKeypair};
+    use tor_hscrypto::pk::{HsClientDescEncKey, HsClientDescEncKeypair, HsIdKey};
     use tor_llcrypto::pk::curve25519;
     use tor_netdoc::doc::{hsdesc::test_data, netstatus::Lifetime};
     use tor_rtcompat::tokio::TokioNativeTlsRuntime;
@@ -1719,6 +1817,42 @@ mod test {
         // TODO HS TESTS: continue with this
     }
 
+    #[test]
+    fn hs_dir_attempts() {
+        let netdir = tor_netdir::testnet::construct_netdir()
+            .unwrap_if_sufficient()
+            .unwrap();
+        let hs_dirs: Vec<_> = netdir.relays().take(3).collect();
+        let mut attempts = HsDirAttempts {
+            hs_dirs: &hs_dirs,
+            next: 0,
+            left: 5,
+            asking: Vec::new(),
+        };
+        let id = |relay: Option<&Relay<'_>>| relay.map(|r| *r.id());
+        let dir = |i: usize| Some(*hs_dirs[i].id());
+
+        // Hedge twice: each request goes to a different HsDir.
+        assert_eq!(id(attempts.next()), dir(0));
+        assert_eq!(id(attempts.next()), dir(1));
+        assert_eq!(id(attempts.next()), dir(2));
+        assert!(attempts.next().is_none());
+        assert_eq!(attempts.left, 2);
+
+        // Once HsDir 1 gives up, we can ask it again, but not HsDir 0,
+        // whose turn it would be.
+        attempts.finished(&hs_dirs[1]);
+        assert_eq!(id(attempts.next()), dir(1));
+        attempts.finished(&hs_dirs[0]);
+        attempts.finished(&hs_dirs[2]);
+        assert_eq!(id(attempts.next()), dir(2));
+
+        // That was our last attempt.
+        attempts.finished(&hs_dirs[2]);
+        assert_eq!(attempts.left, 0);
+        assert!(attempts.next().is_none());
+    }
+
     // TODO HS TESTS: Test IPT state management and expiry:
     //   - obtain a test descriptor with only a broken ipt
     //     (broken in the sense that intro can be attempted, but will fail somehow)
@@ -0,0 +1,111 @@
+//! Hedged onion service descriptor fetches
+//!
+//! By default we ask one HsDir at a time for a descriptor, as C Tor does, so
+//! an unresponsive HsDir costs a whole fetch timeout before we move on. With
+//! hedging enabled we also ask another HsDir whenever the outstanding
+//! requests have been running for longer than fetches usually take, and use
+//! whichever valid descriptor arrives first.
+
+use std::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+use std::time::Duration;
+
+/// Number of HsDirs to query at once per descriptor fetch
+static PARALLEL_FETCHES: AtomicUsize = AtomicUsize::new(1);
+
+/// Smoothed duration of descriptor fetches in milliseconds, or 0 if unknown
+///
+/// A fetch that timed out counts as taking its whole timeout.
+static FETCH_LATENCY_MS: AtomicU64 = AtomicU64::new(0);
+
+/// Shortest delay before querying another HsDir
+///
+/// Below this, hedging would mostly just double our requests.
+const MIN_HEDGE_DELAY: Duration = Duration::from_millis(250);
+
+/// Process-wide setting for hedged descriptor fetches
+///
+/// Querying several HsDirs at once cuts the tail latency of descriptor
+/// fetches, at the cost of extra load on HsDirs and of making our
+/// fetches easier to spot. It is off (one HsDir at a time) by default.
+pub struct HsDescFetchHedging;
+
+impl HsDescFetchHedging {
+    /// The most HsDirs that can be queried at once for one descriptor
+    pub const MAX_PARALLEL: usize = 3;
+
+    /// Query up to `parallel` HsDirs at once, within `1..=MAX_PARALLEL`
+    ///
+    /// 1 turns hedging off.
+    pub fn set(parallel: usize) {
+        PARALLEL_FETCHES.store(parallel.clamp(1, Self::MAX_PARALLEL), Ordering::Relaxed);
+    }
+
+    /// Return the number of HsDirs to query at once
+    pub fn get() -> usize {
+        PARALLEL_FETCHES.load(Ordering::Relaxed)
+    }
+}
+
+/// Record how long a descriptor fetch took, or its timeout if it timed out.
+pub(crate) fn note_fetch_latency(elapsed: Duration) {
+    let sample = u64::try_from(elapsed.as_millis())
+        .unwrap_or(u64::MAX)
+        .max(1);
+    let _ = FETCH_LATENCY_MS.fetch_update(Ordering::Relaxed, Ordering::Relaxed, |old| {
+        // Exponentially weighted moving average, with weight 1/8 for new samples.
+        Some(match old {
+            0 => sample,
+            old => old - old / 8 + sample / 8,
+        })
+    });
+}
+
+/// Return how long to wait on outstanding fetches before querying another HsDir.
+///
+/// This is twice the usual fetch latency, or a quarter of `each_timeout`
+/// before we have seen any fetch finish, and never more than `each_timeout`.
+pub(crate) fn hedge_delay(each_timeout: Duration) -> Duration {
+    let delay = match FETCH_LATENCY_MS.load(Ordering::Relaxed) {
+        0 => each_timeout / 4,
+        ms => Duration::from_millis(ms.saturating_mul(2)),
+    };
+    delay.max(MIN_HEDGE_DELAY).min(each_timeout)
+}
+
+#[cfg(test)]
+mod test {
+    // @@ begin test lint list maintained by maint/add_warning @@
+    #![allow(clippy::bool_assert_comparison)]
+    #![allow(clippy::clone_on_copy)]
+    #![allow(clippy::dbg_macro)]
+    #![allow(clippy::mixed_attributes_style)]
+    #![allow(clippy::print_stderr)]
+    #![allow(clippy::print_stdout)]
+    #![allow(clippy::single_char_pattern)]
+    #![allow(clippy::unwrap_used)]
+    #![allow(clippy::unchecked_duration_subtraction)]
+    #![allow(clippy::useless_vec)]
+    #![allow(clippy::needless_pass_by_value)]
+    //! <!-- @@ end test lint list maintained by maint/add_warning @@ -->
+
+    use super::*;
+
+    #[test]
+    fn delay_follows_latency() {
+        let each_timeout = Duration::from_secs(30);
+        for _ in 0..64 {
+            note_fetch_latency(Duration::from_secs(2));
+        }
+        let delay = hedge_delay(each_timeout);
+        assert!(delay > Duration::from_secs(2) && delay < Duration::from_secs(5));
+
+        for _ in 0..64 {
+            note_fetch_latency(Duration::from_secs(60));
+        }
+        assert_eq!(hedge_delay(each_timeout), each_timeout);
+        assert_eq!(
+            hedge_delay(Duration::from_millis(10)),
+            Duration::from_millis(10)
+        );
+    }
+}
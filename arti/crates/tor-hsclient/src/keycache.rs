@@ -0,0 +1,343 @@
+//! Process-wide cache of blinded onion service keys and their HsDirs
+//!
+//! Every connection to an onion service needs the service's blinded key for
+//! the current time period (an ed25519 scalar multiplication), and every
+//! descriptor fetch needs the HsDirs responsible for that blinded key (a
+//! handful of SHA3 hashes and ring searches). Both are pure functions of
+//! their inputs, so we remember them: blinded keys until the time period
+//! changes, and HsDir lists for as long as the [`NetDir`] they were computed
+//! from is in use.
+
+use std::collections::HashMap;
+use std::sync::{Arc, Mutex, OnceLock, Weak};
+
+use rand::seq::SliceRandom as _;
+use rand::Rng;
+use tor_error::{into_internal, Bug};
+use tor_hscrypto::pk::{HsBlindId, HsId, HsIdKey};
+use tor_hscrypto::time::TimePeriod;
+use tor_hscrypto::Subcredential;
+use tor_linkspec::RelayIds;
+use tor_netdir::{NetDir, Relay};
+
+use crate::ConnError;
+
+/// Upper bound on the number of entries in each of the cache's maps
+///
+/// Reaching it simply empties that map; a caller visiting this many
+/// distinct services within one time period gains little from the cache.
+const MAX_ENTRIES: usize = 100_000;
+
+/// Most directories we keep HsDir lists for at once
+///
+/// Several can be in use at a time, say while callers holding an old one
+/// finish up after a new consensus arrives; switching between them must
+/// not throw away the others' entries.
+const MAX_NETDIRS: usize = 4;
+
+/// Contents of the process-wide cache
+#[derive(Default)]
+struct Cache {
+    /// Time period that `blinded` was computed for
+    period: Option<TimePeriod>,
+    /// Blinded identity and subcredential of each service, for `period`
+    blinded: HashMap<HsId, (HsBlindId, Subcredential)>,
+    /// Responsible HsDirs for each blinded identity, by the directory they
+    /// were computed from, oldest directory first
+    hs_dirs: Vec<(Weak<NetDir>, HashMap<HsBlindId, Vec<RelayIds>>)>,
+}
+
+impl Cache {
+    /// Look up a blinded identity computed for `period`.
+    fn blinded(&self, hsid: &HsId, period: TimePeriod) -> Option<(HsBlindId, Subcredential)> {
+        if self.period != Some(period) {
+            return None;
+        }
+        self.blinded.get(hsid).copied()
+    }
+
+    /// Remember a blinded identity computed for `period`.
+    fn insert_blinded(
+        &mut self,
+        hsid: HsId,
+        period: TimePeriod,
+        value: (HsBlindId, Subcredential),
+    ) {
+        if self.period != Some(period) || self.blinded.len() >= MAX_ENTRIES {
+            self.period = Some(period);
+            self.blinded.clear();
+        }
+        self.blinded.insert(hsid, value);
+    }
+
+    /// Look up the HsDirs for `hs_blind_id` computed from `netdir`.
+    fn hs_dirs(&self, netdir: &Arc<NetDir>, hs_blind_id: &HsBlindId) -> Option<&[RelayIds]> {
+        self.hs_dirs
+            .iter()
+            .find(|(dir, _)| std::ptr::eq(dir.as_ptr(), Arc::as_ptr(netdir)))?
+            .1
+            .get(hs_blind_id)
+            .map(Vec::as_slice)
+    }
+
+    /// Remember the HsDirs for `hs_blind_id` computed from `netdir`.
+    fn insert_hs_dirs(&mut self, netdir: &Arc<NetDir>, hs_blind_id: HsBlindId, ids: Vec<RelayIds>) {
+        let pos = self
+            .hs_dirs
+            .iter()
+            .position(|(dir, _)| std::ptr::eq(dir.as_ptr(), Arc::as_ptr(netdir)));
+        let pos = match pos {
+            Some(pos) => pos,
+            None => {
+                // Directories nobody holds any more can't be looked up again.
+                self.hs_dirs.retain(|(dir, _)| dir.strong_count() > 0);
+                if self.hs_dirs.len() >= MAX_NETDIRS {
+                    self.hs_dirs.remove(0);
+                }
+                self.hs_dirs.push((Arc::downgrade(netdir), HashMap::new()));
+                self.hs_dirs.len() - 1
+            }
+        };
+        let hs_dirs = &mut self.hs_dirs[pos].1;
+        if hs_dirs.len() >= MAX_ENTRIES {
+            hs_dirs.clear();
+        }
+        hs_dirs.insert(hs_blind_id, ids);
+    }
+}
+
+/// Return the process-wide cache.
+fn cache() -> &'static Mutex<Cache> {
+    /// The cache itself, created on first use
+    static CACHE: OnceLock<Mutex<Cache>> = OnceLock::new();
+    CACHE.get_or_init(Default::default)
+}
+
+/// Compute the blinded identity and subcredential of `hsid` for `period`.
+fn compute_blinded(
+    hsid: HsId,
+    period: TimePeriod,
+) -> Result<(HsBlindId, Subcredential), ConnError> {
+    let (hs_blind_id_key, subcredential) = HsIdKey::try_from(hsid)
+        .map_err(|_| ConnError::InvalidHsId)?
+        .compute_blinded_key(period)
+        .map_err(
+            // TODO HS what on earth do these errors mean, in practical terms ?
+            // In particular, we'll want to convert them to a ConnError variant,
+            // but what ErrorKind should they have ?
+            into_internal!("key blinding error, don't know how to handle"),
+        )?;
+    Ok((hs_blind_id_key.id(), subcredential))
+}
+
+/// Compute the responsible HsDirs for `hs_blind_id`.
+fn compute_hs_dirs(netdir: &NetDir, hs_blind_id: HsBlindId) -> Result<Vec<RelayIds>, Bug> {
+    // The order doesn't matter, since every download shuffles it again.
+    Ok(netdir
+        .hs_dirs_download(
+            hs_blind_id,
+            netdir.hs_time_period(),
+            &mut rand::thread_rng(),
+        )?
+        .iter()
+        .map(RelayIds::from_relay_ids)
+        .collect())
+}
+
+/// Return the blinded identity and subcredential of `hsid` for `period`.
+pub(crate) fn blinded_id(
+    hsid: HsId,
+    period: TimePeriod,
+) -> Result<(HsBlindId, Subcredential), ConnError> {
+    if let Some(value) = cache()
+        .lock()
+        .expect("poisoned lock")
+        .blinded(&hsid, period)
+    {
+        return Ok(value);
+    }
+    let value = compute_blinded(hsid, period)?;
+    cache()
+        .lock()
+        .expect("poisoned lock")
+        .insert_blinded(hsid, period, value);
+    Ok(value)
+}
+
+/// Return the HsDirs to download the descriptor for `hs_blind_id` from, in random order.
+///
+/// Equivalent to [`NetDir::hs_dirs_download`] for the current time period.
+pub(crate) fn hs_dirs_download<'r, R: Rng>(
+    netdir: &'r Arc<NetDir>,
+    hs_blind_id: HsBlindId,
+    rng: &mut R,
+) -> Result<Vec<Relay<'r>>, Bug> {
+    let cached: Option<Vec<Relay<'r>>> = cache()
+        .lock()
+        .expect("poisoned lock")
+        .hs_dirs(netdir, &hs_blind_id)
+        .and_then(|ids| ids.iter().map(|ids| netdir.by_ids(ids)).collect());
+    let mut relays = match cached {
+        Some(relays) => relays,
+        None => {
+            let ids = compute_hs_dirs(netdir, hs_blind_id)?;
+            let relays = ids.iter().filter_map(|ids| netdir.by_ids(ids)).collect();
+            cache()
+                .lock()
+                .expect("poisoned lock")
+                .insert_hs_dirs(netdir, hs_blind_id, ids);
+            relays
+        }
+    };
+    relays.shuffle(rng);
+    Ok(relays)
+}
+
+/// Process-wide cache of blinded onion service keys and responsible HsDirs
+///
+/// Connections fill this cache as they go. Callers that know ahead of time
+/// which services they will visit can fill it in bulk with
+/// [`HsKeyCache::precompute`].
+pub struct HsKeyCache;
+
+impl HsKeyCache {
+    /// Compute and cache blinded keys and HsDirs for `hsids` against `netdir`.
+    ///
+    /// The work is spread across one thread per core. Returns the number of
+    /// services that were cached successfully.
+    pub fn precompute(netdir: &Arc<NetDir>, hsids: &[HsId]) -> usize {
+        let period = netdir.hs_time_period();
+        let threads = std::thread::available_parallelism().map_or(1, |n| n.get());
+        let chunk_size = hsids.len().div_ceil(threads).max(1);
+
+        let results: Vec<_> = std::thread::scope(|scope| {
+            let workers: Vec<_> = hsids
+                .chunks(chunk_size)
+                .map(|chunk| {
+                    scope.spawn(move || {
+                        chunk
+                            .iter()
+                            .filter_map(|hsid| {
+                                let blinded = compute_blinded(*hsid, period).ok()?;
+                                let hs_dirs = compute_hs_dirs(netdir, blinded.0).ok()?;
+                                Some((*hsid, blinded, hs_dirs))
+                            })
+                            .collect::<Vec<_>>()
+                    })
+                })
+                .collect();
+            workers
+                .into_iter()
+                .flat_map(|worker| worker.join().unwrap_or_default())
+                .collect()
+        });
+
+        let mut cache = cache().lock().expect("poisoned lock");
+        let count = results.len();
+        for (hsid, blinded, hs_dirs) in results {
+            cache.insert_blinded(hsid, period, blinded);
+            cache.insert_hs_dirs(netdir, blinded.0, hs_dirs);
+        }
+        count
+    }
+
+    /// Forget everything in the cache.
+    pub fn clear() {
+        *cache().lock().expect("poisoned lock") = Default::default();
+    }
+}
+
+#[cfg(test)]
+mod test {
+    // @@ begin test lint list maintained by maint/add_warning @@
+    #![allow(clippy::bool_assert_comparison)]
+    #![allow(clippy::clone_on_copy)]
+    #![allow(clippy::dbg_macro)]
+    #![allow(clippy::mixed_attributes_style)]
+    #![allow(clippy::print_stderr)]
+    #![allow(clippy::print_stdout)]
+    #![allow(clippy::single_char_pattern)]
+    #![allow(clippy::unwrap_used)]
+    #![allow(clippy::unchecked_duration_subtraction)]
+    #![allow(clippy::useless_vec)]
+    #![allow(clippy::needless_pass_by_value)]
+    //! <!-- @@ end test lint list maintained by maint/add_warning @@ -->
+
+    use super::*;
+    use itertools::Itertools;
+    use tor_basic_utils::test_rng::testing_rng;
+    use tor_llcrypto::pk::ed25519::Ed25519Identity;
+    use tor_netdoc::doc::hsdesc::test_data;
+
+    fn netdir() -> Arc<NetDir> {
+        let netdir = tor_netdir::testnet::construct_netdir()
+            .unwrap_if_sufficient()
+            .unwrap();
+        Arc::new(netdir)
+    }
+
+    fn sorted_ids(relays: &[Relay<'_>]) -> Vec<Ed25519Identity> {
+        relays.iter().map(|r| *r.id()).sorted().collect()
+    }
+
+    #[test]
+    fn matches_uncached() {
+        let netdir = netdir();
+        let hsid: HsId = test_data::TEST_HSID_2.into();
+        let period = netdir.hs_time_period();
+
+        let (blind_id, _) = HsIdKey::try_from(hsid)
+            .unwrap()
+            .compute_blinded_key(period)
+            .unwrap();
+        let expected = netdir
+            .hs_dirs_download(blind_id.id(), period, &mut testing_rng())
+            .unwrap();
+
+        HsKeyCache::clear();
+        assert_eq!(HsKeyCache::precompute(&netdir, &[hsid]), 1);
+        for _ in 0..2 {
+            let (cached_id, _) = blinded_id(hsid, period).unwrap();
+            assert_eq!(cached_id, blind_id.id());
+            let relays = hs_dirs_download(&netdir, cached_id, &mut testing_rng()).unwrap();
+            assert_eq!(sorted_ids(&relays), sorted_ids(&expected));
+        }
+
+        // A different directory must not see the old one's HsDirs, and
+        // caching its own must not evict the old one's.
+        let other = self::netdir();
+        let mut cache = cache().lock().unwrap();
+        assert!(cache.hs_dirs(&other, &blind_id.id()).is_none());
+        let other_ids = compute_hs_dirs(&other, blind_id.id()).unwrap();
+        cache.insert_hs_dirs(&other, blind_id.id(), other_ids);
+        assert!(cache.hs_dirs(&other, &blind_id.id()).is_some());
+        assert!(cache.hs_dirs(&netdir, &blind_id.id()).is_some());
+    }
+
+    #[test]
+    fn netdirs_bounded() {
+        let hsid: HsId = test_data::TEST_HSID_2.into();
+        let netdirs: Vec<_> = (0..=MAX_NETDIRS).map(|_| netdir()).collect();
+        let (blind_id, _) = compute_blinded(hsid, netdirs[0].hs_time_period()).unwrap();
+        let ids = compute_hs_dirs(&netdirs[0], blind_id).unwrap();
+
+        let mut cache = Cache::default();
+        for netdir in &netdirs {
+            cache.insert_hs_dirs(netdir, blind_id, ids.clone());
+        }
+        // The oldest directory made way for the newest.
+        assert_eq!(cache.hs_dirs.len(), MAX_NETDIRS);
+        assert!(cache.hs_dirs(&netdirs[0], &blind_id).is_none());
+        assert!(cache.hs_dirs(&netdirs[MAX_NETDIRS], &blind_id).is_some());
+
+        // A directory nobody holds is dropped before any live one.
+        let mut netdirs = netdirs;
+        drop(netdirs.remove(1));
+        let newest = netdir();
+        cache.insert_hs_dirs(&newest, blind_id, ids);
+        assert_eq!(cache.hs_dirs.len(), MAX_NETDIRS);
+        for netdir in netdirs.iter().skip(1) {
+            assert!(cache.hs_dirs(netdir, &blind_id).is_some());
+        }
+    }
+}
@@ -45,7 +45,9 @@
 
 mod connect;
 mod err;
+mod hedging;
 mod isol_map;
+mod keycache;
 mod keys;
 mod pow;
 mod proto_oneshot;
@@ -72,7 +74,10 @@ use tor_rtcompat::Runtime;
 
 pub use err::FailedAttemptError;
 pub use err::{ConnError, DescriptorError, DescriptorErrorDetail, StartupError};
+pub use hedging::HsDescFetchHedging;
+pub use keycache::HsKeyCache;
 pub use keys::{HsClientDescEncKeypairSpecifier, HsClientSecretKeys, HsClientSecretKeysBuilder};
+pub use pow::PowSolverThreads;
 pub use relay_info::InvalidTarget;
 pub use state::HsClientConnectorConfig;
 
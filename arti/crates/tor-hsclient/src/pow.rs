@@ -4,12 +4,34 @@
 mod v1;
 
 use crate::err::ProofOfWorkError;
+use std::sync::atomic::{AtomicUsize, Ordering};
 use tor_cell::relaycell::hs::pow::ProofOfWork;
 use tor_hscrypto::pk::HsBlindId;
 use tor_netdoc::doc::hsdesc::pow::PowParams;
 use tor_netdoc::doc::hsdesc::HsDesc;
 use v1::HsPowClientV1;
 
+/// Number of threads to solve each proof of work puzzle on, or 0 for one per core.
+static POW_SOLVER_THREADS: AtomicUsize = AtomicUsize::new(0);
+
+/// Process-wide thread budget for solving onion service proof of work puzzles
+pub struct PowSolverThreads;
+
+impl PowSolverThreads {
+    /// Solve each puzzle on `threads` threads, or on one per core if 0
+    pub fn set(threads: usize) {
+        POW_SOLVER_THREADS.store(threads, Ordering::Relaxed);
+    }
+
+    /// Return the number of threads to solve each puzzle on
+    pub fn get() -> usize {
+        match POW_SOLVER_THREADS.load(Ordering::Relaxed) {
+            0 => std::thread::available_parallelism().map_or(1, |n| n.get()),
+            n => n,
+        }
+    }
+}
+
 /// Client-side state for a series of connection attempts that might use proof-of-work.
 ///
 /// The `HsPowClient` can be initialized using a recent `HsDesc`, at which point
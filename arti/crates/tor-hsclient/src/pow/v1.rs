@@ -1,14 +1,17 @@
 //! Client support for the `v1` onion service proof of work scheme
 
 use crate::err::ProofOfWorkError;
+use crate::pow::PowSolverThreads;
 use rand::thread_rng;
+use std::sync::{Arc, Mutex};
+use std::thread::JoinHandle;
 use std::time::Instant;
 use tor_async_utils::oneshot;
 use tor_async_utils::oneshot::Canceled;
 use tor_cell::relaycell::hs::pow::v1::ProofOfWorkV1;
 use tor_checkable::{timed::TimerangeBound, Timebound};
 use tor_hscrypto::pk::HsBlindId;
-use tor_hscrypto::pow::v1::{Effort, Instance, SolverInput};
+use tor_hscrypto::pow::v1::{Effort, Instance, RuntimeErrorV1, Solution, SolverInput};
 use tor_netdoc::doc::hsdesc::pow::v1::PowParamsV1;
 use tracing::debug;
 
@@ -80,7 +83,9 @@ impl HsPowClientV1 {
         self.effort = effort.clamp(CLIENT_MIN_RETRY_POW_EFFORT, CLIENT_MAX_POW_EFFORT);
     }
 
-    /// Run the `v1` solver on a thread, if the effort is nonzero
+    /// Run the `v1` solver on [`PowSolverThreads`] threads, if the effort is nonzero
+    ///
+    /// See [`spawn_solvers`].
     ///
     /// Returns None if the effort was zero.
     /// Returns an Err() if the solver experienced a runtime error,
@@ -94,24 +99,12 @@ impl HsPowClientV1 {
         // TODO: config option
         input.runtime(Default::default());
 
+        let threads = PowSolverThreads::get();
         let start_time = Instant::now();
-        debug!("beginning solve, {:?}", self.effort);
-
-        let (result_sender, result_receiver) = oneshot::channel();
-        std::thread::spawn(move || {
-            let mut solver = input.solve(&mut thread_rng());
-            let result = loop {
-                match solver.run_step() {
-                    Err(e) => break Err(e),
-                    Ok(Some(result)) => break Ok(result),
-                    Ok(None) => (),
-                }
-                if result_sender.is_canceled() {
-                    return;
-                }
-            };
-            let _ = result_sender.send(result);
-        });
+        debug!("beginning solve, {:?} on {} threads", self.effort, threads);
+
+        // The threads run detached.
+        let (result_receiver, _) = spawn_solvers(&input, threads);
 
         let result = match result_receiver.await {
             Ok(Ok(solution)) => Ok(Some(ProofOfWorkV1::new(
@@ -135,3 +128,118 @@ impl HsPowClientV1 {
         result
     }
 }
+
+/// Solve `input` on `threads` threads, and return a receiver for the first
+/// result along with the threads' handles
+///
+/// Each thread searches from its own random nonce with its own solver
+/// memory. The first to find a proof (or fail) wins, and the rest stop
+/// at their next step. They also stop once the receiver is dropped.
+fn spawn_solvers(
+    input: &SolverInput,
+    threads: usize,
+) -> (
+    oneshot::Receiver<Result<Solution, RuntimeErrorV1>>,
+    Vec<JoinHandle<()>>,
+) {
+    let (result_sender, result_receiver) = oneshot::channel();
+    // Taken by whichever thread finishes first.
+    let result_sender = Arc::new(Mutex::new(Some(result_sender)));
+    let handles = (0..threads)
+        .map(|_| {
+            let input = input.clone();
+            let result_sender = result_sender.clone();
+            std::thread::spawn(move || {
+                // Nonces are 16 random bytes, so the threads' searches won't overlap.
+                let mut solver = input.solve(&mut thread_rng());
+                let result = loop {
+                    match solver.run_step() {
+                        Err(e) => break Err(e),
+                        Ok(Some(result)) => break Ok(result),
+                        Ok(None) => (),
+                    }
+                    match &*result_sender.lock().expect("poisoned lock") {
+                        Some(sender) if !sender.is_canceled() => (),
+                        _ => return,
+                    }
+                };
+                if let Some(sender) = result_sender.lock().expect("poisoned lock").take() {
+                    debug!("solver thread finished first, {:?}", solver.timings());
+                    let _ = sender.send(result);
+                }
+            })
+        })
+        .collect();
+
+    (result_receiver, handles)
+}
+
+#[cfg(test)]
+mod test {
+    // @@ begin test lint list maintained by maint/add_warning @@
+    #![allow(clippy::bool_assert_comparison)]
+    #![allow(clippy::clone_on_copy)]
+    #![allow(clippy::dbg_macro)]
+    #![allow(clippy::mixed_attributes_style)]
+    #![allow(clippy::print_stderr)]
+    #![allow(clippy::print_stdout)]
+    #![allow(clippy::single_char_pattern)]
+    #![allow(clippy::unwrap_used)]
+    #![allow(clippy::unchecked_duration_subtraction)]
+    #![allow(clippy::useless_vec)]
+    #![allow(clippy::needless_pass_by_value)]
+    //! <!-- @@ end test lint list maintained by maint/add_warning @@ -->
+
+    use super::*;
+    use std::time::Duration;
+    use tor_hscrypto::pow::v1::Verifier;
+
+    /// Return a puzzle instance for a made-up service and seed.
+    fn instance() -> Instance {
+        Instance::new([0x11; 32].into(), [0x22; 32].into())
+    }
+
+    #[test]
+    fn solve_on_threads() {
+        PowSolverThreads::set(4);
+        let client = HsPowClientV1 {
+            instance: TimerangeBound::new(instance(), ..),
+            effort: Effort::new(8),
+        };
+
+        let proof = futures::executor::block_on(client.solve())
+            .unwrap()
+            .unwrap();
+        PowSolverThreads::set(0);
+
+        assert_eq!(proof.effort(), Effort::new(8));
+        let solution = Solution::try_from_bytes(
+            proof.nonce().clone(),
+            proof.effort(),
+            proof.seed_head(),
+            proof.solution(),
+        )
+        .unwrap();
+        Verifier::new(instance()).check(&solution).unwrap();
+    }
+
+    #[test]
+    fn workers_stop_when_abandoned() {
+        // At this effort, no thread will find a proof while the test runs.
+        let input = SolverInput::new(instance(), Effort::new(u32::MAX));
+        let (receiver, handles) = spawn_solvers(&input, 4);
+        assert_eq!(handles.len(), 4);
+        std::thread::sleep(Duration::from_millis(100));
+        assert!(handles.iter().all(|h| !h.is_finished()));
+
+        drop(receiver);
+        let deadline = Instant::now() + Duration::from_secs(10);
+        while handles.iter().any(|h| !h.is_finished()) {
+            assert!(Instant::now() < deadline, "solver threads kept running");
+            std::thread::sleep(Duration::from_millis(10));
+        }
+        for handle in handles {
+            handle.join().unwrap();
+        }
+    }
+}
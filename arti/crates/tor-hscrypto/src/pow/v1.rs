@@ -14,6 +14,6 @@ mod verify;
 
 pub use equix::{RuntimeOption, SolutionByteArray};
 pub use err::{RuntimeErrorV1, SolutionErrorV1};
-pub use solve::{Solver, SolverInput};
+pub use solve::{Solver, SolverInput, SolverTimings};
 pub use types::*;
 pub use verify::Verifier;
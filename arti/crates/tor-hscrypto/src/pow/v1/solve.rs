@@ -5,8 +5,15 @@ use crate::pow::v1::{
     err::RuntimeErrorV1, types::Effort, types::Instance, types::Nonce, types::Solution,
     types::NONCE_LEN,
 };
-use equix::{EquiXBuilder, HashError, RuntimeOption, SolverMemory};
+use equix::{EquiXBuilder, EquiXPipeline, HashError, RuntimeOption, SolverMemory};
 use rand::{CryptoRng, Rng, RngCore};
+use std::time::{Duration, Instant};
+
+/// How many Equi-X instances a [`Solver`] keeps built ahead of the current one
+///
+/// One would be enough to hide build latency on its own, since a solve takes
+/// far longer than a build; the second absorbs scheduling jitter.
+const PIPELINE_DEPTH: usize = 2;
 
 /// All inputs necessary to run the [`Solver`]
 #[derive(Debug, Clone)]
@@ -50,10 +57,18 @@ impl SolverInput {
     /// This is not generally useful, but it's great for unit tests if you'd
     /// like to skip to a deterministic location in the search.
     pub fn solve_with_nonce(self, nonce: &Nonce) -> Solver {
+        let challenges = std::iter::successors(
+            Some(Challenge::new(&self.instance, self.effort, nonce)),
+            |challenge| {
+                let mut next = challenge.clone();
+                next.increment_nonce();
+                Some(next)
+            },
+        );
         Solver {
-            challenge: Challenge::new(&self.instance, self.effort, nonce),
-            equix: self.equix,
+            pipeline: self.equix.pipeline(challenges, PIPELINE_DEPTH),
             mem: SolverMemory::new(),
+            timings: Default::default(),
         }
     }
 }
@@ -64,13 +79,36 @@ impl SolverInput {
 /// it is dropped. This interface supports cancelling an ongoing solve and it
 /// supports multithreaded use, but it requires an external thread pool
 /// implementation.
+///
+/// Each [`Solver`] also runs one helper thread, which generates and compiles
+/// the Equi-X instances for upcoming nonces while the current one is solved.
 pub struct Solver {
-    /// The next assembled [`Challenge`] to try
-    challenge: Challenge,
-    /// Configuration settings for Equi-X, as an [`EquiXBuilder`] instance
-    equix: EquiXBuilder,
+    /// Equi-X instances for each [`Challenge`] to try, built in advance
+    pipeline: EquiXPipeline<Challenge>,
     /// Temporary memory for Equi-X to use
     mem: SolverMemory,
+    /// Time spent so far, split by phase
+    timings: SolverTimings,
+}
+
+/// Where a [`Solver`] has spent its time so far
+///
+/// `build` is what the helper thread spent generating and compiling the
+/// Equi-X instances we used, and `build_wait` the part of that the solver
+/// was blocked for. With a healthy pipeline `build_wait` stays near zero,
+/// and `build` against `solve` shows whether compilation or hashing
+/// dominates.
+#[derive(Debug, Default, Clone, Copy)]
+#[non_exhaustive]
+pub struct SolverTimings {
+    /// Number of nonces tried
+    pub steps: u64,
+    /// Total time the helper thread spent building the instances we used
+    pub build: Duration,
+    /// Total time waiting for Equi-X instances to be generated and compiled
+    pub build_wait: Duration,
+    /// Total time spent running the Equi-X solver and checking effort
+    pub solve: Duration,
 }
 
 impl Solver {
@@ -106,25 +144,38 @@ impl Solver {
     /// been returned, but the resulting solutions will have nearby [`Nonce`]
     /// values so this is not recommended except for benchmarking.
     pub fn run_step(&mut self) -> Result<Option<Solution>, RuntimeErrorV1> {
-        match self.equix.build(self.challenge.as_ref()) {
-            Ok(equix) => {
-                for candidate in equix.solve_with_memory(&mut self.mem) {
-                    if self.challenge.check_effort(&candidate.to_bytes()).is_ok() {
-                        return Ok(Some(Solution::new(
-                            self.challenge.nonce(),
-                            self.challenge.effort(),
-                            self.challenge.seed().head(),
-                            candidate,
-                        )));
-                    }
-                }
-            }
-            Err(equix::Error::Hash(HashError::ProgramConstraints)) => (),
-            Err(e) => {
-                return Err(e.into());
-            }
+        let build_start = Instant::now();
+        let (challenge, equix) = self
+            .pipeline
+            .next()
+            .expect("nonce sequence is endless and the pipeline thread never exits early");
+        let solve_start = Instant::now();
+        self.timings.steps += 1;
+        self.timings.build += self.pipeline.last_build_time();
+        self.timings.build_wait += solve_start.duration_since(build_start);
+
+        let result = match equix {
+            Ok(equix) => Ok(equix
+                .solve_with_memory(&mut self.mem)
+                .into_iter()
+                .find(|candidate| challenge.check_effort(&candidate.to_bytes()).is_ok())
+                .map(|candidate| {
+                    Solution::new(
+                        challenge.nonce(),
+                        challenge.effort(),
+                        challenge.seed().head(),
+                        candidate,
+                    )
+                })),
+            Err(equix::Error::Hash(HashError::ProgramConstraints)) => Ok(None),
+            Err(e) => Err(e.into()),
         };
-        self.challenge.increment_nonce();
-        Ok(None)
+        self.timings.solve += solve_start.elapsed();
+        result
+    }
+
+    /// Report where this solver has spent its time so far.
+    pub fn timings(&self) -> SolverTimings {
+        self.timings
     }
 }
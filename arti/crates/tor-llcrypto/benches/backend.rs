@@ -0,0 +1,55 @@
+use cipher::{KeyIvInit, StreamCipher};
+use criterion::{criterion_group, criterion_main, Criterion, Throughput};
+use digest::Digest;
+
+use tor_llcrypto::backend::backends;
+use tor_llcrypto::cipher::aes::{Aes128Ctr, Aes256Ctr};
+use tor_llcrypto::d::{Sha1, Sha256, Sha3_256};
+
+/// The length of a relay cell body: the unit in which relay crypto runs.
+const CELL_LEN: usize = 509;
+
+/// Benchmark the per-cell primitives of relay cell crypto, with whichever
+/// implementations were selected for this CPU.
+pub fn backend_benchmark(c: &mut Criterion) {
+    // Criterion has no way to attach this to its report, so just print it.
+    #[allow(clippy::print_stdout)]
+    {
+        println!("Relay crypto backends: {}", backends());
+    }
+
+    let mut group = c.benchmark_group("relay_crypto_backend");
+    group.throughput(Throughput::Bytes(CELL_LEN as u64));
+    let mut cell = [0_u8; CELL_LEN];
+
+    let mut aes128 = Aes128Ctr::new(&[7_u8; 16].into(), &Default::default());
+    group.bench_function(format!("aes128ctr [{}]", backends().aes), |b| {
+        b.iter(|| aes128.apply_keystream(&mut cell[..]));
+    });
+
+    let mut aes256 = Aes256Ctr::new(&[7_u8; 32].into(), &Default::default());
+    group.bench_function(format!("aes256ctr [{}]", backends().aes), |b| {
+        b.iter(|| aes256.apply_keystream(&mut cell[..]));
+    });
+
+    let mut sha1 = Sha1::new();
+    group.bench_function(format!("sha1 [{}]", backends().sha1), |b| {
+        b.iter(|| sha1.update(&cell[..]));
+    });
+
+    let mut sha256 = Sha256::new();
+    group.bench_function(format!("sha256 [{}]", backends().sha256), |b| {
+        b.iter(|| sha256.update(&cell[..]));
+    });
+
+    // There is no hardware acceleration for SHA-3; this is here for comparison.
+    let mut sha3 = Sha3_256::new();
+    group.bench_function("sha3_256 [software]", |b| {
+        b.iter(|| sha3.update(&cell[..]));
+    });
+
+    group.finish();
+}
+
+criterion_group!(backend, backend_benchmark);
+criterion_main!(backend);
@@ -0,0 +1,208 @@
+//! Information about which implementations of our symmetric primitives are
+//! in use.
+//!
+//! Relay cell crypto spends nearly all of its time in AES-CTR and in the
+//! running SHA-1 (or SHA-256) digests, so its throughput depends heavily on
+//! whether those use hardware acceleration.
+//!
+//! We don't decide that at build time.  The `aes`, `sha1` and `sha2` crates
+//! that back [`cipher`](crate::cipher) and [`d`](crate::d) each check the
+//! CPU the first time they are used, and pick the fastest implementation that
+//! it supports (AES-NI or the ARMv8 crypto extensions for AES; SHA-NI or the
+//! ARMv8 SHA extensions for the digests), falling back to portable code
+//! otherwise.  A single build therefore runs at full speed on every host.
+//!
+//! This module repeats the same detection, once per process, so that the
+//! choice can be logged and reported by benchmarks.
+
+use std::fmt;
+use std::sync::OnceLock;
+
+/// An implementation of AES, as used by [`cipher::aes`](crate::cipher::aes).
+#[derive(Clone, Copy, Debug, Eq, PartialEq, derive_more::Display)]
+#[non_exhaustive]
+pub enum AesBackend {
+    /// The x86 AES-NI instructions.
+    #[display("AES-NI")]
+    AesNi,
+    /// The ARMv8 cryptography extensions.
+    #[display("ARMv8 crypto extensions")]
+    Armv8,
+    /// OpenSSL, which does its own runtime detection.
+    #[display("OpenSSL")]
+    OpenSsl,
+    /// A portable, constant-time software implementation.
+    #[display("software")]
+    Soft,
+}
+
+/// An implementation of a SHA digest, as used by [`d`](crate::d).
+#[derive(Clone, Copy, Debug, Eq, PartialEq, derive_more::Display)]
+#[non_exhaustive]
+pub enum ShaBackend {
+    /// The x86 SHA extensions.
+    #[display("SHA-NI")]
+    ShaNi,
+    /// The ARMv8 SHA extensions.
+    #[display("ARMv8 crypto extensions")]
+    Armv8,
+    /// A hand-written assembly implementation, from `with-sha1-asm`.
+    #[display("assembly")]
+    Asm,
+    /// OpenSSL, which does its own runtime detection.
+    #[display("OpenSSL")]
+    OpenSsl,
+    /// A portable software implementation.
+    #[display("software")]
+    Soft,
+}
+
+/// The implementations that this process uses for the primitives of relay
+/// cell crypto.
+#[derive(Clone, Copy, Debug, Eq, PartialEq)]
+#[non_exhaustive]
+pub struct Backends {
+    /// The implementation used for AES-128-CTR and AES-256-CTR.
+    pub aes: AesBackend,
+    /// The implementation used for SHA-1.
+    pub sha1: ShaBackend,
+    /// The implementation used for SHA-256.
+    pub sha256: ShaBackend,
+}
+
+impl fmt::Display for Backends {
+    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+        write!(
+            f,
+            "AES: {}, SHA-1: {}, SHA-256: {}",
+            self.aes, self.sha1, self.sha256
+        )
+    }
+}
+
+/// Return the implementations that this process uses for the primitives of
+/// relay cell crypto.
+///
+/// The CPU is only inspected the first time this function is called.
+pub fn backends() -> Backends {
+    /// The result of our detection, once we have done it.
+    static BACKENDS: OnceLock<Backends> = OnceLock::new();
+    *BACKENDS.get_or_init(detect)
+}
+
+/// Inspect the CPU to find out which implementations the `aes`, `sha1` and
+/// `sha2` crates will choose.
+///
+/// This must agree with the feature checks made by those crates.
+fn detect() -> Backends {
+    Backends {
+        aes: detect_aes(),
+        sha1: detect_sha1(),
+        sha256: detect_sha256(),
+    }
+}
+
+/// Helper for `detect`: find out which AES implementation is in use.
+fn detect_aes() -> AesBackend {
+    if cfg!(feature = "with-openssl") {
+        return AesBackend::OpenSsl;
+    }
+    #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+    {
+        if std::is_x86_feature_detected!("aes") && std::is_x86_feature_detected!("sse2") {
+            return AesBackend::AesNi;
+        }
+    }
+    #[cfg(target_arch = "aarch64")]
+    {
+        if std::arch::is_aarch64_feature_detected!("aes") {
+            return AesBackend::Armv8;
+        }
+    }
+    AesBackend::Soft
+}
+
+/// Helper for `detect`: find out which SHA-1 implementation is in use.
+fn detect_sha1() -> ShaBackend {
+    if cfg!(feature = "with-openssl") {
+        return ShaBackend::OpenSsl;
+    }
+    #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+    {
+        if x86_has_sha_ni() {
+            return ShaBackend::ShaNi;
+        }
+    }
+    // On aarch64, the `sha1` crate only uses the ARMv8 extensions via its
+    // assembly backend.
+    #[cfg(target_arch = "aarch64")]
+    {
+        if cfg!(feature = "with-sha1-asm") && std::arch::is_aarch64_feature_detected!("sha2") {
+            return ShaBackend::Armv8;
+        }
+    }
+    if cfg!(all(
+        feature = "with-sha1-asm",
+        any(target_arch = "x86", target_arch = "x86_64")
+    )) {
+        return ShaBackend::Asm;
+    }
+    ShaBackend::Soft
+}
+
+/// Helper for `detect`: find out which SHA-256 implementation is in use.
+fn detect_sha256() -> ShaBackend {
+    #[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+    {
+        if x86_has_sha_ni() {
+            return ShaBackend::ShaNi;
+        }
+    }
+    #[cfg(target_arch = "aarch64")]
+    {
+        if std::arch::is_aarch64_feature_detected!("sha2") {
+            return ShaBackend::Armv8;
+        }
+    }
+    ShaBackend::Soft
+}
+
+/// Return true if this CPU has every feature that the `sha1` and `sha2` crates
+/// require before they will use the SHA extensions.
+#[cfg(any(target_arch = "x86", target_arch = "x86_64"))]
+fn x86_has_sha_ni() -> bool {
+    std::is_x86_feature_detected!("sha")
+        && std::is_x86_feature_detected!("sse2")
+        && std::is_x86_feature_detected!("ssse3")
+        && std::is_x86_feature_detected!("sse4.1")
+}
+
+#[cfg(test)]
+mod test {
+    // @@ begin test lint list maintained by maint/add_warning @@
+    #![allow(clippy::bool_assert_comparison)]
+    #![allow(clippy::clone_on_copy)]
+    #![allow(clippy::dbg_macro)]
+    #![allow(clippy::mixed_attributes_style)]
+    #![allow(clippy::print_stderr)]
+    #![allow(clippy::print_stdout)]
+    #![allow(clippy::single_char_pattern)]
+    #![allow(clippy::unwrap_used)]
+    #![allow(clippy::unchecked_duration_subtraction)]
+    #![allow(clippy::useless_vec)]
+    #![allow(clippy::needless_pass_by_value)]
+    //! <!-- @@ end test lint list maintained by maint/add_warning @@ -->
+    use super::*;
+
+    #[test]
+    fn stable() {
+        let b = backends();
+        assert_eq!(b, backends());
+        assert_eq!(b, detect());
+
+        let s = b.to_string();
+        assert!(s.starts_with("AES: "));
+        assert!(s.contains("SHA-1: "));
+        assert!(s.contains("SHA-256: "));
+    }
+}
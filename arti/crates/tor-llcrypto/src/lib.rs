@@ -43,6 +43,7 @@
 #![allow(clippy::needless_lifetimes)] // See arti#1765
 //! <!-- @@ end lint list maintained by maint/add_warning @@ -->
 
+pub mod backend;
 pub mod cipher;
 pub mod d;
 pub mod pk;
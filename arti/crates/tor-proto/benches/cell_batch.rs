@@ -0,0 +1,93 @@
+use criterion::{criterion_group, criterion_main, Criterion, Throughput};
+use rand::prelude::*;
+
+use tor_bytes::SecretBuf;
+use tor_cell::relaycell::RelayCellFormatV0;
+use tor_llcrypto::{cipher::aes::Aes128Ctr, d::Sha1};
+use tor_proto::bench_utils::{
+    client_decrypt, client_decrypt_batch, encrypt_inbound, HopCryptState, InboundCryptWrapper,
+    RelayBody, RelayBodyBatch,
+};
+
+mod cpu_time;
+use cpu_time::*;
+
+/// How many cells to process in each batch.
+const BATCH_LEN: usize = 16;
+
+/// Return the seeds used for the three hops of our benchmark circuit.
+fn seeds() -> [SecretBuf; 3] {
+    [
+        b"hidden we are free".to_vec().into(),
+        b"free to speak, to free ourselves".to_vec().into(),
+        b"free to hide no more".to_vec().into(),
+    ]
+}
+
+/// Create `BATCH_LEN` random inbound cells from the last hop, and a client
+/// crypt state to decrypt them with.
+fn inbound_setup() -> (Vec<RelayBody>, InboundCryptWrapper) {
+    let mut relays = seeds()
+        .map(|seed| HopCryptState::<Aes128Ctr, Sha1, RelayCellFormatV0>::construct(seed).unwrap());
+    let mut cc_in = InboundCryptWrapper::new();
+    for seed in seeds() {
+        cc_in
+            .add_layer_from_seed::<Aes128Ctr, Sha1, RelayCellFormatV0>(seed)
+            .unwrap();
+    }
+
+    let mut rng = thread_rng();
+    let cells = (0..BATCH_LEN)
+        .map(|_| {
+            let mut cell = [0u8; 509];
+            rng.fill(&mut cell[..]);
+            let mut cell: RelayBody = cell.into();
+            encrypt_inbound(&mut cell, &mut relays);
+            cell
+        })
+        .collect();
+    (cells, cc_in)
+}
+
+/// Benchmark batched relay cell decryption against one-cell-at-a-time
+/// decryption,
+/// in cells per second of CPU time.
+pub fn cell_batch_benchmark(c: &mut Criterion<CpuTime>) {
+    let mut group = c.benchmark_group("cell_batch");
+    group.throughput(Throughput::Elements(BATCH_LEN as u64));
+
+    group.bench_function("decrypt_one_at_a_time_Tor1RelayCrypto", |b| {
+        b.iter_batched_ref(
+            inbound_setup,
+            |(cells, cc_in)| {
+                for cell in cells.iter_mut() {
+                    client_decrypt(cell, cc_in).unwrap();
+                }
+            },
+            criterion::BatchSize::SmallInput,
+        );
+    });
+
+    group.bench_function("decrypt_batch_Tor1RelayCrypto", |b| {
+        b.iter_batched_ref(
+            || {
+                let (cells, cc_in) = inbound_setup();
+                (RelayBodyBatch::from(cells), cc_in)
+            },
+            |(cells, cc_in)| {
+                client_decrypt_batch(cells, cc_in).unwrap();
+            },
+            criterion::BatchSize::SmallInput,
+        );
+    });
+
+    group.finish();
+}
+
+criterion_group!(
+   name = cell_batch;
+   config = Criterion::default()
+      .with_measurement(CpuTime)
+      .sample_size(1000);
+   targets = cell_batch_benchmark);
+criterion_main!(cell_batch);
@@ -17,8 +17,14 @@ mod cpu_time;
 use cpu_time::*;
 
 // Helper macro to setup a full circuit decryption benchmark.
+//
+// If `$add` is given, it names the `InboundCryptWrapper` method used to add
+// each layer.
 macro_rules! full_circuit_inbound_setup {
-    ($sc:ty, $d:ty, $f:ty) => {{
+    ($sc:ty, $d:ty, $f:ty) => {
+        full_circuit_inbound_setup!($sc, $d, $f, add_layer_from_seed)
+    };
+    ($sc:ty, $d:ty, $f:ty, $add:ident) => {{
         let seed1: SecretBuf = b"hidden we are free".to_vec().into();
         let seed2: SecretBuf = b"free to speak, to free ourselves".to_vec().into();
         let seed3: SecretBuf = b"free to hide no more".to_vec().into();
@@ -32,9 +38,9 @@ macro_rules! full_circuit_inbound_setup {
         ];
 
         let mut cc_in = InboundCryptWrapper::new();
-        cc_in.add_layer_from_seed::<$sc, $d, $f>(seed1).unwrap();
-        cc_in.add_layer_from_seed::<$sc, $d, $f>(seed2).unwrap();
-        cc_in.add_layer_from_seed::<$sc, $d, $f>(seed3).unwrap();
+        cc_in.$add::<$sc, $d, $f>(seed1).unwrap();
+        cc_in.$add::<$sc, $d, $f>(seed2).unwrap();
+        cc_in.$add::<$sc, $d, $f>(seed3).unwrap();
 
         let cell = create_inbound_cell::<$sc, $d, $f>(&mut rng, &mut circuit_sates);
         (cell, cc_in)
@@ -75,6 +81,23 @@ pub fn cell_decrypt_benchmark(c: &mut Criterion<CpuTime>) {
         );
     });
 
+    group.bench_function("cell_decrypt_Tor1RelayCrypto_boxed", |b| {
+        b.iter_batched_ref(
+            || {
+                full_circuit_inbound_setup!(
+                    Aes128Ctr,
+                    Sha1,
+                    RelayCellFormatV0,
+                    add_boxed_layer_from_seed
+                )
+            },
+            |(cell, cc_in)| {
+                client_decrypt(cell, cc_in).unwrap();
+            },
+            criterion::BatchSize::SmallInput,
+        );
+    });
+
     group.bench_function("cell_decrypt_Tor1Hsv3RelayCrypto", |b| {
         b.iter_batched_ref(
             || full_circuit_inbound_setup!(Aes256Ctr, Sha256, RelayCellFormatV0),
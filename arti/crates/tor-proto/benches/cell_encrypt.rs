@@ -15,16 +15,22 @@ use cpu_time::*;
 const HOP_NUM: u8 = 2;
 
 /// Helper macro to setup a full circuit encryption benchmark.
+///
+/// If `$add` is given, it names the `OutboundCryptWrapper` method used to add
+/// each layer.
 macro_rules! full_circuit_outbound_setup {
-    ($sc:ty, $d:ty, $f:ty) => {{
+    ($sc:ty, $d:ty, $f:ty) => {
+        full_circuit_outbound_setup!($sc, $d, $f, add_layer_from_seed)
+    };
+    ($sc:ty, $d:ty, $f:ty, $add:ident) => {{
         let seed1: SecretBuf = b"hidden we are free".to_vec().into();
         let seed2: SecretBuf = b"free to speak, to free ourselves".to_vec().into();
         let seed3: SecretBuf = b"free to hide no more".to_vec().into();
 
         let mut cc_out = OutboundCryptWrapper::new();
-        cc_out.add_layer_from_seed::<$sc, $d, $f>(seed1).unwrap();
-        cc_out.add_layer_from_seed::<$sc, $d, $f>(seed2).unwrap();
-        cc_out.add_layer_from_seed::<$sc, $d, $f>(seed3).unwrap();
+        cc_out.$add::<$sc, $d, $f>(seed1).unwrap();
+        cc_out.$add::<$sc, $d, $f>(seed2).unwrap();
+        cc_out.$add::<$sc, $d, $f>(seed3).unwrap();
 
         let mut rng = rand::thread_rng();
         let cell = create_outbound_cell(&mut rng);
@@ -54,6 +60,23 @@ pub fn cell_encrypt_benchmark(c: &mut Criterion<CpuTime>) {
         );
     });
 
+    group.bench_function("cell_encrypt_Tor1RelayCrypto_boxed", |b| {
+        b.iter_batched_ref(
+            || {
+                full_circuit_outbound_setup!(
+                    Aes128Ctr,
+                    Sha1,
+                    RelayCellFormatV0,
+                    add_boxed_layer_from_seed
+                )
+            },
+            |(cell, cc_out)| {
+                client_encrypt(cell, cc_out, HOP_NUM).unwrap();
+            },
+            criterion::BatchSize::SmallInput,
+        );
+    });
+
     group.bench_function("cell_encrypt_Tor1Hsv3RelayCrypto", |b| {
         b.iter_batched_ref(
             || full_circuit_outbound_setup!(Aes256Ctr, Sha256, RelayCellFormatV0),
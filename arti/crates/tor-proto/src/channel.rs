@@ -62,10 +62,12 @@ pub mod kist;
 pub mod padding;
 pub mod params;
 mod reactor;
+mod scheduler;
 mod unique_id;
 
 pub use crate::channel::params::*;
 use crate::channel::reactor::{BoxedChannelSink, BoxedChannelStream, Reactor};
+pub use crate::channel::scheduler::CircPriority;
 pub use crate::channel::unique_id::UniqId;
 use crate::memquota::{ChannelAccount, CircuitAccount, SpecificAccount as _};
 use crate::util::err::ChannelClosed;
@@ -506,6 +508,7 @@ impl Channel {
             details,
             padding_timer,
             special_outgoing: Default::default(),
+            scheduler: Default::default(),
         };
 
         Ok((channel, reactor))
@@ -726,6 +729,13 @@ impl Channel {
         Ok(())
     }
 
+    /// Tell the reactor to schedule the circuit with the given ID in the
+    /// class `priority`.
+    pub(crate) fn set_circ_priority(&self, circid: CircId, priority: CircPriority) -> Result<()> {
+        self.send_control(CtrlMsg::SetCircPriority(circid, priority))?;
+        Ok(())
+    }
+
     /// Return a future that will resolve once this channel has closed.
     ///
     /// Note that this method does not _cause_ the channel to shut down on its own.
@@ -7,6 +7,7 @@
 //! or in the error handling behavior.
 
 use super::circmap::{CircEnt, CircMap};
+use super::scheduler::{CircPriority, CircScheduler};
 use super::OpenChanCellS2C;
 use crate::channel::OpenChanMsgS2C;
 use crate::circuit::halfcirc::HalfCirc;
@@ -25,6 +26,7 @@ use oneshot_fused_workaround as oneshot;
 
 use futures::sink::SinkExt;
 use futures::stream::Stream;
+use futures::FutureExt as _;
 use futures::Sink;
 use futures::StreamExt as _;
 use futures::{select, select_biased};
@@ -52,6 +54,17 @@ pub(super) type BoxedChannelStreamOps = Box<dyn StreamOps + Send + Unpin + 'stat
 /// The type of a oneshot channel used to inform reactor users of the result of an operation.
 pub(super) type ReactorResultChannel<T> = oneshot::Sender<Result<T>>;
 
+/// The largest number of outbound cells that we'll hand to the sink in a
+/// single reactor wakeup.
+///
+/// The sink only flushes when we run out of cells to give it, so this bounds
+/// how much we encode into one write to the TLS layer (about 16 KiB of
+/// cells), and how long we go without looking at our other inputs.
+///
+/// It is also the most cells we take out of `cells` (which is accounted
+/// for by the memory quota system) into our [`CircScheduler`].
+const OUTBOUND_CELL_BATCH_MAX: usize = 32;
+
 /// Convert `err` to an Error, under the assumption that it's happening on an
 /// open channel.
 fn codec_err_to_chan(err: CodecError) -> Error {
@@ -97,6 +110,8 @@ pub enum CtrlMsg {
     /// the sender of these messages is responsible for the optimisation of
     /// ensuring that "no-change" messages are elided.
     KistConfigUpdate(KistParams),
+    /// Put a circuit in a different scheduling class.
+    SetCircPriority(CircId, CircPriority),
 }
 
 /// Object to handle incoming cells and background tasks on a channel.
@@ -128,6 +143,8 @@ pub struct Reactor<S: SleepProvider> {
     pub(super) padding_timer: Pin<Box<padding::Timer<S>>>,
     /// Outgoing cells introduced at the channel reactor
     pub(super) special_outgoing: SpecialOutgoing,
+    /// Cells taken from `cells` but not yet sent, queued per circuit.
+    pub(super) scheduler: CircScheduler,
     /// A map from circuit ID to Sinks on which we can deliver cells.
     pub(super) circs: CircMap,
     /// A unique identifier for this channel.
@@ -212,6 +229,12 @@ impl<S: SleepProvider> Reactor<S> {
                     return Some(l)
                 }
 
+                // If we already hold cells from several circuits, pick among them.
+                if let Some(c) = self.scheduler.pop() {
+                    self.padding_timer.as_mut().note_cell_sent();
+                    return Some(c)
+                }
+
                 select_biased! {
                     n = self.cells.next() => {
                         // Note transmission on *input* to the reactor, not ultimate
@@ -231,7 +254,14 @@ impl<S: SleepProvider> Reactor<S> {
                         // (We in any case need padding that we generate when idle to make it
                         // through to the output promptly, or it will be late and ineffective.)
                         self.padding_timer.as_mut().note_cell_sent();
-                        n
+
+                        // Take whatever else is already waiting, so that the
+                        // scheduler gets to choose among all ready circuits,
+                        // rather than sending in arrival order.
+                        let n = n?;
+                        self.scheduler.push(n);
+                        self.scheduler.push_ready(&mut self.cells, OUTBOUND_CELL_BATCH_MAX);
+                        self.scheduler.pop()
                     },
                     p = self.padding_timer.as_mut().next() => {
                         // eprintln!("PADDING - SENDING PADDING: {:?}", &p);
@@ -242,6 +272,7 @@ impl<S: SleepProvider> Reactor<S> {
                 let (msg, sendable) = ret.map_err(codec_err_to_chan)?;
                 let msg = msg.ok_or(ReactorError::Shutdown)?;
                 sendable.send(msg).map_err(codec_err_to_chan)?;
+                self.send_ready_cells()?;
             }
 
             ret = self.control.next() => {
@@ -264,12 +295,49 @@ impl<S: SleepProvider> Reactor<S> {
         Ok(()) // Run again.
     }
 
+    /// Hand the sink every outbound cell that is already queued, up to
+    /// [`OUTBOUND_CELL_BATCH_MAX`], without waiting.
+    ///
+    /// Cells from all our circuits thus end up encoded back-to-back in the
+    /// sink's buffer, which `prepare_send_from` flushes (as one large write
+    /// into TLS, giving full-sized records) once no more cells are ready.
+    /// Without this, we'd go around the `select!` in `run_once` once per cell.
+    fn send_ready_cells(&mut self) -> Result<()> {
+        for _ in 1..OUTBOUND_CELL_BATCH_MAX {
+            // Don't take a cell unless the sink can accept it right away;
+            // otherwise we'd have nowhere to put it.
+            match futures::future::poll_fn(|cx| self.output.poll_ready_unpin(cx)).now_or_never() {
+                Some(ready) => ready.map_err(codec_err_to_chan)?,
+                None => break,
+            }
+            let cell = match self.special_outgoing.next() {
+                Some(cell) => cell,
+                None => {
+                    self.scheduler
+                        .push_ready(&mut self.cells, OUTBOUND_CELL_BATCH_MAX);
+                    match self.scheduler.pop() {
+                        Some(cell) => cell,
+                        None => break,
+                    }
+                }
+            };
+            self.padding_timer.as_mut().note_cell_sent();
+            self.output
+                .start_send_unpin(cell)
+                .map_err(codec_err_to_chan)?;
+        }
+        Ok(())
+    }
+
     /// Handle a CtrlMsg other than Shutdown.
     async fn handle_control(&mut self, msg: CtrlMsg) -> Result<()> {
         trace!("{}: reactor received {:?}", &self, msg);
         match msg {
             CtrlMsg::Shutdown => panic!(), // was handled in reactor loop.
             CtrlMsg::CloseCircuit(id) => self.outbound_destroy_circ(id).await?,
+            CtrlMsg::SetCircPriority(id, priority) => {
+                self.scheduler.set_priority(id, priority);
+            }
             CtrlMsg::AllocateCircuit {
                 created_sender,
                 sender,
@@ -406,6 +474,7 @@ impl<S: SleepProvider> Reactor<S> {
 
         // Remove the circuit from the map: nothing more can be done with it.
         let entry = self.circs.remove(circid);
+        self.scheduler.remove(circid);
         self.update_disused_since();
         match entry {
             // If the circuit is waiting for CREATED, tell it that it
@@ -456,6 +525,7 @@ impl<S: SleepProvider> Reactor<S> {
         // TODO: It would be great to have a tighter upper bound for
         // the number of relay cells we'll receive.
         self.circs.destroy_sent(id, HalfCirc::new(3000));
+        self.scheduler.remove(id);
         self.update_disused_since();
         let destroy = Destroy::new(DestroyReason::NONE).into();
         let cell = AnyChanCell::new(Some(id), destroy);
@@ -598,6 +668,36 @@ pub(crate) mod test {
         });
     }
 
+    // Cells that are already queued should all go out in one reactor wakeup.
+    #[test]
+    fn send_ready_cells_batch() {
+        tor_rtcompat::test_with_all_runtimes!(|rt| async move {
+            let (chan, mut reactor, mut output, _input) = new_reactor(rt);
+            let mut sender = chan.sender();
+
+            for id in 7..12 {
+                let destroy = msg::Destroy::new(DestroyReason::NONE).into();
+                sender
+                    .send(AnyChanCell::new(CircId::new(id), destroy))
+                    .await
+                    .unwrap();
+            }
+            reactor.run_once().await.unwrap();
+
+            // These are all on different circuits, so the scheduler may pick
+            // them in any order.
+            let mut sent: Vec<u32> = (7..12)
+                .map(|_| {
+                    let cell = output.try_next().unwrap().unwrap();
+                    assert!(matches!(cell.msg(), AnyChanMsg::Destroy(_)));
+                    cell.circid().unwrap().into()
+                })
+                .collect();
+            sent.sort_unstable();
+            assert_eq!(sent, (7..12).collect::<Vec<u32>>());
+        });
+    }
+
     #[test]
     fn new_circ_closed() {
         tor_rtcompat::test_with_all_runtimes!(|rt| async move {
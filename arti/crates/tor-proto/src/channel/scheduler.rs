@@ -0,0 +1,282 @@
+//! EWMA scheduling of outbound cells among the circuits on a channel.
+//!
+//! Like C tor's `circuitmux_ewma`, we keep an exponentially-weighted moving
+//! average of how many cells each circuit has recently sent, and when several
+//! circuits have cells waiting we send from the quietest one first. This keeps
+//! a bulk transfer from adding latency to interactive circuits on the same
+//! channel.
+//!
+//! Unlike C tor, our "clock" is the number of cells sent on the channel, not
+//! wall-clock time: a circuit's count halves every [`HALFLIFE_CELLS`] cells
+//! the channel sends. That needs no timer, and only the relative order of the
+//! counts matters.
+//!
+//! Circuits may also be put in a [`CircPriority`] class. Classes are strict:
+//! a circuit is only picked while no circuit in a more urgent class has cells
+//! waiting. EWMA decides among circuits of the same class.
+
+use std::collections::hash_map::Entry;
+use std::collections::{HashMap, VecDeque};
+
+use futures::{FutureExt as _, Stream, StreamExt as _};
+use tor_cell::chancell::{AnyChanCell, CircId};
+
+/// How many cells the channel sends before a circuit's EWMA count halves.
+const HALFLIFE_CELLS: f64 = 1000.0;
+
+/// Once the per-cell increment grows past this, rescale every count.
+///
+/// (We add an ever-growing increment rather than decaying every count on
+/// every cell; see [`CircScheduler::note_sent`].)
+const RESCALE_THRESHOLD: f64 = 1e100;
+
+/// Scheduling class of a circuit on its channel.
+///
+/// Cells from circuits in a more urgent class are always sent before cells
+/// from circuits in a less urgent one, when both are waiting.
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq, PartialOrd, Ord, Hash)]
+#[non_exhaustive]
+pub enum CircPriority {
+    /// Latency-sensitive traffic, like interactive requests.
+    Interactive,
+    /// Ordinary traffic.
+    #[default]
+    Normal,
+    /// Bulk transfers, which should yield to everything else.
+    Bulk,
+}
+
+/// Scheduling state for one circuit.
+#[derive(Debug, Default)]
+struct CircQueue {
+    /// Cells waiting to be sent, in order.
+    cells: VecDeque<AnyChanCell>,
+    /// Scaled EWMA count of the cells this circuit has recently sent.
+    ///
+    /// Only comparable with other counts on the same [`CircScheduler`].
+    ewma: f64,
+    /// The class this circuit is scheduled in.
+    priority: CircPriority,
+}
+
+/// A set of per-circuit cell queues, drained in EWMA order.
+#[derive(Debug)]
+pub(super) struct CircScheduler {
+    /// Cells that belong to no circuit (like padding), sent before any other.
+    unscheduled: VecDeque<AnyChanCell>,
+    /// Queues for the circuits we've seen cells from, or have a priority for.
+    circs: HashMap<CircId, CircQueue>,
+    /// Number of cells in all the queues in `circs`.
+    n_queued: usize,
+    /// What we add to a circuit's count for each cell it sends.
+    ///
+    /// This grows by a factor of two every [`HALFLIFE_CELLS`] cells, which
+    /// is equivalent to halving every count.
+    increment: f64,
+    /// Factor by which `increment` grows for each cell.
+    growth: f64,
+}
+
+impl Default for CircScheduler {
+    fn default() -> Self {
+        Self {
+            unscheduled: VecDeque::new(),
+            circs: HashMap::new(),
+            n_queued: 0,
+            increment: 1.0,
+            growth: 2.0_f64.powf(1.0 / HALFLIFE_CELLS),
+        }
+    }
+}
+
+impl CircScheduler {
+    /// Queue `cell` behind any other cells from the same circuit.
+    pub(super) fn push(&mut self, cell: AnyChanCell) {
+        match cell.circid() {
+            Some(id) => {
+                self.circs.entry(id).or_default().cells.push_back(cell);
+                self.n_queued += 1;
+            }
+            None => self.unscheduled.push_back(cell),
+        }
+    }
+
+    /// Return the number of cells waiting.
+    pub(super) fn len(&self) -> usize {
+        self.unscheduled.len() + self.n_queued
+    }
+
+    /// Queue cells that `cells` can give us right away, until we hold `max`.
+    ///
+    /// Stops early if the stream is closed; the caller will see that the next
+    /// time it polls the stream.
+    pub(super) fn push_ready<S>(&mut self, cells: &mut S, max: usize)
+    where
+        S: Stream<Item = AnyChanCell> + Unpin,
+    {
+        while self.len() < max {
+            match cells.next().now_or_never() {
+                Some(Some(cell)) => self.push(cell),
+                Some(None) | None => break,
+            }
+        }
+    }
+
+    /// Take the next cell to send, if any.
+    ///
+    /// That's a cell without a circuit if we have one; otherwise the oldest
+    /// cell of the most urgent, then quietest, circuit that has cells waiting.
+    pub(super) fn pop(&mut self) -> Option<AnyChanCell> {
+        if let Some(cell) = self.unscheduled.pop_front() {
+            return Some(cell);
+        }
+        // We expect few circuits to have cells waiting at once, so a linear
+        // scan is fine here.
+        let id = *self
+            .circs
+            .iter()
+            .filter(|(_, q)| !q.cells.is_empty())
+            .min_by(|(_, a), (_, b)| a.priority.cmp(&b.priority).then(a.ewma.total_cmp(&b.ewma)))?
+            .0;
+        let queue = self.circs.get_mut(&id)?;
+        let cell = queue.cells.pop_front()?;
+        self.n_queued -= 1;
+        self.note_sent(id);
+        Some(cell)
+    }
+
+    /// Record that circuit `id` has sent a cell.
+    fn note_sent(&mut self, id: CircId) {
+        if let Some(q) = self.circs.get_mut(&id) {
+            q.ewma += self.increment;
+        }
+        self.increment *= self.growth;
+        if self.increment > RESCALE_THRESHOLD {
+            self.rescale();
+        }
+    }
+
+    /// Divide every count (and the increment) by the increment, so that they
+    /// stay representable.
+    ///
+    /// While we're at it, forget about circuits that have gone quiet and
+    /// have no special priority.
+    fn rescale(&mut self) {
+        let scale = self.increment;
+        self.increment = 1.0;
+        self.circs.retain(|_, q| {
+            q.ewma /= scale;
+            !q.cells.is_empty() || q.priority != CircPriority::Normal || q.ewma >= 1.0
+        });
+    }
+
+    /// Put circuit `id` in the class `priority`.
+    pub(super) fn set_priority(&mut self, id: CircId, priority: CircPriority) {
+        self.circs.entry(id).or_default().priority = priority;
+    }
+
+    /// Forget about circuit `id`, dropping any cells still queued for it.
+    pub(super) fn remove(&mut self, id: CircId) {
+        if let Entry::Occupied(e) = self.circs.entry(id) {
+            self.n_queued -= e.remove().cells.len();
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    // @@ begin test lint list maintained by maint/add_warning @@
+    #![allow(clippy::bool_assert_comparison)]
+    #![allow(clippy::clone_on_copy)]
+    #![allow(clippy::dbg_macro)]
+    #![allow(clippy::mixed_attributes_style)]
+    #![allow(clippy::print_stderr)]
+    #![allow(clippy::print_stdout)]
+    #![allow(clippy::single_char_pattern)]
+    #![allow(clippy::unwrap_used)]
+    #![allow(clippy::unchecked_duration_subtraction)]
+    #![allow(clippy::useless_vec)]
+    #![allow(clippy::needless_pass_by_value)]
+    //! <!-- @@ end test lint list maintained by maint/add_warning @@ -->
+    use super::*;
+    use tor_cell::chancell::msg;
+
+    /// Return a DESTROY cell on circuit `id`.
+    fn cell(id: u32) -> AnyChanCell {
+        AnyChanCell::new(
+            CircId::new(id),
+            msg::Destroy::new(msg::DestroyReason::NONE).into(),
+        )
+    }
+
+    /// Return the circuit IDs of every cell we pop from `sched`, in order.
+    fn drain(sched: &mut CircScheduler) -> Vec<u32> {
+        std::iter::from_fn(|| sched.pop())
+            .map(|c| c.circid().unwrap().into())
+            .collect()
+    }
+
+    #[test]
+    fn quiet_circuit_first() {
+        let mut sched = CircScheduler::default();
+        // Circuit 1 has been busy.
+        for _ in 0..10 {
+            sched.push(cell(1));
+        }
+        for _ in 0..5 {
+            sched.pop();
+        }
+        // Circuit 2 shows up with a little traffic; it should go first.
+        sched.push(cell(2));
+        sched.push(cell(2));
+        assert_eq!(drain(&mut sched), vec![2, 2, 1, 1, 1, 1, 1]);
+        assert_eq!(sched.len(), 0);
+    }
+
+    #[test]
+    fn priority_classes() {
+        let mut sched = CircScheduler::default();
+        sched.set_priority(CircId::new(1).unwrap(), CircPriority::Bulk);
+        sched.set_priority(CircId::new(3).unwrap(), CircPriority::Interactive);
+        sched.push(cell(1));
+        sched.push(cell(2));
+        sched.push(cell(3));
+        sched.push(AnyChanCell::new(None, msg::Padding::new().into()));
+
+        assert!(sched.pop().unwrap().circid().is_none());
+        assert_eq!(drain(&mut sched), vec![3, 2, 1]);
+    }
+
+    #[test]
+    fn per_circuit_order() {
+        let mut sched = CircScheduler::default();
+        for i in 0..4_u8 {
+            sched.push(AnyChanCell::new(
+                CircId::new(5),
+                msg::Destroy::new(i.into()).into(),
+            ));
+        }
+        let reasons: Vec<_> = std::iter::from_fn(|| sched.pop())
+            .map(|c| match c.msg() {
+                msg::AnyChanMsg::Destroy(d) => u8::from(d.reason()),
+                _ => panic!(),
+            })
+            .collect();
+        assert_eq!(reasons, vec![0, 1, 2, 3]);
+    }
+
+    #[test]
+    fn rescale_and_remove() {
+        let mut sched = CircScheduler::default();
+        sched.increment = RESCALE_THRESHOLD;
+        sched.push(cell(1));
+        assert_eq!(sched.pop().unwrap().circid(), CircId::new(1));
+        assert!(sched.increment < RESCALE_THRESHOLD);
+
+        sched.push(cell(2));
+        sched.push(cell(2));
+        sched.remove(CircId::new(2).unwrap());
+        assert_eq!(sched.len(), 0);
+        assert!(sched.pop().is_none());
+    }
+}
@@ -49,7 +49,7 @@ pub(crate) mod reactor;
 mod streammap;
 mod unique_id;
 
-use crate::channel::Channel;
+use crate::channel::{Channel, CircPriority};
 use crate::circuit::celltypes::*;
 use crate::circuit::reactor::{
     CircuitHandshake, CtrlMsg, Reactor, RECV_WINDOW_INIT, STREAM_READER_BUFFER,
@@ -742,6 +742,20 @@ impl ClientCirc {
         rx.await.map_err(|_| Error::CircuitClosed)?
     }
 
+    /// Change how this circuit's cells are scheduled on its channel, relative
+    /// to those of other circuits sharing the channel.
+    ///
+    /// Circuits start out as [`CircPriority::Normal`].
+    pub async fn set_priority(&self, priority: CircPriority) -> Result<()> {
+        let (tx, rx) = oneshot::channel();
+
+        self.command
+            .unbounded_send(CtrlCmd::SetPriority { priority, done: tx })
+            .map_err(|_| Error::CircuitClosed)?;
+
+        rx.await.map_err(|_| Error::CircuitClosed)?
+    }
+
     /// Helper, used to begin a stream.
     ///
     /// This function allocates a stream ID, and sends the message
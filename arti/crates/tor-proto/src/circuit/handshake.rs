@@ -18,7 +18,8 @@ use crate::crypto::binding::CircuitBinding;
 #[cfg(feature = "hs-common")]
 use crate::crypto::cell::Tor1Hsv3RelayCrypto;
 use crate::crypto::cell::{
-    ClientLayer, CryptInit, InboundClientLayer, OutboundClientLayer, Tor1RelayCrypto,
+    ClientLayer, CryptInit, InboundClientLayer, InboundHopLayer, OutboundClientLayer,
+    OutboundHopLayer, Tor1RelayCrypto,
 };
 
 use crate::Result;
@@ -84,9 +85,9 @@ pub enum HandshakeRole {
 /// client.
 pub(crate) struct BoxedClientLayer {
     /// The outbound cryptographic layer to use for this hop
-    pub(crate) fwd: Box<dyn OutboundClientLayer + Send>,
+    pub(crate) fwd: OutboundHopLayer,
     /// The inbound cryptogarphic layer to use for this hop
-    pub(crate) back: Box<dyn InboundClientLayer + Send>,
+    pub(crate) back: InboundHopLayer,
     /// A circuit binding key for this hop.
     pub(crate) binding: Option<CircuitBinding>,
 }
@@ -135,8 +136,8 @@ where
         std::mem::swap(&mut fwd, &mut back);
     }
     Ok(BoxedClientLayer {
-        fwd: Box::new(fwd),
-        back: Box::new(back),
+        fwd: OutboundHopLayer::new(fwd),
+        back: InboundHopLayer::new(back),
         binding: Some(binding),
     })
 }
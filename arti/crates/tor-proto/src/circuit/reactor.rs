@@ -33,7 +33,7 @@ use crate::congestion::sendme::{self, CircTag};
 use crate::congestion::{CongestionControl, CongestionSignals};
 use crate::crypto::binding::CircuitBinding;
 use crate::crypto::cell::{
-    HopNum, InboundClientCrypt, InboundClientLayer, OutboundClientCrypt, OutboundClientLayer,
+    HopNum, InboundClientCrypt, InboundHopLayer, OutboundClientCrypt, OutboundHopLayer,
     RelayCellBody, SENDME_TAG_LEN,
 };
 use crate::crypto::handshake::fast::CreateFastClient;
@@ -104,6 +104,9 @@ pub(super) const RECV_WINDOW_INIT: u16 = 500;
 ///             get sent more than the receive window anyway!). We might do due to things that
 ///             don't count towards the window though.
 pub(super) const STREAM_READER_BUFFER: usize = (2 * RECV_WINDOW_INIT) as usize;
+/// The largest number of already-queued inbound RELAY cells that we will
+/// decrypt together in a single call to [`Reactor::run_once`].
+const INBOUND_RELAY_BATCH_MAX: usize = 32;
 
 /// The type of a oneshot channel used to inform reactor users of the result of an operation.
 pub(super) type ReactorResultChannel<T> = oneshot::Sender<Result<T>>;
@@ -666,7 +669,7 @@ impl Reactor {
             Some(SelectResult::HandleControl(ctrl)) => {
                 Some(RunOnceCmd::Single(ControlHandler::new(self).handle(ctrl)?))
             }
-            Some(SelectResult::HandleCell(cell)) => self.handle_cell(cell)?,
+            Some(SelectResult::HandleCell(cell)) => return self.handle_cell_batch(cell).await,
         };
 
         if let Some(cmd) = cmd {
@@ -676,6 +679,66 @@ impl Reactor {
         Ok(())
     }
 
+    /// Handle `first`, along with any RELAY cells that are already waiting
+    /// behind it on our input.
+    ///
+    /// Waiting RELAY cells are decrypted together, so that each layer of our
+    /// crypto state processes the whole run of cells at once.  After that,
+    /// each cell is handled in order, exactly as if it had arrived on its own.
+    async fn handle_cell_batch(&mut self, first: ClientCircChanMsg) -> StdResult<(), ReactorError> {
+        let mut relay_cells = Vec::new();
+        // A non-RELAY cell that ended the batch, if any.
+        let mut trailer = None;
+        match first {
+            ClientCircChanMsg::Relay(r) => relay_cells.push(r),
+            other => trailer = Some(other),
+        }
+
+        // If a meta-cell handler is installed, the next cell may add a hop to the
+        // circuit, and change how the cells behind it must be decrypted.
+        // So in that case, we take cells one at a time.
+        if trailer.is_none() && self.meta_handler.is_none() {
+            while relay_cells.len() < INBOUND_RELAY_BATCH_MAX {
+                match self.input.next().now_or_never() {
+                    Some(Some(ClientCircChanMsg::Relay(r))) => relay_cells.push(r),
+                    Some(Some(other)) => {
+                        trailer = Some(other);
+                        break;
+                    }
+                    // Either nothing is ready, or the input is closed, in which
+                    // case we'll notice the next time we poll it.
+                    Some(None) | None => break,
+                }
+            }
+        }
+
+        if !relay_cells.is_empty() {
+            trace!(
+                "{}: handling {} RELAY cells",
+                self.unique_id,
+                relay_cells.len()
+            );
+            let mut bodies: Vec<RelayCellBody> = relay_cells
+                .into_iter()
+                .map(|cell| cell.into_relay_body().into())
+                .collect();
+            let origins = self.crypto_in.decrypt_batch(&mut bodies)?;
+            for (body, (hopnum, tag)) in bodies.into_iter().zip(origins) {
+                if let Some(cmd) = self.handle_relay_cell(hopnum, tag.into(), body)? {
+                    self.handle_run_once_cmd(cmd).await?;
+                }
+            }
+        }
+
+        if let Some(cell) = trailer {
+            if let Some(cmd) = self.handle_cell(cell)? {
+                self.handle_run_once_cmd(cmd).await?;
+            }
+        }
+
+        Ok(())
+    }
+
     /// Handle a [`RunOnceCmd`].
     async fn handle_run_once_cmd(&mut self, cmd: RunOnceCmd) -> StdResult<(), ReactorError> {
         match cmd {
@@ -989,8 +1052,8 @@ impl Reactor {
             .build()
             .expect("Could not construct fake hop");
 
-        let fwd = Box::new(DummyCrypto::new(fwd_lasthop));
-        let rev = Box::new(DummyCrypto::new(rev_lasthop));
+        let fwd = OutboundHopLayer::new(DummyCrypto::new(fwd_lasthop));
+        let rev = InboundHopLayer::new(DummyCrypto::new(rev_lasthop));
         let binding = None;
         self.add_hop(
             format,
@@ -1168,8 +1231,8 @@ impl Reactor {
         &mut self,
         format: RelayCellFormat,
         peer_id: path::HopDetail,
-        fwd: Box<dyn OutboundClientLayer + 'static + Send>,
-        rev: Box<dyn InboundClientLayer + 'static + Send>,
+        fwd: OutboundHopLayer,
+        rev: InboundHopLayer,
         binding: Option<CircuitBinding>,
         params: &CircParameters,
     ) {
@@ -1287,8 +1350,8 @@ impl Reactor {
             .hop_mut(hopnum)
             .ok_or_else(|| Error::CircProto(format!("Couldn't find hop {}", hopnum.display())))?;
 
-        let tag = match msg.into_tag() {
-            Some(v) => CircTag::try_from(v.as_slice())
+        let tag = match msg.tag() {
+            Some(v) => CircTag::try_from(v)
                 .map_err(|_| Error::CircProto("malformed tag on circuit sendme".into()))?,
             None => {
                 // Versions of Tor <=0.3.5 would omit a SENDME tag in this case;
@@ -1457,7 +1520,11 @@ impl Reactor {
         trace!("{}: handling cell: {:?}", self.unique_id, cell);
         use ClientCircChanMsg::*;
         match cell {
-            Relay(r) => self.handle_relay_cell(r),
+            Relay(r) => {
+                let mut body = r.into_relay_body().into();
+                let (hopnum, tag) = self.decrypt_relay_cell(&mut body)?;
+                self.handle_relay_cell(hopnum, tag, body)
+            }
             Destroy(d) => {
                 let reason = d.reason();
                 debug!(
@@ -1473,17 +1540,12 @@ impl Reactor {
         }
     }
 
-    /// Decode `cell`, returning its corresponding hop number, tag,
-    /// and decoded body.
-    fn decode_relay_cell(
-        &mut self,
-        cell: Relay,
-    ) -> Result<(HopNum, CircTag, RelayCellDecoderResult)> {
-        let mut body = cell.into_relay_body().into();
-
+    /// Decrypt the body of a single relay cell, returning the hop number that
+    /// originated it, and its tag.
+    fn decrypt_relay_cell(&mut self, body: &mut RelayCellBody) -> Result<(HopNum, CircTag)> {
         // Decrypt the cell. If it's recognized, then find the
         // corresponding hop.
-        let (hopnum, tag) = self.crypto_in.decrypt(&mut body)?;
+        let (hopnum, tag) = self.crypto_in.decrypt(body)?;
         // Make a copy of the authentication tag. TODO: I'd rather not
         // copy it, but I don't see a way around it right now.
         let tag = {
@@ -1494,6 +1556,15 @@ impl Reactor {
             tag_copy
         };
 
+        Ok((hopnum, tag.into()))
+    }
+
+    /// Decode the already-decrypted `body`, which came from `hopnum`.
+    fn decode_relay_cell(
+        &mut self,
+        hopnum: HopNum,
+        body: RelayCellBody,
+    ) -> Result<RelayCellDecoderResult> {
         // Decode the cell.
         let decode_res = self
             .hop_mut(hopnum)
@@ -1507,12 +1578,18 @@ impl Reactor {
             .decode(body.into())
             .map_err(|e| Error::from_bytes_err(e, "relay cell"))?;
 
-        Ok((hopnum, tag.into(), decode_res))
+        Ok(decode_res)
     }
 
-    /// React to a Relay or RelayEarly cell.
-    fn handle_relay_cell(&mut self, cell: Relay) -> Result<Option<RunOnceCmd>> {
-        let (hopnum, tag, decode_res) = self.decode_relay_cell(cell)?;
+    /// React to a Relay or RelayEarly cell, whose body has already been
+    /// decrypted and found to come from `hopnum`.
+    fn handle_relay_cell(
+        &mut self,
+        hopnum: HopNum,
+        tag: CircTag,
+        body: RelayCellBody,
+    ) -> Result<Option<RunOnceCmd>> {
+        let decode_res = self.decode_relay_cell(hopnum, body)?;
 
         let c_t_w = decode_res.cmds().any(sendme::cmd_counts_towards_windows);
 
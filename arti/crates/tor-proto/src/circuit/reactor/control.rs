@@ -4,12 +4,13 @@ use super::{
     CircuitHandshake, CloseStreamBehavior, MetaCellHandler, Reactor, ReactorResultChannel,
     RunOnceCmdInner, SendRelayCell,
 };
+use crate::channel::CircPriority;
 use crate::circuit::celltypes::CreateResponse;
 use crate::circuit::reactor::extender::CircuitExtender;
 use crate::circuit::reactor::{NtorClient, ReactorError};
 use crate::circuit::{path, streammap, CircParameters};
 use crate::crypto::binding::CircuitBinding;
-use crate::crypto::cell::{HopNum, InboundClientLayer, OutboundClientLayer, Tor1RelayCrypto};
+use crate::crypto::cell::{HopNum, InboundHopLayer, OutboundHopLayer, Tor1RelayCrypto};
 #[cfg(feature = "ntor_v3")]
 use crate::crypto::handshake::ntor_v3::{NtorV3Client, NtorV3PublicKey};
 use crate::stream::AnyCmdChecker;
@@ -327,6 +328,14 @@ impl<'a> ControlHandler<'a> {
 pub(crate) enum CtrlCmd {
     /// Shut down the reactor.
     Shutdown,
+    /// Change how the channel schedules this circuit's cells relative to
+    /// those of other circuits.
+    SetPriority {
+        /// The scheduling class to put this circuit in.
+        priority: CircPriority,
+        /// Oneshot channel to notify on completion.
+        done: ReactorResultChannel<()>,
+    },
     /// Extend the circuit by one hop, in response to an out-of-band handshake.
     ///
     /// (This is used for onion services, where the negotiation takes place in
@@ -338,11 +347,7 @@ pub(crate) enum CtrlCmd {
         /// The cryptographic algorithms and keys to use when communicating with
         /// the newly added hop.
         #[educe(Debug(ignore))]
-        cell_crypto: (
-            Box<dyn OutboundClientLayer + Send>,
-            Box<dyn InboundClientLayer + Send>,
-            Option<CircuitBinding>,
-        ),
+        cell_crypto: (OutboundHopLayer, InboundHopLayer, Option<CircuitBinding>),
         /// A set of parameters used to configure this hop.
         params: CircParameters,
         /// Oneshot channel to notify on completion.
@@ -402,6 +407,15 @@ impl<'a> CommandHandler<'a> {
         trace!("{}: reactor received {:?}", self.reactor.unique_id, msg);
         match msg {
             CtrlCmd::Shutdown => Err(ReactorError::Shutdown),
+            CtrlCmd::SetPriority { priority, done } => {
+                let ret = self
+                    .reactor
+                    .channel
+                    .set_circ_priority(self.reactor.channel_id, priority);
+                let _ = done.send(ret); // don't care if the corresponding receiver goes away.
+
+                Ok(())
+            }
             #[cfg(feature = "hs-common")]
             #[allow(unreachable_code)]
             CtrlCmd::ExtendVirtual {
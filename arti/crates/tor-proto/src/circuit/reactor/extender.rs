@@ -4,7 +4,8 @@ use super::{MetaCellDisposition, MetaCellHandler, Reactor, ReactorResultChannel}
 use crate::circuit::unique_id::UniqId;
 use crate::circuit::CircParameters;
 use crate::crypto::cell::{
-    ClientLayer, CryptInit, HopNum, InboundClientLayer, OutboundClientLayer,
+    ClientLayer, CryptInit, HopNum, InboundClientLayer, InboundHopLayer, OutboundClientLayer,
+    OutboundHopLayer,
 };
 use crate::crypto::handshake::fast::CreateFastClient;
 #[cfg(feature = "ntor_v3")]
@@ -177,8 +178,8 @@ where
         reactor.add_hop(
             self.relay_cell_format,
             path::HopDetail::Relay(self.peer_id.clone()),
-            Box::new(layer_fwd),
-            Box::new(layer_back),
+            OutboundHopLayer::new(layer_fwd),
+            InboundHopLayer::new(layer_back),
             Some(binding),
             &self.params,
         );
@@ -6,10 +6,14 @@ use crate::congestion::sendme;
 use crate::stream::{AnyCmdChecker, StreamSendFlowControl};
 use crate::util::stream_poll_set::{KeyAlreadyInsertedError, StreamPollSet};
 use crate::{Error, Result};
+use futures::StreamExt as _;
 use pin_project::pin_project;
 use tor_async_utils::peekable_stream::{PeekableStream, UnobtrusivePeekableStream};
 use tor_async_utils::stream_peek::StreamUnobtrusivePeeker;
-use tor_cell::relaycell::{msg::AnyRelayMsg, StreamId};
+use tor_cell::relaycell::{
+    msg::{AnyRelayMsg, Data},
+    StreamId,
+};
 use tor_cell::relaycell::{RelayMsg, UnparsedRelayMsg};
 
 use std::collections::hash_map;
@@ -47,7 +51,7 @@ pub(super) struct OpenStreamEnt {
     // `OpenStreamEntStream`s implementation of `Stream`, which in turn should
     // only be used through `StreamPollSet`.
     #[pin]
-    rx: StreamUnobtrusivePeeker<StreamMpscReceiver<AnyRelayMsg>>,
+    rx: StreamUnobtrusivePeeker<DataPacker<StreamMpscReceiver<AnyRelayMsg>>>,
     /// Waker to be woken when more sending capacity becomes available (e.g.
     /// receiving a SENDME).
     flow_ctrl_waker: Option<Waker>,
@@ -153,6 +157,104 @@ impl UnobtrusivePeekableStream for OpenStreamEntStream {
     }
 }
 
+/// Stream adaptor that packs consecutive small DATA messages into one.
+///
+/// A `DataWriter` sends a partial DATA message whenever it is flushed, so an
+/// application making many small writes (and flushing each) queues many
+/// partly filled messages for its stream. When we take a DATA message from
+/// the queue, we append any DATA messages that are *already* queued behind
+/// it, up to [`Data::MAXLEN`] bytes. We never wait for more data to arrive,
+/// so this adds no latency: it only saves cells (and SENDME window) when the
+/// circuit is already behind the application.
+///
+/// Messages other than DATA are passed through unchanged and in order.
+#[derive(Debug)]
+struct DataPacker<S> {
+    /// The underlying queue of messages.
+    inner: S,
+    /// A message we took from `inner` but couldn't pack; it goes next.
+    carry: Option<AnyRelayMsg>,
+    /// True if `inner` has returned `None`.
+    done: bool,
+}
+
+impl<S> DataPacker<S> {
+    /// Wrap `inner` in a new `DataPacker`.
+    fn new(inner: S) -> Self {
+        Self {
+            inner,
+            carry: None,
+            done: false,
+        }
+    }
+}
+
+impl<S> futures::Stream for DataPacker<S>
+where
+    S: futures::Stream<Item = AnyRelayMsg> + Unpin,
+{
+    type Item = AnyRelayMsg;
+
+    fn poll_next(
+        mut self: Pin<&mut Self>,
+        cx: &mut std::task::Context<'_>,
+    ) -> Poll<Option<Self::Item>> {
+        let this = &mut *self;
+        let first = match this.carry.take() {
+            Some(m) => m,
+            None if this.done => return Poll::Ready(None),
+            None => match this.inner.poll_next_unpin(cx) {
+                Poll::Ready(Some(m)) => m,
+                Poll::Ready(None) => {
+                    this.done = true;
+                    return Poll::Ready(None);
+                }
+                Poll::Pending => return Poll::Pending,
+            },
+        };
+        let AnyRelayMsg::Data(first) = first else {
+            return Poll::Ready(Some(first));
+        };
+
+        // Only copy if there turns out to be something to append.
+        let mut packed: Option<Vec<u8>> = None;
+        while !this.done && this.carry.is_none() {
+            let len = packed.as_ref().map_or(first.as_ref().len(), Vec::len);
+            if len >= Data::MAXLEN {
+                break;
+            }
+            // If this returns Pending, it registers `cx` to be woken when
+            // more arrives; that's harmless, since we return Ready below.
+            match this.inner.poll_next_unpin(cx) {
+                Poll::Ready(Some(AnyRelayMsg::Data(next))) => {
+                    let buf = packed.get_or_insert_with(|| {
+                        let mut buf = Vec::with_capacity(Data::MAXLEN);
+                        buf.extend_from_slice(first.as_ref());
+                        buf
+                    });
+                    let next = next.as_ref();
+                    let n = std::cmp::min(next.len(), Data::MAXLEN - len);
+                    buf.extend_from_slice(&next[..n]);
+                    this.carry = Data::try_split_from(&next[n..]).map(|(rest, remainder)| {
+                        debug_assert!(remainder.is_empty());
+                        rest.into()
+                    });
+                }
+                Poll::Ready(Some(other)) => this.carry = Some(other),
+                Poll::Ready(None) => this.done = true,
+                Poll::Pending => break,
+            }
+        }
+
+        // `buf` is never longer than MAXLEN, so there is no remainder.
+        let data = match packed.as_deref().and_then(Data::try_split_from) {
+            Some((data, _)) => data,
+            None => first,
+        };
+        Poll::Ready(Some(data.into()))
+    }
+}
+
 /// Entry for a stream where we have sent an END, or other message
 /// indicating that the stream is terminated.
 #[derive(Debug)]
@@ -280,7 +382,7 @@ impl StreamMap {
                 flow_ctrl: StreamSendFlowControl::new_window_based(send_window),
                 dropped: 0,
                 cmd_checker,
-                rx: StreamUnobtrusivePeeker::new(rx),
+                rx: StreamUnobtrusivePeeker::new(DataPacker::new(rx)),
                 flow_ctrl_waker: None,
             },
         };
@@ -321,7 +423,7 @@ impl StreamMap {
                 flow_ctrl: StreamSendFlowControl::new_window_based(send_window),
                 dropped: 0,
                 cmd_checker,
-                rx: StreamUnobtrusivePeeker::new(rx),
+                rx: StreamUnobtrusivePeeker::new(DataPacker::new(rx)),
                 flow_ctrl_waker: None,
             },
         };
@@ -526,6 +628,47 @@ mod test {
         assert_eq!(wrapping_next_stream_id(max), one);
     }
 
+    #[test]
+    fn data_packer() {
+        use tor_cell::relaycell::msg::End;
+
+        let data = |byte: u8, len: usize| AnyRelayMsg::from(Data::new(&vec![byte; len]).unwrap());
+        let input = vec![
+            data(b'a', 100),
+            data(b'b', 300),
+            data(b'c', 200),
+            End::new_misc().into(),
+            data(b'd', Data::MAXLEN),
+            data(b'e', 10),
+        ];
+        let packed: Vec<_> =
+            futures::executor::block_on(DataPacker::new(futures::stream::iter(input)).collect());
+
+        let mut first = vec![b'a'; 100];
+        first.extend_from_slice(&[b'b'; 300]);
+        first.extend_from_slice(&vec![b'c'; Data::MAXLEN - 400]);
+        let rest = vec![b'c'; 600 - Data::MAXLEN];
+
+        let bodies: Vec<Option<Vec<u8>>> = packed
+            .into_iter()
+            .map(|m| match m {
+                AnyRelayMsg::Data(d) => Some(d.into()),
+                AnyRelayMsg::End(_) => None,
+                _ => panic!(),
+            })
+            .collect();
+        assert_eq!(
+            bodies,
+            vec![
+                Some(first),
+                Some(rest),
+                None,
+                Some(vec![b'd'; Data::MAXLEN]),
+                Some(vec![b'e'; 10]),
+            ]
+        );
+    }
+
     #[test]
     #[allow(clippy::cognitive_complexity)]
     fn streammap_basics() -> Result<()> {
@@ -9,8 +9,8 @@ use tor_cell::relaycell::RelayCellFormatTrait;
 
 pub use super::cell::tor1::bench_utils::*;
 use super::cell::{
-    tor1::CryptStatePair, ClientLayer, CryptInit, InboundClientCrypt, OutboundClientCrypt,
-    RelayCrypt,
+    tor1::CryptStatePair, ClientLayer, CryptInit, InboundClientCrypt, InboundHopLayer,
+    OutboundClientCrypt, OutboundHopLayer, RelayCellBody, RelayCrypt,
 };
 
 /// Public wrapper around the `CryptStatePair` struct.
@@ -19,6 +19,15 @@ pub struct HopCryptState<SC: StreamCipher, D: Digest + Clone, RCF: RelayCellForm
     CryptStatePair<SC, D, RCF>,
 );
 
+/// Public wrapper around a run of `RelayCellBody`s, to be processed as a batch.
+pub struct RelayBodyBatch(Vec<RelayCellBody>);
+
+impl From<Vec<RelayBody>> for RelayBodyBatch {
+    fn from(bodies: Vec<RelayBody>) -> Self {
+        Self(bodies.into_iter().map(|body| body.0).collect())
+    }
+}
+
 /// Public wrapper around the `InboundClientCrypt` struct.
 #[repr(transparent)]
 pub struct InboundCryptWrapper(InboundClientCrypt);
@@ -53,7 +62,24 @@ impl InboundCryptWrapper {
     ) -> Result<()> {
         let layer: CryptStatePair<SC, D, RCF> = CryptStatePair::construct(KGen::new(seed))?;
         let (_outbound, inbound, _binding) = layer.split();
-        self.0.add_layer(Box::new(inbound));
+        self.0.add_layer(InboundHopLayer::new(inbound));
+
+        Ok(())
+    }
+
+    /// Like `add_layer_from_seed`, but always store the layer behind a
+    /// `Box<dyn ...>`, even when it could have been kept inline.
+    pub fn add_boxed_layer_from_seed<
+        SC: StreamCipher + KeyIvInit + Send + 'static,
+        D: Digest + Clone + Send + 'static,
+        RCF: RelayCellFormatTrait + Send + 'static,
+    >(
+        &mut self,
+        seed: SecretBuf,
+    ) -> Result<()> {
+        let layer: CryptStatePair<SC, D, RCF> = CryptStatePair::construct(KGen::new(seed))?;
+        let (_outbound, inbound, _binding) = layer.split();
+        self.0.add_layer(InboundHopLayer::Dyn(Box::new(inbound)));
 
         Ok(())
     }
@@ -82,7 +108,24 @@ impl OutboundCryptWrapper {
     ) -> Result<()> {
         let layer: CryptStatePair<SC, D, RCF> = CryptStatePair::construct(KGen::new(seed))?;
         let (outbound, _inbound, _binding) = layer.split();
-        self.0.add_layer(Box::new(outbound));
+        self.0.add_layer(OutboundHopLayer::new(outbound));
+
+        Ok(())
+    }
+
+    /// Like `add_layer_from_seed`, but always store the layer behind a
+    /// `Box<dyn ...>`, even when it could have been kept inline.
+    pub fn add_boxed_layer_from_seed<
+        SC: StreamCipher + KeyIvInit + Send + 'static,
+        D: Digest + Clone + Send + 'static,
+        RCF: RelayCellFormatTrait + Send + 'static,
+    >(
+        &mut self,
+        seed: SecretBuf,
+    ) -> Result<()> {
+        let layer: CryptStatePair<SC, D, RCF> = CryptStatePair::construct(KGen::new(seed))?;
+        let (outbound, _inbound, _binding) = layer.split();
+        self.0.add_layer(OutboundHopLayer::Dyn(Box::new(outbound)));
 
         Ok(())
     }
@@ -131,3 +174,14 @@ pub fn client_encrypt(
 
     Ok(())
 }
+
+/// Public wrapper around the `InboundClientCrypt::decrypt_batch` method
+/// for benchmarking purposes.
+pub fn client_decrypt_batch(
+    cells: &mut RelayBodyBatch,
+    cc_in: &mut InboundCryptWrapper,
+) -> Result<()> {
+    cc_in.0.decrypt_batch(&mut cells.0)?;
+
+    Ok(())
+}
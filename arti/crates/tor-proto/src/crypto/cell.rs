@@ -32,7 +32,9 @@
 
 use crate::{Error, Result};
 use derive_deftly::Deftly;
+use std::any::Any;
 use tor_cell::chancell::BoxedCellBody;
+use tor_cell::relaycell::RelayCellFormatV0;
 use tor_error::internal;
 use tor_memquota::derive_deftly_template_HasMemoryCost;
 
@@ -171,12 +173,133 @@ impl From<HopNum> for usize {
     }
 }
 
+/// The single-direction, single-hop state used by [`Tor1RelayCrypto`] with
+/// [`RelayCellFormatV0`].
+///
+/// Nearly every hop on a client circuit uses this type, so
+/// [`OutboundClientCrypt`] and [`InboundClientCrypt`] store these layers
+/// inline, rather than behind a `Box<dyn ...>`.
+pub(crate) type Tor1ClientLayer = tor1::CryptState<
+    tor_llcrypto::cipher::aes::Aes128Ctr,
+    tor_llcrypto::d::Sha1,
+    RelayCellFormatV0,
+>;
+
+/// The outbound cryptographic layer for a single hop, on its way to being
+/// added to an [`OutboundClientCrypt`].
+pub(crate) enum OutboundHopLayer {
+    /// A standard tor1 layer, whose concrete type we know.
+    Tor1(Box<Tor1ClientLayer>),
+    /// Any other kind of layer.
+    Dyn(Box<dyn OutboundClientLayer + Send>),
+}
+
+/// The inbound cryptographic layer for a single hop, on its way to being
+/// added to an [`InboundClientCrypt`].
+pub(crate) enum InboundHopLayer {
+    /// A standard tor1 layer, whose concrete type we know.
+    Tor1(Box<Tor1ClientLayer>),
+    /// Any other kind of layer.
+    Dyn(Box<dyn InboundClientLayer + Send>),
+}
+
+/// Helper: If `layer` is a [`Tor1ClientLayer`], return it as one; otherwise
+/// give it back unchanged.
+fn try_into_tor1<L: 'static>(layer: L) -> std::result::Result<Box<Tor1ClientLayer>, L> {
+    let mut layer = Some(layer);
+    match (&mut layer as &mut dyn Any).downcast_mut::<Option<Tor1ClientLayer>>() {
+        Some(tor1) => Ok(Box::new(tor1.take().expect("layer vanished"))),
+        None => Err(layer.expect("layer vanished")),
+    }
+}
+
+impl OutboundHopLayer {
+    /// Wrap `layer`, keeping track of its concrete type if it is a
+    /// [`Tor1ClientLayer`].
+    pub(crate) fn new<L: OutboundClientLayer + Send + 'static>(layer: L) -> Self {
+        match try_into_tor1(layer) {
+            Ok(tor1) => OutboundHopLayer::Tor1(tor1),
+            Err(layer) => OutboundHopLayer::Dyn(Box::new(layer)),
+        }
+    }
+}
+
+impl InboundHopLayer {
+    /// Wrap `layer`, keeping track of its concrete type if it is a
+    /// [`Tor1ClientLayer`].
+    pub(crate) fn new<L: InboundClientLayer + Send + 'static>(layer: L) -> Self {
+        match try_into_tor1(layer) {
+            Ok(tor1) => InboundHopLayer::Tor1(tor1),
+            Err(layer) => InboundHopLayer::Dyn(Box::new(layer)),
+        }
+    }
+}
+
+impl<L: OutboundClientLayer + ?Sized> OutboundClientLayer for Box<L> {
+    fn originate_for(&mut self, cell: &mut RelayCellBody) -> &[u8] {
+        (**self).originate_for(cell)
+    }
+    fn encrypt_outbound(&mut self, cell: &mut RelayCellBody) {
+        (**self).encrypt_outbound(cell);
+    }
+}
+
+impl<L: InboundClientLayer + ?Sized> InboundClientLayer for Box<L> {
+    fn decrypt_inbound(&mut self, cell: &mut RelayCellBody) -> Option<&[u8]> {
+        (**self).decrypt_inbound(cell)
+    }
+}
+
+/// The layers of a client circuit, in one direction.
+///
+/// As long as every hop uses [`Tor1ClientLayer`], the layers are kept in
+/// `Tor1`, and processed without any dynamic dispatch.  As soon as any other
+/// kind of layer is added, every layer is moved to `Dyn`.
+enum ClientLayers<D> {
+    /// Every layer is a standard tor1 layer.
+    Tor1(Vec<Tor1ClientLayer>),
+    /// At least one layer is of some other type.
+    Dyn(Vec<D>),
+}
+
+impl<D> ClientLayers<D> {
+    /// Return the number of layers in this object.
+    fn len(&self) -> usize {
+        match self {
+            ClientLayers::Tor1(v) => v.len(),
+            ClientLayers::Dyn(v) => v.len(),
+        }
+    }
+
+    /// Add a tor1 layer, which can stay unboxed if every other layer is
+    /// also a tor1 layer.
+    fn push_tor1(&mut self, layer: Tor1ClientLayer, boxed: impl FnOnce(Tor1ClientLayer) -> D) {
+        assert!(self.len() < u8::MAX as usize);
+        match self {
+            ClientLayers::Tor1(v) => v.push(layer),
+            ClientLayers::Dyn(v) => v.push(boxed(layer)),
+        }
+    }
+
+    /// Add a layer of some other type, moving every existing layer to the
+    /// slower `Dyn` representation if necessary.
+    fn push_dyn(&mut self, layer: D, boxed: impl FnMut(Tor1ClientLayer) -> D) {
+        assert!(self.len() < u8::MAX as usize);
+        if let ClientLayers::Tor1(v) = self {
+            *self = ClientLayers::Dyn(std::mem::take(v).into_iter().map(boxed).collect());
+        }
+        if let ClientLayers::Dyn(v) = self {
+            v.push(layer);
+        }
+    }
+}
+
 /// A client's view of the cryptographic state for an entire
 /// constructed circuit, as used for sending cells.
 pub(crate) struct OutboundClientCrypt {
     /// Vector of layers, one for each hop on the circuit, ordered from the
     /// closest hop to the farthest.
-    layers: Vec<Box<dyn OutboundClientLayer + Send>>,
+    layers: ClientLayers<Box<dyn OutboundClientLayer + Send>>,
 }
 
 /// A client's view of the cryptographic state for an entire
@@ -184,17 +307,92 @@ pub(crate) struct OutboundClientCrypt {
 pub(crate) struct InboundClientCrypt {
     /// Vector of layers, one for each hop on the circuit, ordered from the
     /// closest hop to the farthest.
-    layers: Vec<Box<dyn InboundClientLayer + Send>>,
+    layers: ClientLayers<Box<dyn InboundClientLayer + Send>>,
 }
 
 /// The length of the tag that we include (with this algorithm) in an
 /// authenticated SENDME message.
 pub(crate) const SENDME_TAG_LEN: usize = 20;
 
+/// Helper: prepare `cell` for the `hop`th entry of `layers`, and encrypt it
+/// with every layer up to and including that one.
+///
+/// This is generic so that it gets monomorphized separately for inline and
+/// boxed layers.
+fn encrypt_with<'a, L: OutboundClientLayer>(
+    layers: &'a mut [L],
+    cell: &mut RelayCellBody,
+    hop: usize,
+) -> Result<&'a [u8; SENDME_TAG_LEN]> {
+    let (first_layer, layers) = layers
+        .get_mut(..=hop)
+        .and_then(<[L]>::split_last_mut)
+        .ok_or(Error::NoSuchHop)?;
+    let tag = first_layer.originate_for(cell);
+    for layer in layers.iter_mut().rev() {
+        layer.encrypt_outbound(cell);
+    }
+    Ok(tag.try_into().expect("wrong SENDME digest size"))
+}
+
+/// Helper: decrypt `cell` with each of `layers` in turn, until one of them
+/// recognizes it.
+///
+/// This is generic so that it gets monomorphized separately for inline and
+/// boxed layers.
+fn decrypt_with<'a, L: InboundClientLayer>(
+    layers: &'a mut [L],
+    cell: &mut RelayCellBody,
+) -> Result<(HopNum, &'a [u8])> {
+    for (hopnum, layer) in layers.iter_mut().enumerate() {
+        if let Some(tag) = layer.decrypt_inbound(cell) {
+            let hopnum = HopNum(u8::try_from(hopnum).expect("Somehow > 255 hops"));
+            return Ok((hopnum, tag));
+        }
+    }
+    Err(Error::BadCellAuth)
+}
+
+/// Helper: like `decrypt_with`, but for a batch of cells.
+///
+/// Each layer processes every cell before the next layer starts, so that its
+/// keystream and digest state stay hot.  A cell that one layer recognizes is
+/// not shown to any later layer, so every layer sees exactly the same cells,
+/// in the same order, as it would if the cells were decrypted one at a time.
+fn decrypt_batch_with<L: InboundClientLayer>(
+    layers: &mut [L],
+    cells: &mut [RelayCellBody],
+) -> Result<Vec<(HopNum, [u8; SENDME_TAG_LEN])>> {
+    let mut found: Vec<Option<(HopNum, [u8; SENDME_TAG_LEN])>> = vec![None; cells.len()];
+    let mut n_remaining = cells.len();
+    for (hopnum, layer) in layers.iter_mut().enumerate() {
+        if n_remaining == 0 {
+            break;
+        }
+        let hopnum = HopNum(u8::try_from(hopnum).expect("Somehow > 255 hops"));
+        for (cell, found) in cells.iter_mut().zip(found.iter_mut()) {
+            if found.is_some() {
+                continue;
+            }
+            if let Some(tag) = layer.decrypt_inbound(cell) {
+                let tag = tag.try_into().expect("wrong SENDME digest size");
+                *found = Some((hopnum, tag));
+                n_remaining -= 1;
+            }
+        }
+    }
+    found
+        .into_iter()
+        .map(|found| found.ok_or(Error::BadCellAuth))
+        .collect()
+}
+
 impl OutboundClientCrypt {
     /// Return a new (empty) OutboundClientCrypt.
     pub(crate) fn new() -> Self {
-        OutboundClientCrypt { layers: Vec::new() }
+        OutboundClientCrypt {
+            layers: ClientLayers::Tor1(Vec::new()),
+        }
     }
     /// Prepare a cell body to sent away from the client.
     ///
@@ -209,23 +407,19 @@ impl OutboundClientCrypt {
         hop: HopNum,
     ) -> Result<&[u8; SENDME_TAG_LEN]> {
         let hop: usize = hop.into();
-        if hop >= self.layers.len() {
-            return Err(Error::NoSuchHop);
-        }
-
-        let mut layers = self.layers.iter_mut().take(hop + 1).rev();
-        let first_layer = layers.next().ok_or(Error::NoSuchHop)?;
-        let tag = first_layer.originate_for(cell);
-        for layer in layers {
-            layer.encrypt_outbound(cell);
+        match &mut self.layers {
+            ClientLayers::Tor1(layers) => encrypt_with(layers, cell, hop),
+            ClientLayers::Dyn(layers) => encrypt_with(layers, cell, hop),
         }
-        Ok(tag.try_into().expect("wrong SENDME digest size"))
     }
 
     /// Add a new layer to this OutboundClientCrypt
-    pub(crate) fn add_layer(&mut self, layer: Box<dyn OutboundClientLayer + Send>) {
-        assert!(self.layers.len() < u8::MAX as usize);
-        self.layers.push(layer);
+    pub(crate) fn add_layer(&mut self, layer: OutboundHopLayer) {
+        let boxed = |l: Tor1ClientLayer| -> Box<dyn OutboundClientLayer + Send> { Box::new(l) };
+        match layer {
+            OutboundHopLayer::Tor1(layer) => self.layers.push_tor1(*layer, boxed),
+            OutboundHopLayer::Dyn(layer) => self.layers.push_dyn(layer, boxed),
+        }
     }
 
     /// Return the number of layers configured on this OutboundClientCrypt.
@@ -237,25 +431,45 @@ impl OutboundClientCrypt {
 impl InboundClientCrypt {
     /// Return a new (empty) InboundClientCrypt.
     pub(crate) fn new() -> Self {
-        InboundClientCrypt { layers: Vec::new() }
+        InboundClientCrypt {
+            layers: ClientLayers::Tor1(Vec::new()),
+        }
     }
     /// Decrypt an incoming cell that is coming to the client.
     ///
     /// On success, return which hop was the originator of the cell.
     // TODO(nickm): Use a real type for the tag, not just `&[u8]`.
     pub(crate) fn decrypt(&mut self, cell: &mut RelayCellBody) -> Result<(HopNum, &[u8])> {
-        for (hopnum, layer) in self.layers.iter_mut().enumerate() {
-            if let Some(tag) = layer.decrypt_inbound(cell) {
-                let hopnum = HopNum(u8::try_from(hopnum).expect("Somehow > 255 hops"));
-                return Ok((hopnum, tag));
-            }
+        match &mut self.layers {
+            ClientLayers::Tor1(layers) => decrypt_with(layers, cell),
+            ClientLayers::Dyn(layers) => decrypt_with(layers, cell),
+        }
+    }
+    /// Decrypt a batch of incoming cells that are coming to the client.
+    ///
+    /// This has the same effect as calling [`decrypt`](Self::decrypt) on each
+    /// cell in order, but is faster for long runs of cells.
+    ///
+    /// On success, return which hop originated each cell, along with its
+    /// authentication tag, in the same order as `cells`.  If any cell is not
+    /// recognized by any hop, return an error: in that case, the state of this
+    /// object is unspecified, and the circuit must be closed.
+    pub(crate) fn decrypt_batch(
+        &mut self,
+        cells: &mut [RelayCellBody],
+    ) -> Result<Vec<(HopNum, [u8; SENDME_TAG_LEN])>> {
+        match &mut self.layers {
+            ClientLayers::Tor1(layers) => decrypt_batch_with(layers, cells),
+            ClientLayers::Dyn(layers) => decrypt_batch_with(layers, cells),
         }
-        Err(Error::BadCellAuth)
     }
     /// Add a new layer to this InboundClientCrypt
-    pub(crate) fn add_layer(&mut self, layer: Box<dyn InboundClientLayer + Send>) {
-        assert!(self.layers.len() < u8::MAX as usize);
-        self.layers.push(layer);
+    pub(crate) fn add_layer(&mut self, layer: InboundHopLayer) {
+        let boxed = |l: Tor1ClientLayer| -> Box<dyn InboundClientLayer + Send> { Box::new(l) };
+        match layer {
+            InboundHopLayer::Tor1(layer) => self.layers.push_tor1(*layer, boxed),
+            InboundHopLayer::Dyn(layer) => self.layers.push_dyn(layer, boxed),
+        }
     }
 
     /// Return the number of layers configured on this InboundClientCrypt.
@@ -613,8 +827,20 @@ mod test {
         pair: Tor1RelayCrypto<RelayCellFormatV0>,
     ) {
         let (outbound, inbound, _) = pair.split();
-        cc_out.add_layer(Box::new(outbound));
-        cc_in.add_layer(Box::new(inbound));
+        cc_out.add_layer(OutboundHopLayer::new(outbound));
+        cc_in.add_layer(InboundHopLayer::new(inbound));
+    }
+
+    /// Like `add_layers`, but hide the layers' types, so that the crypt
+    /// objects have to use dynamic dispatch.
+    fn add_dyn_layers(
+        cc_out: &mut OutboundClientCrypt,
+        cc_in: &mut InboundClientCrypt,
+        pair: Tor1RelayCrypto<RelayCellFormatV0>,
+    ) {
+        let (outbound, inbound, _) = pair.split();
+        cc_out.add_layer(OutboundHopLayer::Dyn(Box::new(outbound)));
+        cc_in.add_layer(InboundHopLayer::Dyn(Box::new(inbound)));
     }
 
     #[test]
@@ -694,6 +920,140 @@ mod test {
         }
     }
 
+    #[test]
+    fn tor1_matches_dyn() {
+        // Make sure that the inline tor1 layers behave exactly like the boxed
+        // ones, including when a circuit switches representation halfway.
+        use crate::crypto::handshake::ShakeKeyGenerator as KGen;
+        let seeds: [&[u8]; 3] = [b"one hop", b"two hops", b"three hops"];
+        let pair = |seed: &[u8]| {
+            Tor1RelayCrypto::<RelayCellFormatV0>::construct(KGen::new(seed.to_vec().into()))
+                .unwrap()
+        };
+
+        let mut fast_out = OutboundClientCrypt::new();
+        let mut fast_in = InboundClientCrypt::new();
+        let mut slow_out = OutboundClientCrypt::new();
+        let mut slow_in = InboundClientCrypt::new();
+        let mut mixed_out = OutboundClientCrypt::new();
+        let mut mixed_in = InboundClientCrypt::new();
+        for (idx, seed) in seeds.into_iter().enumerate() {
+            add_layers(&mut fast_out, &mut fast_in, pair(seed));
+            add_dyn_layers(&mut slow_out, &mut slow_in, pair(seed));
+            if idx == 1 {
+                add_dyn_layers(&mut mixed_out, &mut mixed_in, pair(seed));
+            } else {
+                add_layers(&mut mixed_out, &mut mixed_in, pair(seed));
+            }
+        }
+        assert!(matches!(fast_out.layers, ClientLayers::Tor1(_)));
+        assert!(matches!(fast_in.layers, ClientLayers::Tor1(_)));
+        assert!(matches!(slow_out.layers, ClientLayers::Dyn(_)));
+        assert!(matches!(mixed_in.layers, ClientLayers::Dyn(_)));
+        assert_eq!(mixed_out.n_layers(), 3);
+
+        let mut rng = testing_rng();
+        for hop in [2, 0, 1, 2, 2] {
+            let mut body = Box::new([0_u8; 509]);
+            rng.fill_bytes(&mut body[..]);
+            let mut fast: RelayCellBody = body.clone().into();
+            let mut slow: RelayCellBody = body.clone().into();
+            let mut mixed: RelayCellBody = body.into();
+            let fast_tag = *fast_out.encrypt(&mut fast, hop.into()).unwrap();
+            let slow_tag = *slow_out.encrypt(&mut slow, hop.into()).unwrap();
+            let mixed_tag = *mixed_out.encrypt(&mut mixed, hop.into()).unwrap();
+            assert_eq!(fast.as_ref(), slow.as_ref());
+            assert_eq!(fast.as_ref(), mixed.as_ref());
+            assert_eq!(fast_tag, slow_tag);
+            assert_eq!(fast_tag, mixed_tag);
+
+            // None of these cells were made by a relay, so no layer
+            // should recognize them.
+            assert!(matches!(
+                fast_in.decrypt(&mut fast),
+                Err(Error::BadCellAuth)
+            ));
+            assert!(matches!(
+                slow_in.decrypt(&mut slow),
+                Err(Error::BadCellAuth)
+            ));
+            assert!(matches!(
+                mixed_in.decrypt(&mut mixed),
+                Err(Error::BadCellAuth)
+            ));
+            assert_eq!(fast.as_ref(), slow.as_ref());
+            assert_eq!(fast.as_ref(), mixed.as_ref());
+        }
+
+        let mut cell = Box::new([0_u8; 509]).into();
+        assert!(matches!(
+            fast_out.encrypt(&mut cell, 3.into()),
+            Err(Error::NoSuchHop)
+        ));
+    }
+
+    #[test]
+    fn batch_matches_single() {
+        use crate::crypto::handshake::ShakeKeyGenerator as KGen;
+        let seeds: [&[u8]; 3] = [b"batch one", b"batch two", b"batch three"];
+        let pair = |seed: &[u8]| {
+            Tor1RelayCrypto::<RelayCellFormatV0>::construct(KGen::new(seed.to_vec().into()))
+                .unwrap()
+        };
+
+        let mut cc_out = OutboundClientCrypt::new();
+        let mut single_in = InboundClientCrypt::new();
+        let mut batch_in = InboundClientCrypt::new();
+        let mut relays = Vec::new();
+        for seed in seeds {
+            add_layers(&mut cc_out, &mut single_in, pair(seed));
+            add_layers(&mut cc_out, &mut batch_in, pair(seed));
+            relays.push(pair(seed));
+        }
+
+        let mut rng = testing_rng();
+        let mut random_cell = || -> RelayCellBody {
+            let mut body = Box::new([0_u8; 509]);
+            rng.fill_bytes(&mut body[..]);
+            body.into()
+        };
+
+        // A batch of cells from a mixture of hops.
+        let origins = [2, 2, 0, 1, 2, 0, 0, 2, 1, 2];
+        let mut cells = Vec::new();
+        for origin in origins {
+            let mut cell = random_cell();
+            relays[origin].originate(&mut cell);
+            for relay in relays[..=origin].iter_mut().rev() {
+                relay.encrypt_inbound(&mut cell);
+            }
+            cells.push(cell);
+        }
+        let mut expected = cells.clone();
+        let expected_hops: Vec<(HopNum, [u8; SENDME_TAG_LEN])> = expected
+            .iter_mut()
+            .map(|cell| {
+                let (hop, tag) = single_in.decrypt(cell).unwrap();
+                (hop, tag.try_into().unwrap())
+            })
+            .collect();
+        let hops = batch_in.decrypt_batch(&mut cells).unwrap();
+        assert_eq!(hops, expected_hops);
+        for ((hop, _), origin) in hops.iter().zip(origins) {
+            assert_eq!(*hop, HopNum::from(origin as u8));
+        }
+        for (cell, expected) in cells.iter().zip(expected.iter()) {
+            assert_eq!(cell.as_ref(), expected.as_ref());
+        }
+
+        // A junk cell anywhere in the batch is an error.
+        let mut cells = vec![random_cell(), random_cell()];
+        assert!(matches!(
+            batch_in.decrypt_batch(&mut cells),
+            Err(Error::BadCellAuth)
+        ));
+    }
+
     // From tor's test_relaycrypt.c
 
     #[test]
@@ -930,6 +930,21 @@ impl DataReaderImpl {
     async fn read_cell(mut self) -> (Self, Result<()>) {
         use DataStreamMsg::*;
         let msg = match self.s.recv().await {
+            // Fast path: copy a DATA message's body straight out of the cell,
+            // rather than decoding it into a freshly allocated `Data`.
+            Ok(unparsed) if self.connected && unparsed.cmd() == RelayCmd::DATA => {
+                let result = match unparsed.data_body() {
+                    Ok(body) => {
+                        self.add_data(body.unwrap_or_default());
+                        Ok(())
+                    }
+                    Err(e) => {
+                        self.s.protocol_error();
+                        Err(Error::from_bytes_err(e, "message on a data stream"))
+                    }
+                };
+                return (self, result);
+            }
             Ok(unparsed) => match unparsed.decode::<DataStreamMsg>() {
                 Ok(cell) => cell.into_msg(),
                 Err(e) => {
@@ -962,7 +977,7 @@ impl DataReaderImpl {
                 ))
             }
             Data(d) if self.connected => {
-                self.add_data(d.into());
+                self.add_data(d.as_ref());
                 Ok(())
             }
             Data(_) => {
@@ -978,18 +993,17 @@ impl DataReaderImpl {
     }
 
     /// Add the data from `d` to the end of our pending bytes.
-    fn add_data(&mut self, mut d: Vec<u8>) {
+    fn add_data(&mut self, d: &[u8]) {
         if self.buf_is_empty() {
-            // No data pending?  Just take d as the new pending.
-            self.pending = d;
+            // No data pending?  Reuse our buffer (and its allocation) for d.
+            self.pending.clear();
             self.offset = 0;
-        } else {
-            // TODO(nickm) This has potential to grow `pending` without bound.
-            // Fortunately, we don't currently read cells or call this
-            // `add_data` method when pending is nonempty—but if we do in the
-            // future, we'll have to be careful here.
-            self.pending.append(&mut d);
         }
+        // TODO(nickm) This has potential to grow `pending` without bound.
+        // Fortunately, we don't currently read cells or call this
+        // `add_data` method when pending is nonempty—but if we do in the
+        // future, we'll have to be careful here.
+        self.pending.extend_from_slice(d);
     }
 }
 
@@ -1,7 +1,16 @@
+mod tor_bwscan;
 mod tor_circmgr;
 mod tor_chanmgr;
+mod tor_daemon;
+mod tor_events;
+mod tor_geopath;
 mod tor_hs_client;
 mod tor_hs_connector;
+mod tor_idle;
+mod tor_multipath;
+mod tor_probe;
+mod tor_ratelimit;
+mod tor_relaydb;
 
 mod test;
 
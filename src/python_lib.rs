@@ -1,45 +1,329 @@
+mod tor_bwscan;
 mod tor_circmgr;
 mod tor_chanmgr;
+mod tor_daemon;
+mod tor_events;
+mod tor_geopath;
 mod tor_hs_client;
 mod tor_hs_connector;
+mod tor_idle;
+mod tor_multipath;
+mod tor_probe;
+mod tor_ratelimit;
+mod tor_relaydb;
 
-use tor_circmgr::TorCircuitManager;
+use tor_bwscan::{ScanBudget, ScanServer};
+use tor_circmgr::{RelaySpec, TorCircuitManager};
+use tor_daemon::{DaemonClient, DaemonHandle};
+use tor_events::{EventBus, EventValue, TorEvent};
+use tor_geopath::{GeoPath, GeoPathLimits};
+use tor_hsclient::HsDescFetchHedging;
+use tor_proto::channel::CircPriority;
 use tor_rtcompat::{BlockOn, PreferredRuntime};
 use tor_hs_client::TorHSClient;
+use tor_ratelimit::{Limiter, TrafficRateLimit};
 
-use log::info;
+use log::{info, warn};
 use pyo3::prelude::*;
 use pyo3::exceptions::PyValueError;
+use pyo3::types::{PyDict, PyList};
 use std::collections::HashMap;
-use futures::{AsyncReadExt, AsyncWriteExt};
+use std::os::fd::IntoRawFd;
+use std::path::Path;
+use std::sync::{Arc, Mutex, Weak};
+use std::time::{Duration, Instant, UNIX_EPOCH};
+use futures::{AsyncRead, AsyncReadExt, AsyncWrite, AsyncWriteExt, StreamExt};
 
+/// Build the runtime that drives our channel and circuit reactors.
+///
+/// Each circuit reactor runs as its own task and does all onion-layer crypto
+/// for its circuit, so on a multi-threaded runtime the crypto for circuits
+/// sharing one guard channel is spread over the worker pool while cells on any
+/// one circuit stay in order. `worker_threads` bounds that pool; `None` keeps
+/// tokio's default of one worker per core.
+fn build_runtime(
+    worker_threads: Option<usize>,
+) -> PyResult<(tokio::runtime::Runtime, PreferredRuntime)> {
+    let mut builder = tokio::runtime::Builder::new_multi_thread();
+    builder.enable_all().thread_name("pyarti-worker");
+    if let Some(n) = worker_threads {
+        if n == 0 {
+            return Err(PyValueError::new_err("worker_threads must be at least 1"));
+        }
+        builder.worker_threads(n);
+    }
+    let tokio_rt = builder.build()?;
+    let runtime = {
+        let _guard = tokio_rt.enter();
+        PreferredRuntime::current()?
+    };
+
+    Ok((tokio_rt, runtime))
+}
+
+/// Split `url` into its host and path.
+fn split_url(url: &str) -> PyResult<(&str, String)> {
+    let (_, rest) = url.split_once("://")
+        .ok_or_else(|| PyValueError::new_err("Invalid URL: Missing scheme (http or https)"))?;
+
+    Ok(match rest.split_once('/') {
+        Some((host, path)) => (host, format!("/{}", path)),
+        None => (rest, "/".to_string()),
+    })
+}
+
+/// Send an HTTP GET for `path` on `stream` and read the whole response.
+async fn http_get<S>(mut stream: S, host: &str, path: &str) -> PyResult<String>
+where
+    S: AsyncRead + AsyncWrite + Unpin,
+{
+    let request = format!(
+        "GET {} HTTP/1.1\r\n\
+            Host: {}\r\n\
+            Connection: close\r\n\
+            \r\n",
+        path, host
+    );
+
+    // Write request to the stream
+    stream.write_all(request.as_bytes()).await.map_err(|e| {
+        PyValueError::new_err(format!("Connection failed to write request: {}", e))
+    })?;
+
+    // IMPORTANT: Make sure the request was written.
+    // Arti buffers data, so flushing the buffer is usually required.
+    stream.flush().await.map_err(|e| {
+        PyValueError::new_err(format!("Failed to flush stream: {}", e))
+    })?;
+
+    // Read the response into a string. On an optimistic stream, this is also
+    // where we learn that the exit refused the BEGIN.
+    let mut response = String::new();
+    match stream.read_to_string(&mut response).await {
+        Ok(_) => Ok(response),
+        Err(e) => Err(PyValueError::new_err(format!("Failed to read response: {}", e))),
+    }
+}
+
+/// Set the rate limit for `scope` ("process", "client", "circuit" or
+/// "stream") under `client`, the limiter of one client.
+///
+/// `bytes_per_sec` of None removes the limit.
+fn set_rate_limit(
+    client: &Arc<Limiter>,
+    scope: &str,
+    bytes_per_sec: Option<u64>,
+    burst: Option<u64>,
+) -> PyResult<()> {
+    let limit = bytes_per_sec
+        .map(|bps| TrafficRateLimit::new(bps, burst))
+        .transpose()
+        .map_err(|e| PyValueError::new_err(format!("Invalid rate limit: {}", e)))?;
+    let res = match scope {
+        "process" => Limiter::process().set_limit(0, limit),
+        "client" => client.set_limit(0, limit),
+        "circuit" => client.set_limit(1, limit),
+        "stream" => client.set_limit(2, limit),
+        _ => return Err(PyValueError::new_err(format!("Unknown scope: {}", scope))),
+    };
+
+    res.map_err(|e| PyValueError::new_err(format!("Failed to set rate limit: {}", e)))
+}
+
+/// Convert `path` to the dict `PyArtiClient.geo_path` returns.
+fn geo_path_dict(py: Python<'_>, path: GeoPath) -> PyResult<PyObject> {
+    let dict = PyDict::new(py);
+    dict.set_item("hops", path.hops)?;
+    dict.set_item("countries", path.countries)?;
+    dict.set_item("estimated_rtt_ms", path.estimated_rtt_ms)?;
+
+    Ok(dict.to_object(py))
+}
+
+/// Most events we hand to Python in one batch.
+const EVENT_BATCH_MAX: usize = 256;
+
+/// How long we wait for more events to join a batch once one has arrived.
+const EVENT_BATCH_LINGER: Duration = Duration::from_millis(50);
+
+/// Somewhere to deliver batches of events.
+#[derive(Clone)]
+enum EventSink {
+    /// Called with each batch.
+    Callback(PyObject),
+    /// An asyncio queue, which gets each batch through its event loop.
+    Queue { queue: PyObject, event_loop: PyObject },
+}
+
+/// Delivers a client's events to Python.
+///
+/// A thread of our own waits for events, so Rust code never blocks on (or
+/// takes the GIL for) Python, and takes the GIL once per batch rather than
+/// once per event.
+struct EventDispatcher {
+    bus: Arc<EventBus>,
+    sinks: Arc<Mutex<Vec<EventSink>>>,
+    started: Mutex<bool>,
+}
+
+impl EventDispatcher {
+    fn new(bus: Arc<EventBus>) -> Self {
+        Self { bus, sinks: Arc::new(Mutex::new(Vec::new())), started: Mutex::new(false) }
+    }
+
+    fn add(&self, sink: EventSink) -> PyResult<()> {
+        self.sinks.lock().expect("poisoned lock").push(sink);
+
+        let mut started = self.started.lock().expect("poisoned lock");
+        if !*started {
+            self.bus.listen();
+            let bus = Arc::downgrade(&self.bus);
+            let sinks = self.sinks.clone();
+            std::thread::Builder::new()
+                .name("pyarti-events".to_string())
+                .spawn(move || dispatch_events(bus, sinks))?;
+            *started = true;
+        }
+
+        Ok(())
+    }
+
+    fn clear(&self) {
+        self.sinks.lock().expect("poisoned lock").clear();
+    }
+}
+
+/// Hand batches of events from `bus` to `sinks` until the bus is gone.
+fn dispatch_events(bus: Weak<EventBus>, sinks: Arc<Mutex<Vec<EventSink>>>) {
+    // Wake up now and then, to notice if the client has gone.
+    while let Some(bus) = bus.upgrade() {
+        let batch = bus.next_batch(EVENT_BATCH_MAX, Duration::from_secs(1), EVENT_BATCH_LINGER);
+        drop(bus);
+        if batch.is_empty() {
+            continue;
+        }
+
+        Python::with_gil(|py| {
+            let batch = match event_list(py, &batch) {
+                Ok(list) => list,
+                Err(e) => {
+                    warn!("Failed to convert events: {}", e);
+                    return;
+                }
+            };
+            // Callbacks may add or remove sinks, so don't hold the lock.
+            let sinks = sinks.lock().expect("poisoned lock").clone();
+            for sink in sinks {
+                let res = match sink {
+                    EventSink::Callback(callback) => callback.call1(py, (batch,)),
+                    EventSink::Queue { queue, event_loop } => queue.getattr(py, "put_nowait")
+                        .and_then(|put| event_loop.call_method1(py, "call_soon_threadsafe", (put, batch))),
+                };
+                if let Err(e) = res {
+                    warn!("Failed to deliver events: {}", e);
+                }
+            }
+        });
+    }
+}
+
+/// Convert `events` to a list of dicts, each with the event's "kind", "at"
+/// (seconds since the epoch) and fields.
+fn event_list<'py>(py: Python<'py>, events: &[TorEvent]) -> PyResult<&'py PyList> {
+    let list = PyList::empty(py);
+    for event in events {
+        let dict = PyDict::new(py);
+        dict.set_item("kind", event.kind)?;
+        let at = event.at.duration_since(UNIX_EPOCH).map_or(0.0, |d| d.as_secs_f64());
+        dict.set_item("at", at)?;
+        for (name, value) in &event.fields {
+            match value {
+                EventValue::Int(v) => dict.set_item(*name, v)?,
+                EventValue::Float(v) => dict.set_item(*name, v)?,
+                EventValue::Str(v) => dict.set_item(*name, v)?,
+            }
+        }
+        list.append(dict)?;
+    }
+
+    Ok(list)
+}
 
 #[pyclass]
-#[pyo3(text_signature = "()")]
+#[pyo3(text_signature = "(worker_threads=None)")]
 pub struct PyArtiClient {
     runtime: PreferredRuntime,
     circ_manager: TorCircuitManager<PreferredRuntime>,
+    events: EventDispatcher,
+    /// Set while we serve circuits to other processes.
+    daemon: Mutex<Option<DaemonHandle>>,
+    // Owns the worker pool behind `runtime`; must outlive it.
+    _tokio_rt: tokio::runtime::Runtime,
 }
 
 #[pymethods]
 impl PyArtiClient {
     #[new]
-    fn new() -> PyResult<Self> {
-        let runtime = PreferredRuntime::create()?;
+    #[pyo3(signature = (worker_threads=None))]
+    fn new(worker_threads: Option<usize>) -> PyResult<Self> {
+        let (_tokio_rt, runtime) = build_runtime(worker_threads)?;
         let circ_manager = TorCircuitManager::new(runtime.clone())
         .map_err(|e| PyValueError::new_err(format!("Failed to create circuit manager: {}", e)))?;
+        let events = EventDispatcher::new(circ_manager.events().clone());
 
-        Ok(Self { runtime, circ_manager })
+        Ok(Self { runtime, circ_manager, events, daemon: Mutex::new(None), _tokio_rt })
     }
 
-    #[pyo3(text_signature = "()")]
-    fn init(&self) -> PyResult<()> {
+    /// Bootstrap, and open the relay performance database.
+    ///
+    /// `storage` may give a `state_dir` and `cache_dir`, as for
+    /// `PyArtiHSClient.init`; the database lives under the state directory.
+    #[pyo3(signature = (storage=None))]
+    #[pyo3(text_signature = "(storage=None)")]
+    fn init(&mut self, storage: Option<HashMap<String, String>>) -> PyResult<()> {
         self.runtime.block_on(async {
-            self.circ_manager.init().await
+            self.circ_manager.init(storage.as_ref()).await
                 .map_err(|e| PyValueError::new_err(format!("Initialization failed: {}", e)))
         })
     }
 
+    /// Return what we have recently observed about the relay `rsa_id`.
+    ///
+    /// The result maps `builds_succeeded`, `builds_failed`, `handshake_ms`,
+    /// `throughput_bps`, `lifetime_secs`, `scanned_bps` (each None if never
+    /// observed) and
+    /// `score`, a number in (0, 1) for ranking relays; higher is better.
+    #[pyo3(text_signature = "(rsa_id)")]
+    fn relay_stats(&self, py: Python<'_>, rsa_id: &str) -> PyResult<HashMap<&'static str, Option<f64>>> {
+        let circ_manager = &self.circ_manager;
+        let stats = py.allow_threads(|| circ_manager.relay_stats(rsa_id))
+            .map_err(|e| PyValueError::new_err(format!("Failed to read relay stats: {}", e)))?;
+
+        Ok(HashMap::from([
+            ("builds_succeeded", Some(stats.builds_succeeded as f64)),
+            ("builds_failed", Some(stats.builds_failed as f64)),
+            ("handshake_ms", stats.handshake_ms),
+            ("throughput_bps", stats.throughput_bps),
+            ("lifetime_secs", stats.lifetime_secs),
+            ("scanned_bps", stats.scanned_bps),
+            ("score", Some(stats.score())),
+        ]))
+    }
+
+    /// Return `rsa_ids` ordered best first by their relay score.
+    #[pyo3(text_signature = "(rsa_ids)")]
+    fn rank_relays(&self, py: Python<'_>, rsa_ids: Vec<String>) -> PyResult<Vec<(String, f64)>> {
+        let circ_manager = &self.circ_manager;
+        let stats = py.allow_threads(|| circ_manager.relays_stats(&rsa_ids))
+            .map_err(|e| PyValueError::new_err(format!("Failed to read relay stats: {}", e)))?;
+        let mut ranked: Vec<(String, f64)> = rsa_ids.into_iter()
+            .zip(stats.iter().map(|stats| stats.score()))
+            .collect();
+        ranked.sort_by(|(_, a), (_, b)| b.total_cmp(a));
+
+        Ok(ranked)
+    }
+
     #[pyo3(text_signature = "(relay_ip, relay_port, rsa_id)")]
     fn create(
         &mut self,
@@ -86,72 +370,369 @@ impl PyArtiClient {
         })
     }
 
-    #[pyo3(text_signature = "(url, port)")]
-    fn connect(&self, url: &str, port: u16) -> PyResult<String> {
-        let (_, rest) = url.split_once("://")
-            .ok_or_else(|| PyValueError::new_err("Invalid URL: Missing scheme (http or https)"))?;
-    
-        let (host, path) = match rest.split_once('/') {
-            Some((host, path)) => (host, format!("/{}", path)),
-            None => (rest, "/".to_string()),
+    #[pyo3(text_signature = "(priority)")]
+    fn set_priority(&self, priority: &str) -> PyResult<()> {
+        let priority = match priority {
+            "interactive" => CircPriority::Interactive,
+            "normal" => CircPriority::Normal,
+            "bulk" => CircPriority::Bulk,
+            _ => return Err(PyValueError::new_err(format!("Unknown priority: {}", priority))),
         };
-    
+
         self.runtime.block_on(async {
-            let client_circ = self.circ_manager.get_circ()
-                .map_err(|_| PyValueError::new_err("No circuit exists"))?;
-    
-            let request = format!(
-                "GET {} HTTP/1.1\r\n\
-                    Host: {}\r\n\
-                    Connection: close\r\n\
-                    \r\n",
-                path, host
-            );
-    
-            let mut stream = match client_circ.begin_stream(host, port, None).await {
-                Ok(stream) => stream,
-                Err(e) => return Err(PyValueError::new_err(format!("Failed to begin stream: {}", e))),
-            };
-    
-            // Write request to the stream
-            stream.write_all(request.as_bytes()).await.map_err(|e| {
-                PyValueError::new_err(format!("Connection failed to write request: {}", e))
-            })?;
-    
-            // IMPORTANT: Make sure the request was written.
-            // Arti buffers data, so flushing the buffer is usually required.
-            stream.flush().await.map_err(|e| {
-                PyValueError::new_err(format!("Failed to flush stream: {}", e))
-            })?;
-    
-            // Read the response into a string
-            let mut response = String::new();
-            match stream.read_to_string(&mut response).await {
-                Ok(_) => Ok(response),
-                Err(e) => Err(PyValueError::new_err(format!("Failed to read response: {}", e))),
+            self.circ_manager.set_priority(priority).await
+                .map_err(|e| PyValueError::new_err(format!("Failed to set priority: {}", e)))
+        })
+    }
+
+    /// Build a circuit along each of `legs`, a list of (ip, port, rsa_id) hops.
+    ///
+    /// Every leg must end at the same exit. Later streams are spread over the
+    /// legs, lowest RTT first, failing over when a leg closes.
+    #[pyo3(text_signature = "(legs)")]
+    fn create_multipath(&mut self, legs: Vec<Vec<RelaySpec>>) -> PyResult<()> {
+        self.runtime.block_on(async {
+            match self.circ_manager.create_multipath(legs).await {
+                Ok(_) => {
+                    info!("Created the multipath circuit set.");
+
+                    Ok(())
+                },
+                Err(e) => Err(PyValueError::new_err(format!("Connection failed: {}", e)))
             }
         })
     }
+
+    /// Go dormant after `quiet_secs` with no circuits being built and no
+    /// streams open, or never if None (the default). Dormant channels send no
+    /// padding and background probing pauses; the next `create`, `extend` or
+    /// `connect` wakes everything up first.
+    #[pyo3(text_signature = "(quiet_secs)")]
+    fn set_idle_timeout(&self, quiet_secs: Option<f64>) -> PyResult<()> {
+        let quiet_period = quiet_secs.map(Duration::try_from_secs_f64)
+            .transpose()
+            .map_err(|e| PyValueError::new_err(format!("Invalid quiet_secs: {}", e)))?;
+        self.circ_manager.set_idle_timeout(quiet_period)
+            .map_err(|e| PyValueError::new_err(format!("Failed to set idle timeout: {}", e)))
+    }
+
+    #[pyo3(text_signature = "()")]
+    fn is_dormant(&self) -> bool {
+        self.circ_manager.is_dormant()
+    }
+
+    /// Cap the bandwidth used at `scope`: "process" (every client in this
+    /// process), "client" (this one), or each "circuit" or "stream" of this
+    /// client. Uploads and downloads are limited separately, each to
+    /// `bytes_per_sec`, with bursts of up to `burst` bytes (a second's worth
+    /// by default). Changes apply to open streams too. Pass None to lift the
+    /// limit.
+    #[pyo3(signature = (scope, bytes_per_sec, burst=None))]
+    #[pyo3(text_signature = "(scope, bytes_per_sec, burst=None)")]
+    fn set_rate_limit(&self, scope: &str, bytes_per_sec: Option<u64>, burst: Option<u64>) -> PyResult<()> {
+        set_rate_limit(self.circ_manager.limiter(), scope, bytes_per_sec, burst)
+    }
+
+    /// Call `callback` with each batch of events: a list of dicts, each with
+    /// the event's "kind", "at" (seconds since the epoch) and fields.
+    ///
+    /// Kinds are "circuit_built" and "circuit_closed" (with "circuit"; only
+    /// for circuits you build, not those built to probe or scan relays),
+    /// "stream_opened", "bytes_milestone" (every MiB) and "stream_closed"
+    /// (with "stream"), "bootstrap_progress", "netdir_updated", and
+    /// "events_dropped" if Python fell too far behind. Callbacks run on a
+    /// thread of their own, so they should be quick.
+    #[pyo3(text_signature = "(callback)")]
+    fn add_event_callback(&self, callback: PyObject) -> PyResult<()> {
+        self.events.add(EventSink::Callback(callback))
+    }
+
+    /// Put each batch of events on `queue`, an asyncio.Queue, through
+    /// `event_loop`, the loop it belongs to.
+    #[pyo3(text_signature = "(queue, event_loop)")]
+    fn add_event_queue(&self, queue: PyObject, event_loop: PyObject) -> PyResult<()> {
+        self.events.add(EventSink::Queue { queue, event_loop })
+    }
+
+    #[pyo3(text_signature = "()")]
+    fn clear_event_listeners(&self) {
+        self.events.clear()
+    }
+
+    /// Serve circuits and streams to `PyArtiDaemonClient`s in other
+    /// processes, over a Unix socket at `socket_path`, in the background.
+    ///
+    /// They share this client's directory, channels, relay database and rate
+    /// limits, so call `init` first. Serving again moves to the new path.
+    #[pyo3(text_signature = "(socket_path)")]
+    fn serve(&self, socket_path: &str) -> PyResult<()> {
+        let handle = tor_daemon::serve(self.circ_manager.detached(), Path::new(socket_path), &self.runtime)
+            .map_err(|e| PyValueError::new_err(format!("Failed to start daemon: {}", e)))?;
+        *self.daemon.lock().expect("poisoned lock") = Some(handle);
+
+        Ok(())
+    }
+
+    /// Stop serving; streams already handed out carry on.
+    #[pyo3(text_signature = "()")]
+    fn stop_serving(&self) {
+        self.daemon.lock().expect("poisoned lock").take();
+    }
+
+    /// Measure the bandwidth of each of `targets`, (ip, port, rsa_id) tuples,
+    /// by downloading `url` over a two-hop circuit with `helper`, a relay
+    /// known to be fast.
+    ///
+    /// Each download stops after `max_bytes` or `max_secs`. At most
+    /// `concurrency` run at once, and together they read no faster than
+    /// `budget_bps` bytes per second, if given. Results are recorded in the
+    /// relay performance database, where they feed `relay_stats` and
+    /// `rank_relays`. Return a dict from rsa_id to bytes per second, or None
+    /// if the measurement failed.
+    #[pyo3(signature = (targets, helper, url, port=80, max_bytes=16777216, max_secs=10.0, concurrency=4, budget_bps=None))]
+    #[pyo3(text_signature = "(targets, helper, url, port=80, max_bytes=16777216, max_secs=10.0, concurrency=4, budget_bps=None)")]
+    fn scan_bandwidth(
+        &self,
+        targets: Vec<RelaySpec>,
+        helper: RelaySpec,
+        url: &str,
+        port: u16,
+        max_bytes: usize,
+        max_secs: f64,
+        concurrency: usize,
+        budget_bps: Option<f64>,
+    ) -> PyResult<HashMap<String, Option<f64>>> {
+        let (host, path) = split_url(url)?;
+        let max_time = Duration::try_from_secs_f64(max_secs)
+            .map_err(|e| PyValueError::new_err(format!("Invalid max_secs: {}", e)))?;
+        let server = ScanServer { host: host.to_string(), port, path, max_bytes, max_time };
+        let budget = ScanBudget::new(budget_bps);
+
+        let results = self.runtime.block_on(async {
+            self.circ_manager.scan_bandwidth(&targets, &helper, &server, concurrency, &budget).await
+        });
+
+        Ok(results.into_iter()
+            .map(|(rsa_id, res)| (rsa_id, res.ok().map(|m| m.bytes_per_sec())))
+            .collect())
+    }
+
+    /// Pick a guard, middle and exit whose locations keep the round trip
+    /// from `client` through the path to `dest` short.
+    ///
+    /// `client` and `dest` are each a country code or an IP address; the exit
+    /// must allow `port`. At most `max_per_country` hops share a country, a
+    /// country needs `min_country_relays` usable relays at a position to be
+    /// picked there, and we pick at random among paths whose estimated RTT is
+    /// within `slack` (a fraction) of the best. Within a country, relays are
+    /// weighted by bandwidth times their `relay_stats` score. Return a dict
+    /// of `hops`, a list of (ip, port, rsa_id), `countries`, and
+    /// `estimated_rtt_ms`.
+    #[pyo3(signature = (client, dest=None, port=443, max_per_country=2, min_country_relays=3, slack=0.25))]
+    #[pyo3(text_signature = "(client, dest=None, port=443, max_per_country=2, min_country_relays=3, slack=0.25)")]
+    fn geo_path(
+        &self,
+        py: Python<'_>,
+        client: &str,
+        dest: Option<&str>,
+        port: u16,
+        max_per_country: usize,
+        min_country_relays: usize,
+        slack: f64,
+    ) -> PyResult<PyObject> {
+        let limits = GeoPathLimits { max_per_country, min_country_relays, slack };
+        let circ_manager = &self.circ_manager;
+        let path = py.allow_threads(|| circ_manager.geo_path(client, dest, port, &limits))
+            .map_err(|e| PyValueError::new_err(format!("Failed to choose a path: {}", e)))?;
+
+        geo_path_dict(py, path)
+    }
+
+    /// Like `geo_path`, then build the path as the current circuit.
+    #[pyo3(signature = (client, dest=None, port=443, max_per_country=2, min_country_relays=3, slack=0.25))]
+    #[pyo3(text_signature = "(client, dest=None, port=443, max_per_country=2, min_country_relays=3, slack=0.25)")]
+    fn create_geo_path(
+        &mut self,
+        py: Python<'_>,
+        client: &str,
+        dest: Option<&str>,
+        port: u16,
+        max_per_country: usize,
+        min_country_relays: usize,
+        slack: f64,
+    ) -> PyResult<PyObject> {
+        let limits = GeoPathLimits { max_per_country, min_country_relays, slack };
+        let path = self.runtime.block_on(async {
+            self.circ_manager.create_geo_path(client, dest, port, &limits).await
+                .map_err(|e| PyValueError::new_err(format!("Connection failed: {}", e)))
+        })?;
+
+        geo_path_dict(py, path)
+    }
+
+    /// Probe each of `candidates`, (ip, port, rsa_id) tuples, once now.
+    ///
+    /// Each probe builds a one-hop circuit to the candidate, or a two-hop
+    /// circuit through `via` if given, and times the handshake and a cell
+    /// round trip; see `latency_table`. At most `concurrency` probes run at
+    /// once. Return the number of probes that succeeded.
+    #[pyo3(signature = (candidates, via=None, concurrency=4))]
+    #[pyo3(text_signature = "(candidates, via=None, concurrency=4)")]
+    fn probe_relays(
+        &self,
+        candidates: Vec<RelaySpec>,
+        via: Option<RelaySpec>,
+        concurrency: usize,
+    ) -> PyResult<usize> {
+        self.runtime.block_on(async {
+            Ok(self.circ_manager.probe_relays(&candidates, via.as_ref(), concurrency).await)
+        })
+    }
+
+    /// Like `probe_relays`, but in the background, every `interval_secs`,
+    /// until `stop_probing` is called.
+    #[pyo3(signature = (candidates, via=None, interval_secs=600.0, concurrency=4))]
+    #[pyo3(text_signature = "(candidates, via=None, interval_secs=600.0, concurrency=4)")]
+    fn start_probing(
+        &self,
+        candidates: Vec<RelaySpec>,
+        via: Option<RelaySpec>,
+        interval_secs: f64,
+        concurrency: usize,
+    ) -> PyResult<()> {
+        let interval = Duration::try_from_secs_f64(interval_secs)
+            .map_err(|e| PyValueError::new_err(format!("Invalid interval: {}", e)))?;
+        self.circ_manager.start_probing(candidates, via, interval, concurrency)
+            .map_err(|e| PyValueError::new_err(format!("Failed to start probing: {}", e)))
+    }
+
+    #[pyo3(text_signature = "()")]
+    fn stop_probing(&self) {
+        self.circ_manager.stop_probing();
+    }
+
+    /// Return what probing has measured, as a dict from rsa_id to a dict of
+    /// `handshake_ms`, `rtt_ms` and `probed_at` (seconds since the epoch).
+    #[pyo3(text_signature = "()")]
+    fn latency_table(&self) -> HashMap<String, HashMap<&'static str, Option<f64>>> {
+        self.circ_manager.latency_table().relays()
+            .into_iter()
+            .map(|(rsa_id, latency)| {
+                let probed_at = latency.probed_at
+                    .and_then(|t| t.duration_since(UNIX_EPOCH).ok())
+                    .map(|d| d.as_secs_f64());
+                (rsa_id, HashMap::from([
+                    ("handshake_ms", latency.handshake_ms),
+                    ("rtt_ms", latency.rtt_ms),
+                    ("probed_at", probed_at),
+                ]))
+            })
+            .collect()
+    }
+
+    /// Given a list of candidate rsa_ids for each hop, pick one per hop to
+    /// minimise the path's RTT, going by the latency table.
+    #[pyo3(text_signature = "(template)")]
+    fn fastest_path(&self, template: Vec<Vec<String>>) -> PyResult<Vec<String>> {
+        self.circ_manager.latency_table().choose_path(&template)
+            .ok_or_else(|| PyValueError::new_err("No path fits the template"))
+    }
+
+    /// Send an HTTP GET for `url` and return the response.
+    ///
+    /// With `optimistic` the request goes out right behind the
+    /// BEGIN cell instead of after the exit's CONNECTED, saving a round trip.
+    /// If the exit then refuses the stream, the request is dropped and reading
+    /// the response fails.
+    #[pyo3(signature = (url, port, optimistic=false))]
+    #[pyo3(text_signature = "(url, port, optimistic=False)")]
+    fn connect(&self, url: &str, port: u16, optimistic: bool) -> PyResult<String> {
+        let (host, path) = split_url(url)?;
+
+        self.runtime.block_on(async {
+            let (stream, circ) = self.circ_manager.begin_stream(host, port, optimistic).await
+                .map_err(|e| PyValueError::new_err(e.to_string()))?;
+
+            let started = Instant::now();
+            let response = http_get(stream, host, &path).await?;
+            self.circ_manager.note_stream_throughput(&circ, response.len(), started.elapsed());
+
+            Ok(response)
+        })
+    }
+
+    /// Send an HTTP GET for each of `urls` and return the responses in order.
+    ///
+    /// All the streams are opened on the current circuit at once, with at
+    /// most `max_in_flight` BEGINs awaiting CONNECTED, and each request is
+    /// sent as soon as its stream connects.
+    #[pyo3(signature = (urls, port, max_in_flight=8))]
+    #[pyo3(text_signature = "(urls, port, max_in_flight=8)")]
+    fn connect_many(&self, urls: Vec<String>, port: u16, max_in_flight: usize) -> PyResult<Vec<String>> {
+        let requests = urls.iter()
+            .map(|url| split_url(url))
+            .collect::<PyResult<Vec<_>>>()?;
+        let targets = requests.iter()
+            .map(|(host, _)| (host.to_string(), port))
+            .collect();
+
+        self.runtime.block_on(async {
+            let opens = self.circ_manager.begin_streams(targets, max_in_flight)
+                .map_err(|e| PyValueError::new_err(format!("Failed to begin streams: {}", e)))?;
+
+            let requests = &requests;
+            let circ_manager = &self.circ_manager;
+            let mut responses: Vec<(usize, PyResult<String>)> = opens
+                .map(|(i, stream)| async move {
+                    let (host, path) = &requests[i];
+                    let response = match stream {
+                        Ok((stream, circ)) => {
+                            let started = Instant::now();
+                            let response = http_get(stream, host, path).await;
+                            if let Ok(response) = &response {
+                                circ_manager.note_stream_throughput(&circ, response.len(), started.elapsed());
+                            }
+                            response
+                        },
+                        Err(e) => Err(PyValueError::new_err(e.to_string())),
+                    };
+                    (i, response)
+                })
+                .buffer_unordered(requests.len().max(1))
+                .collect()
+                .await;
+
+            responses.sort_by_key(|(i, _)| *i);
+            responses.into_iter().map(|(_, response)| response).collect()
+        })
+    }
 }
 
 #[pyclass]
-#[pyo3(text_signature = "()")]
+#[pyo3(text_signature = "(worker_threads=None)")]
 pub struct PyArtiHSClient {
     runtime: PreferredRuntime,
     hs_client: TorHSClient,
+    events: EventDispatcher,
+    // Owns the worker pool behind `runtime`; must outlive it.
+    _tokio_rt: tokio::runtime::Runtime,
 }
 
 #[pymethods]
 impl PyArtiHSClient {
     #[new]
-    fn new() -> PyResult<Self> {
-        let runtime = PreferredRuntime::create()?;
+    #[pyo3(signature = (worker_threads=None))]
+    fn new(worker_threads: Option<usize>) -> PyResult<Self> {
+        let (_tokio_rt, runtime) = build_runtime(worker_threads)?;
         let hs_client = TorHSClient::new()
             .map_err(|e| PyValueError::new_err(format!("Failed to create tor hs_client: {}", e)))?;
+        let events = EventDispatcher::new(hs_client.events().clone());
 
         Ok(Self {
             runtime,
-            hs_client
+            hs_client,
+            events,
+            _tokio_rt,
         })
     }
 
@@ -180,21 +761,179 @@ impl PyArtiHSClient {
         Ok(())
     }
 
-    #[pyo3(text_signature = "(hs_addr, hs_port)")]
-    fn connect(&self, hs_addr: &str, hs_port: u16) -> PyResult<String> {
+    /// Go dormant after `quiet_secs` with no connections open, or never if
+    /// None (the default). Dormant clients stop refreshing the directory and
+    /// padding channels; the next `connect` wakes them first.
+    #[pyo3(text_signature = "(quiet_secs)")]
+    fn set_idle_timeout(&self, quiet_secs: Option<f64>) -> PyResult<()> {
+        let quiet_period = quiet_secs.map(Duration::try_from_secs_f64)
+            .transpose()
+            .map_err(|e| PyValueError::new_err(format!("Invalid quiet_secs: {}", e)))?;
+        self.hs_client.set_idle_timeout(quiet_period, &self.runtime)
+            .map_err(|e| PyValueError::new_err(format!("Failed to set idle timeout: {}", e)))
+    }
+
+    #[pyo3(text_signature = "()")]
+    fn is_dormant(&self) -> bool {
+        self.hs_client.is_dormant()
+    }
+
+    /// Like `PyArtiClient.set_rate_limit`. Each onion service connection has
+    /// its own rendezvous circuit, so "circuit" limits apply per connection.
+    #[pyo3(signature = (scope, bytes_per_sec, burst=None))]
+    #[pyo3(text_signature = "(scope, bytes_per_sec, burst=None)")]
+    fn set_rate_limit(&self, scope: &str, bytes_per_sec: Option<u64>, burst: Option<u64>) -> PyResult<()> {
+        set_rate_limit(self.hs_client.limiter(), scope, bytes_per_sec, burst)
+    }
+
+    /// Solve the proof of work puzzles of onion services under DoS defence on
+    /// `threads` threads at once, or on one per core if None (the default).
+    /// The first thread to find a proof stops the rest. This applies to every
+    /// client in the process.
+    #[pyo3(signature = (threads=None))]
+    #[pyo3(text_signature = "(threads=None)")]
+    fn set_pow_threads(&self, threads: Option<usize>) -> PyResult<()> {
+        if threads == Some(0) {
+            return Err(PyValueError::new_err("threads must be at least 1"));
+        }
+        self.hs_client.set_pow_threads(threads.unwrap_or(0));
+
+        Ok(())
+    }
+
+    /// Fetch each onion service descriptor from up to `parallel` HSDirs at
+    /// once (at most 3). Another HSDir is asked whenever the outstanding
+    /// requests take longer than fetches usually do, and the first valid
+    /// descriptor wins. 1 (the default) asks one HSDir at a time. This applies
+    /// to every client in the process.
+    #[pyo3(text_signature = "(parallel)")]
+    fn set_hsdir_hedging(&self, parallel: usize) -> PyResult<()> {
+        if !(1..=HsDescFetchHedging::MAX_PARALLEL).contains(&parallel) {
+            return Err(PyValueError::new_err(format!(
+                "parallel must be between 1 and {}",
+                HsDescFetchHedging::MAX_PARALLEL
+            )));
+        }
+        self.hs_client.set_hsdir_hedging(parallel);
+
+        Ok(())
+    }
+
+    /// Work out the blinded keys and responsible HSDirs of the onion
+    /// addresses in `hs_addrs` ahead of time, on one thread per core. Later
+    /// connections to them skip that work until the next time period (for
+    /// keys) or consensus (for HSDirs). Returns how many were cached.
+    #[pyo3(text_signature = "(hs_addrs)")]
+    fn precompute_keys(&self, py: Python<'_>, hs_addrs: Vec<String>) -> PyResult<usize> {
+        let hs_client = &self.hs_client;
+        py.allow_threads(|| hs_client.precompute_keys(&hs_addrs))
+            .map_err(|e| PyValueError::new_err(format!("Failed to precompute keys: {}", e)))
+    }
+
+    /// Keep the onion services in `hs_addrs` ready for `connect`, replacing
+    /// any earlier list; an empty list stops prefetching. In the background,
+    /// their descriptors are fetched and verified, and the introduction and
+    /// rendezvous handshakes done, so a later `connect` only has to open its
+    /// stream. The circuits are refreshed every five minutes, except while
+    /// the client is dormant; prefetching doesn't keep it awake.
+    #[pyo3(text_signature = "(hs_addrs)")]
+    fn prefetch(&self, py: Python<'_>, hs_addrs: Vec<String>) -> PyResult<()> {
+        let hs_client = &self.hs_client;
+        py.allow_threads(|| hs_client.prefetch(&hs_addrs))
+            .map_err(|e| PyValueError::new_err(format!("Failed to start prefetching: {}", e)))
+    }
+
+    /// Like `PyArtiClient.add_event_callback`. Arti builds onion service
+    /// circuits itself, so there are no circuit events; the rest are as for
+    /// `PyArtiClient`, with "netdir_updated" on each new consensus.
+    #[pyo3(text_signature = "(callback)")]
+    fn add_event_callback(&self, callback: PyObject) -> PyResult<()> {
+        self.events.add(EventSink::Callback(callback))
+    }
+
+    #[pyo3(text_signature = "(queue, event_loop)")]
+    fn add_event_queue(&self, queue: PyObject, event_loop: PyObject) -> PyResult<()> {
+        self.events.add(EventSink::Queue { queue, event_loop })
+    }
+
+    #[pyo3(text_signature = "()")]
+    fn clear_event_listeners(&self) {
+        self.events.clear()
+    }
+
+    /// Send an HTTP(S) GET to the onion service and return the response.
+    ///
+    /// `optimistic` works as for `PyArtiClient.connect`.
+    #[pyo3(signature = (hs_addr, hs_port, optimistic=false))]
+    #[pyo3(text_signature = "(hs_addr, hs_port, optimistic=False)")]
+    fn connect(&self, hs_addr: &str, hs_port: u16, optimistic: bool) -> PyResult<String> {
         self.runtime.block_on(async {
-            self.hs_client.connect_to_hs(hs_addr, hs_port).await
+            self.hs_client.connect_to_hs(hs_addr, hs_port, optimistic).await
                 .map_err(|e| PyValueError::new_err(format!("Request failed failed: {}", e)))
         })
     }
 }
 
 
+/// A connection to a `PyArtiClient` serving circuits from another process.
+///
+/// This doesn't run Tor itself, so it's cheap to have one per worker.
+#[pyclass]
+#[pyo3(text_signature = "(socket_path)")]
+pub struct PyArtiDaemonClient {
+    client: DaemonClient,
+}
+
+#[pymethods]
+impl PyArtiDaemonClient {
+    #[new]
+    fn new(socket_path: &str) -> PyResult<Self> {
+        let client = DaemonClient::connect(Path::new(socket_path))
+            .map_err(|e| PyValueError::new_err(format!("{}", e)))?;
+
+        Ok(Self { client })
+    }
+
+    /// Build a circuit through `hops`, a list of (ip, port, rsa_id) tuples,
+    /// and call it `name`. Every client of the daemon can use it.
+    #[pyo3(text_signature = "(name, hops)")]
+    fn create_circuit(&mut self, py: Python<'_>, name: &str, hops: Vec<RelaySpec>) -> PyResult<()> {
+        let client = &mut self.client;
+        py.allow_threads(|| client.create_circuit(name, &hops))
+            .map_err(|e| PyValueError::new_err(format!("Failed to create circuit: {}", e)))
+    }
+
+    /// Open a stream to `host:port` on the circuit called `name`, and return
+    /// it as a connected `socket.socket`.
+    #[pyo3(text_signature = "(name, host, port)")]
+    fn open_stream(&mut self, py: Python<'_>, name: &str, host: &str, port: u16) -> PyResult<PyObject> {
+        let client = &mut self.client;
+        let fd = py.allow_threads(|| client.open_stream(name, host, port))
+            .map_err(|e| PyValueError::new_err(format!("Failed to open stream: {}", e)))?;
+
+        // The socket object owns the descriptor from here on.
+        let kwargs = PyDict::new(py);
+        kwargs.set_item("fileno", fd.into_raw_fd())?;
+        let socket = py.import("socket")?.getattr("socket")?.call((), Some(kwargs))?;
+
+        Ok(socket.to_object(py))
+    }
+
+    #[pyo3(text_signature = "(name)")]
+    fn close_circuit(&mut self, py: Python<'_>, name: &str) -> PyResult<()> {
+        let client = &mut self.client;
+        py.allow_threads(|| client.close_circuit(name))
+            .map_err(|e| PyValueError::new_err(format!("Failed to close circuit: {}", e)))
+    }
+}
+
 #[pymodule]
 fn pyarti(_py: Python, m: &PyModule) -> PyResult<()> {
     env_logger::init();
+    info!("Relay crypto backends: {}", tor_llcrypto::backend::backends());
     m.add_class::<PyArtiClient>()?;
     m.add_class::<PyArtiHSClient>()?;
-    m.add("__all__", vec!["PyArtiClient", "PyArtiHSClient"])?;
+    m.add_class::<PyArtiDaemonClient>()?;
+    m.add("__all__", vec!["PyArtiClient", "PyArtiHSClient", "PyArtiDaemonClient"])?;
     Ok(())
 }
\ No newline at end of file
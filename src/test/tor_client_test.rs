@@ -12,9 +12,9 @@ struct TorClient {
 impl TorClient {
     async fn new() -> AnyResult<Self> {
         let runtime = PreferredRuntime::current()?;
-        let circ_manager = TorCircuitManager::new(runtime)?;
+        let mut circ_manager = TorCircuitManager::new(runtime)?;
 
-        circ_manager.init().await?;
+        circ_manager.init(None).await?;
         
         Ok(Self {
             circ_manager
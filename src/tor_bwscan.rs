@@ -0,0 +1,75 @@
+use std::sync::Mutex;
+use std::time::{Duration, Instant};
+
+/// Where, and how much, a bandwidth scan downloads.
+#[derive(Debug, Clone)]
+pub struct ScanServer {
+    /// Host the exit connects to.
+    pub host: String,
+    pub port: u16,
+    /// Path of a file at least `max_bytes` long.
+    pub path: String,
+    /// Stop each measurement after this many bytes.
+    pub max_bytes: usize,
+    /// Stop each measurement after this long, whatever we've received.
+    pub max_time: Duration,
+}
+
+/// A cap on the total download rate of a scan, shared by every measurement
+/// running in it.
+///
+/// Each measurement reports the bytes it reads and waits for as long as we
+/// say before reading more. We keep the time at which everything reported so
+/// far would have arrived at the capped rate; nobody reads again before then.
+#[derive(Debug)]
+pub struct ScanBudget {
+    bytes_per_sec: Option<f64>,
+    /// When the bytes reported so far are paid for.
+    paid_until: Mutex<Option<Instant>>,
+}
+
+impl ScanBudget {
+    /// Cap the download rate at `bytes_per_sec`, or not at all if `None`.
+    pub fn new(bytes_per_sec: Option<f64>) -> Self {
+        Self {
+            bytes_per_sec: bytes_per_sec.filter(|bps| *bps > 0.0),
+            paid_until: Mutex::new(None),
+        }
+    }
+
+    /// Note that `n` bytes arrived, and return how long to wait before
+    /// reading more.
+    pub fn take(&self, n: usize) -> Duration {
+        let Some(rate) = self.bytes_per_sec else {
+            return Duration::ZERO;
+        };
+        let now = Instant::now();
+        let mut paid_until = self.paid_until.lock().expect("poisoned lock");
+        let from = paid_until.filter(|t| *t > now).unwrap_or(now);
+        let until = from + Duration::from_secs_f64(n as f64 / rate);
+        *paid_until = Some(until);
+
+        until.saturating_duration_since(now)
+    }
+}
+
+/// The result of measuring one relay.
+#[derive(Debug, Clone)]
+pub struct BandwidthMeasurement {
+    /// Bytes we received, headers included.
+    pub bytes: usize,
+    /// Time from sending the request to the last byte we read.
+    pub elapsed: Duration,
+}
+
+impl BandwidthMeasurement {
+    /// Return the measured rate, in bytes per second.
+    pub fn bytes_per_sec(&self) -> f64 {
+        let secs = self.elapsed.as_secs_f64();
+        if secs > 0.0 {
+            self.bytes as f64 / secs
+        } else {
+            0.0
+        }
+    }
+}
@@ -2,12 +2,15 @@ use std::sync::{Arc, Mutex};
 use futures::stream::BoxStream;
 use anyhow::{anyhow, Result as AnyResult};
 use postage::broadcast::{self, Receiver, Sender};
+use postage::sink::Sink;
+use postage::stream::Stream;
 
 use tor_rtcompat::Runtime;
 use tor_memquota::{MemoryQuotaTracker, Config};
 use tor_chanmgr::{ChanMgr, ChannelConfig, Dormancy};
 use tor_netdir::{NetDir, NetDirProvider, DirEvent, Timeliness, Error, params::NetParameters};
 
+#[derive(Clone)]
 pub struct TorChannelManager<R: Runtime> {
     chan_mgr: Arc<ChanMgr<R>>,
     dir_provider: Arc<CustomNetDirProvider>,
@@ -39,7 +42,7 @@ impl<R: Runtime> TorChannelManager<R> {
         })
     }
 
-    pub fn init(&self, netdir: &NetDir) -> AnyResult<()> {
+    pub fn init(&self, netdir: &Arc<NetDir>) -> AnyResult<()> {
         self.dir_provider.set_netdir(netdir.clone());
 
         self.chan_mgr
@@ -49,6 +52,11 @@ impl<R: Runtime> TorChannelManager<R> {
         Ok(())
     }
 
+    /// Switch to a newer network directory.
+    pub fn set_netdir(&self, netdir: Arc<NetDir>) {
+        self.dir_provider.set_netdir(netdir);
+    }
+
     pub fn netdir(&self) -> AnyResult<Arc<NetDir>> {
         let netdir = self.dir_provider.netdir(Timeliness::Timely)
             .map_err(|e| anyhow!("Failed to get network directory: {}", e))?;
@@ -56,6 +64,14 @@ impl<R: Runtime> TorChannelManager<R> {
         Ok(netdir)
     }
 
+    /// Put our channels into dormant mode (no padding or other spontaneous
+    /// activity), or wake them.
+    pub fn set_dormant(&self, dormant: bool) -> AnyResult<()> {
+        let dormancy = if dormant { Dormancy::Dormant } else { Dormancy::Active };
+        self.chan_mgr.set_dormancy(dormancy, self.dir_provider.params())
+            .map_err(|e| anyhow!("Failed to set dormancy: {}", e))
+    }
+
     pub fn get_chanmgr(&self) -> AnyResult<Arc<ChanMgr<R>>> {
         Ok(self.chan_mgr.clone())
     }
@@ -73,17 +89,18 @@ struct Inner {
     current: Option<Arc<NetDir>>,
     /// Event sender for network directory updates
     event_tx: Sender<DirEvent>,
-    /// Event receiver (kept to prevent channel closure)
-    _event_rx: Receiver<DirEvent>,  
+    /// Event receiver (kept to prevent channel closure, and drained so it
+    /// never fills the channel)
+    event_rx: Receiver<DirEvent>,
 }
 
 impl CustomNetDirProvider {
     pub fn new() -> Self {
-        let (event_tx, _event_rx) = broadcast::channel(128);
+        let (event_tx, event_rx) = broadcast::channel(128);
         let inner = Inner {
             current: None,
             event_tx,
-            _event_rx,
+            event_rx,
         };
 
         Self {
@@ -91,9 +108,12 @@ impl CustomNetDirProvider {
         }
     }
 
+    /// Replace the current directory, and tell subscribers about it.
     pub fn set_netdir(&self, dir: impl Into<Arc<NetDir>>) {
         let mut inner = self.inner.lock().expect("lock poisoned");
         inner.current = Some(dir.into());
+        while inner.event_rx.try_recv().is_ok() {}
+        let _ = inner.event_tx.try_send(DirEvent::NewConsensus);
     }
 }
 
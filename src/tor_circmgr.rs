@@ -1,27 +1,73 @@
+use crate::tor_bwscan::{BandwidthMeasurement, ScanBudget, ScanServer};
 use crate::tor_chanmgr::TorChannelManager;
+use crate::tor_events::{self, EventBus, TorEvent, WatchedStream};
+use crate::tor_geopath::{self, GeoPath, GeoPathLimits};
+use crate::tor_idle::IdleMonitor;
+use crate::tor_multipath::{LegStream, MultipathCircSet};
+use crate::tor_probe::LatencyTable;
+use crate::tor_ratelimit::{LimitedStream, Limiter};
+use crate::tor_relaydb::{ObservationKind, RelayPerfDb, RelayStats};
 
-use log::info;
-use std::sync::Arc;
+use log::{info, warn};
+use std::sync::{Arc, Mutex, Weak};
 use std::net::SocketAddr;
+use std::path::PathBuf;
+use std::collections::HashMap;
+use std::time::{Duration, Instant};
 use futures::task::SpawnExt;
+use futures::{AsyncReadExt, AsyncWriteExt, Stream, StreamExt};
 use anyhow::{anyhow, Result as AnyResult};
+use tokio::sync::watch;
 
-use arti_client::{TorClient, TorClientConfig};
+use arti_client::{DormantMode, TorClient, TorClientConfig};
+use arti_client::config::{CfgPath, TorClientConfigBuilder};
 
-use tor_rtcompat::Runtime;
+use tor_rtcompat::{PreferredRuntime, Runtime, SleepProvider};
 use tor_units::Percentage;
 use tor_llcrypto::pk::rsa::RsaIdentity;
 use tor_chanmgr::{ChannelUsage, ChanProvenance};
+use tor_netdir::DirEvent;
 use tor_linkspec::{ChanTarget, CircTarget, HasRelayIds, IntoOwnedChanTarget, OwnedChanTarget, OwnedCircTarget};
-use tor_proto::circuit::{ClientCirc, PendingClientCirc, CircParameters};
+use tor_proto::channel::CircPriority;
+use tor_proto::circuit::{ClientCirc, PendingClientCirc, CircParameters, Path};
 use tor_proto::ccparams::{
     Algorithm, CongestionControlParamsBuilder, FixedWindowParamsBuilder,
     RoundTripEstimatorParamsBuilder, CongestionWindowParamsBuilder
 };
 
+/// Streams that receive fewer bytes than this don't tell us much about
+/// throughput, so we don't record it for them.
+const MIN_THROUGHPUT_SAMPLE_BYTES: usize = 64 * 1024;
+
+/// A relay to build a circuit through: (ip, port, fingerprint).
+pub type RelaySpec = (String, u16, String);
+
+/// A stream opened by a [`TorCircuitManager`]: rate limited, and reported
+/// as events.
+pub type ClientStream = WatchedStream<LimitedStream<LegStream>>;
+
+// Cloning is cheap, and gives a handle that shares the channel manager,
+// relay database, latency table, rate limits and events. A clone also holds
+// on to the current circuit; see `detached` for a handle that doesn't.
+#[derive(Clone)]
 pub struct TorCircuitManager<R: Runtime> {
     tor_chan_mgr: TorChannelManager<R>,
     circ: Option<Arc<ClientCirc>>,
+    multipath: Option<Arc<MultipathCircSet>>,
+    relay_db: Option<Arc<RelayPerfDb>>,
+    latency: Arc<LatencyTable>,
+    /// Bumped to stop the current background probing task, if any.
+    probe_generation: Arc<watch::Sender<u64>>,
+    /// Rate limits for this client, under the process-wide ones.
+    limiter: Arc<Limiter>,
+    /// Rate limits for each circuit we've opened streams on, under `limiter`.
+    circ_limiters: Arc<Mutex<Vec<(Weak<ClientCirc>, Arc<Limiter>)>>>,
+    /// How long the latest handshake on each circuit we've built took: about
+    /// its round trip time up to its current last hop.
+    path_rtts: Arc<Mutex<Vec<(Weak<ClientCirc>, Duration)>>>,
+    /// Puts our channels to sleep when we've been idle for a while.
+    idle: Arc<IdleMonitor>,
+    events: Arc<EventBus>,
     runtime: R,
 }
 
@@ -130,28 +176,289 @@ impl<R: Runtime> TorCircuitManager<R> {
         let circ = self.create_common(&self.runtime, ct, usage).await?;
 
         let params = params.clone();
+        let started = Instant::now();
         let handshake_res = circ.create_firsthop_ntor(ct, params).await;
+        self.note_handshake(ct, started, Duration::ZERO, handshake_res.is_ok());
+
+        let circ = handshake_res
+            .map_err(|_| anyhow!("Failed to create first hop: {}", ct.to_logged().to_string()))?;
+        self.set_path_rtt(&circ, started.elapsed());
+
+        Ok(circ)
+    }
+
+    /// Extend `circ` to `target`, recording how it went.
+    async fn extend_hop(
+        &self,
+        circ: &Arc<ClientCirc>,
+        target: &OwnedCircTarget,
+        params: &CircParameters,
+    ) -> AnyResult<()> {
+        let path_rtt = self.path_rtt(circ);
+        let started = Instant::now();
+        let res = circ.extend_ntor(target, params).await;
+        self.note_handshake(target, started, path_rtt, res.is_ok());
+        if res.is_ok() {
+            self.set_path_rtt(circ, started.elapsed());
+        }
+
+        res.map_err(|e| anyhow!("Failed to extend to {}: {}", target.to_logged().to_string(), e))
+    }
+
+    /// Return about how long a round trip to the last hop of `circ` takes,
+    /// or zero if we didn't build it.
+    fn path_rtt(&self, circ: &Arc<ClientCirc>) -> Duration {
+        self.path_rtts.lock().expect("poisoned lock")
+            .iter()
+            .find(|(c, _)| std::ptr::eq(c.as_ptr(), Arc::as_ptr(circ)))
+            .map_or(Duration::ZERO, |(_, rtt)| *rtt)
+    }
+
+    /// Note that a handshake with the last hop of `circ` took `rtt`.
+    fn set_path_rtt(&self, circ: &Arc<ClientCirc>, rtt: Duration) {
+        let mut rtts = self.path_rtts.lock().expect("poisoned lock");
+        rtts.retain(|(c, _)| c.strong_count() > 0);
+        match rtts.iter_mut().find(|(c, _)| std::ptr::eq(c.as_ptr(), Arc::as_ptr(circ))) {
+            Some((_, old)) => *old = rtt,
+            None => rtts.push((Arc::downgrade(circ), rtt)),
+        }
+    }
+
+    /// Record the outcome of a CREATE or EXTEND handshake with `target` that
+    /// began at `started`.
+    ///
+    /// An EXTEND goes through the circuit's earlier hops first, so its time
+    /// includes `path_rtt`, the round trip to the previous hop; we record
+    /// only the remainder as this relay's handshake latency.
+    fn note_handshake<T: HasRelayIds + ?Sized>(
+        &self,
+        target: &T,
+        started: Instant,
+        path_rtt: Duration,
+        succeeded: bool,
+    ) {
+        let (Some(db), Some(rsa_id)) = (&self.relay_db, target.rsa_identity()) else {
+            return;
+        };
+        if succeeded {
+            db.record(rsa_id, ObservationKind::BuildSucceeded, 1.0);
+            let ms = started.elapsed().saturating_sub(path_rtt).as_secs_f64() * 1000.0;
+            db.record(rsa_id, ObservationKind::HandshakeLatency, ms);
+        } else {
+            db.record(rsa_id, ObservationKind::BuildFailed, 1.0);
+        }
+    }
 
-        handshake_res.map_err(|_| anyhow!("Failed to create first hop: {}", ct.to_logged().to_string()))
+    /// Once `circ` closes, record how long it stayed open against each relay
+    /// in its path.
+    ///
+    /// If the circuit was closed by dropping it, we don't learn its path (or
+    /// anything about its relays), so we record nothing.
+    ///
+    /// Either way, report its closing as an event.
+    fn watch_lifetime(&self, circ: &Arc<ClientCirc>) {
+        let db = self.relay_db.clone();
+        let events = self.events.clone();
+        let id = circ.unique_id().to_string();
+        let opened = Instant::now();
+        let closed = circ.wait_for_close();
+        let circ = Arc::downgrade(circ);
+
+        let res = self.runtime.spawn(async move {
+            closed.await;
+            let secs = opened.elapsed().as_secs_f64();
+            events.emit(TorEvent::new("circuit_closed").with("circuit", id).with("secs", secs));
+            if let (Some(db), Some(circ)) = (db, circ.upgrade()) {
+                record_path(&db, &circ.path_ref(), ObservationKind::CircuitLifetime, secs);
+            }
+        });
+        if let Err(e) = res {
+            warn!("Failed to spawn circuit lifetime watcher: {}", e);
+        }
+    }
+
+    /// Record that a stream on `circ` received `bytes` bytes in `elapsed`.
+    pub fn note_stream_throughput(&self, circ: &ClientCirc, bytes: usize, elapsed: Duration) {
+        let Some(db) = &self.relay_db else {
+            return;
+        };
+        let secs = elapsed.as_secs_f64();
+        if bytes < MIN_THROUGHPUT_SAMPLE_BYTES || secs <= 0.0 {
+            return;
+        }
+        let bps = bytes as f64 / secs;
+        record_path(db, &circ.path_ref(), ObservationKind::StreamThroughput, bps);
+    }
+
+    /// Return what we have recently observed about the relay with the
+    /// fingerprint `rsa_id`.
+    pub fn relay_stats(&self, rsa_id: &str) -> AnyResult<RelayStats> {
+        self.relay_db.as_ref()
+            .ok_or_else(|| anyhow!("Relay performance database is not open"))?
+            .stats(rsa_id)
+    }
+
+    /// Like [`Self::relay_stats`], for each fingerprint in `rsa_ids`, in order.
+    pub fn relays_stats(&self, rsa_ids: &[String]) -> AnyResult<Vec<RelayStats>> {
+        self.relay_db.as_ref()
+            .ok_or_else(|| anyhow!("Relay performance database is not open"))?
+            .stats_many(rsa_ids)
+    }
+
+    /// Return a handle that shares everything with this one except the
+    /// current circuit and multipath set, for background tasks that must
+    /// not keep those open.
+    pub fn detached(&self) -> Self {
+        Self {
+            circ: None,
+            multipath: None,
+            ..self.clone()
+        }
     }
 
     pub fn new(runtime: R) -> AnyResult<Self> {
         let tor_chan_mgr = TorChannelManager::new(runtime.clone())
             .map_err(|e| anyhow!("Failed to create channel manager: {}", e))?;
 
+        let idle = IdleMonitor::new();
+        let chan_mgr = tor_chan_mgr.clone();
+        idle.on_dormancy_change(move |dormant| {
+            if let Err(e) = chan_mgr.set_dormant(dormant) {
+                warn!("{}", e);
+            }
+        });
+
         Ok(Self {
             tor_chan_mgr,
             circ: None,
+            multipath: None,
+            relay_db: None,
+            latency: Arc::new(LatencyTable::default()),
+            probe_generation: Arc::new(watch::Sender::new(0)),
+            limiter: Limiter::process().child(),
+            circ_limiters: Arc::new(Mutex::new(Vec::new())),
+            path_rtts: Arc::new(Mutex::new(Vec::new())),
+            idle,
+            events: EventBus::new(),
             runtime,
         })
     }
 
-    pub async fn init(&self) -> AnyResult<()> {
-        let config = TorClientConfig::default();
-        let arti_client = Arc::new(TorClient::create_bootstrapped(config).await?);
+    pub async fn init(&mut self, storage: Option<&HashMap<String, String>>) -> AnyResult<()> {
+        let (mut config, state_dir) = match storage {
+            Some(storage_map) => {
+                let state_dir = storage_map.get("state_dir")
+                    .ok_or_else(|| anyhow!("Missing state_dir"))?;
+                let cache_dir = storage_map.get("cache_dir")
+                    .ok_or_else(|| anyhow!("Missing cache_dir"))?;
+                let config = TorClientConfigBuilder::from_directories(state_dir, cache_dir);
+
+                (config, PathBuf::from(state_dir))
+            },
+            None => {
+                let state_dir = CfgPath::new("${ARTI_LOCAL_DATA}".to_string())
+                    .path(&tor_config_path::arti_client_base_resolver())?;
+
+                (TorClientConfig::builder(), state_dir)
+            },
+        };
+        // We build our own circuits; the bootstrap client only keeps the
+        // directory fresh, so it has no use for exit circuits built ahead.
+        let preemptive = config.preemptive_circuits();
+        preemptive.disable_at_threshold(0);
+        preemptive.initial_predicted_ports().clear();
+        let config = config.build()?;
+
+        // The database only feeds relay scoring, so we can do without it.
+        match RelayPerfDb::open(&state_dir) {
+            Ok(db) => self.relay_db = Some(Arc::new(db)),
+            Err(e) => warn!("Not recording relay performance: {}", e),
+        }
+
+        let arti_client = Arc::new(TorClient::create_unbootstrapped(config)?);
+        // This ends once we're ready for traffic; later blips in the
+        // directory show up as "netdir_updated" events instead.
+        let mut progress = arti_client.bootstrap_events();
+        let events = self.events.clone();
+        let res = self.runtime.spawn(async move {
+            while let Some(status) = progress.next().await {
+                events.emit(TorEvent::new("bootstrap_progress")
+                    .with("fraction", f64::from(status.as_frac()))
+                    .with("status", status.to_string()));
+                if status.ready_for_traffic() {
+                    break;
+                }
+            }
+        });
+        if let Err(e) = res {
+            warn!("Failed to spawn bootstrap progress reporter: {}", e);
+        }
+        arti_client.bootstrap().await?;
         let netdir = arti_client.dirmgr().timely_netdir().unwrap();
 
-        self.tor_chan_mgr.init(&netdir)
+        self.tor_chan_mgr.init(&netdir)?;
+        self.events.emit(tor_events::netdir_updated(&netdir));
+        self.follow_directory(arti_client);
+
+        Ok(())
+    }
+
+    /// Switch to each new directory `arti_client` fetches, keeping it (and
+    /// so its refreshes) going for as long as the runtime runs.
+    ///
+    /// Its directory manager asks for each consensus as a diff against the
+    /// one it has cached, and reuses the cached microdescriptors of relays
+    /// that haven't changed, so a refresh usually costs a few tens of KB
+    /// rather than a full consensus.
+    ///
+    /// The client's other background tasks (circuit timeout testing, guard
+    /// channels and their padding) sleep whenever we go dormant.
+    fn follow_directory(&self, arti_client: Arc<TorClient<PreferredRuntime>>) {
+        let mode = |dormant| if dormant { DormantMode::Soft } else { DormantMode::Normal };
+        let dormant_client = arti_client.clone();
+        self.idle.on_dormancy_change(move |dormant| dormant_client.set_dormant(mode(dormant)));
+
+        let mut updates = arti_client.dirmgr().events();
+        let tor_chan_mgr = self.tor_chan_mgr.clone();
+        let events = self.events.clone();
+        let res = self.runtime.spawn(async move {
+            while let Some(update) = updates.next().await {
+                // New descriptors come in often, and don't change the relay list.
+                if update != DirEvent::NewConsensus {
+                    continue;
+                }
+                if let Ok(netdir) = arti_client.dirmgr().timely_netdir() {
+                    info!("Switching to a new network directory");
+                    events.emit(tor_events::netdir_updated(&netdir));
+                    tor_chan_mgr.set_netdir(netdir);
+                }
+            }
+        });
+        if let Err(e) = res {
+            warn!("Failed to spawn directory follower; the directory will go stale: {}", e);
+        }
+    }
+
+    /// Return the events this manager reports.
+    pub fn events(&self) -> &Arc<EventBus> {
+        &self.events
+    }
+
+    /// Report that the user's new circuit `circ` has been built, and watch
+    /// its lifetime.
+    ///
+    /// Circuits we build for ourselves, to probe or scan relays, are not the
+    /// user's business, so we report nothing about them.
+    fn note_new_circ(&self, circ: &Arc<ClientCirc>) {
+        self.note_built(circ);
+        self.watch_lifetime(circ);
+    }
+
+    /// Report that `circ` has been built, or extended.
+    fn note_built(&self, circ: &ClientCirc) {
+        self.events.emit(TorEvent::new("circuit_built")
+            .with("circuit", circ.unique_id().to_string())
+            .with("hops", circ.n_hops()));
     }
 
     pub fn get_circ(&self) -> AnyResult<Arc<ClientCirc>> {
@@ -188,6 +495,7 @@ impl<R: Runtime> TorCircuitManager<R> {
         relay_port: u16,
         relay_fingerprint: &str
     ) -> AnyResult<Arc<ClientCirc>> {
+        let _busy = self.idle.busy();
         let circ_target = self.circ_target_from_relay(relay_ip, relay_port, relay_fingerprint)
             .await?;
         let cc_params = self.build_circuit_params()?;
@@ -195,18 +503,219 @@ impl<R: Runtime> TorCircuitManager<R> {
 
         let client_circ = self.inner_create(&circ_target, &circ_params, ChannelUsage::UserTraffic)
             .await?;
+        self.note_new_circ(&client_circ);
 
         self.circ = Some(client_circ.clone());
+        self.multipath = None;
 
         Ok(client_circ)
     }
 
+    /// Build a circuit through `hops`, and make it the current circuit.
+    pub async fn create_path(&mut self, hops: &[RelaySpec]) -> AnyResult<Arc<ClientCirc>> {
+        let _busy = self.idle.busy();
+        let circ = self.build_path(hops).await?;
+        self.note_new_circ(&circ);
+
+        self.circ = Some(circ.clone());
+        self.multipath = None;
+
+        Ok(circ)
+    }
+
+    /// Build a circuit through `hops`, without reporting it; see
+    /// [`Self::note_new_circ`].
+    async fn build_path(&self, hops: &[RelaySpec]) -> AnyResult<Arc<ClientCirc>> {
+        let ((ip, port, fingerprint), rest) = hops.split_first()
+            .ok_or_else(|| anyhow!("A path needs at least one hop"))?;
+        let cc_params = self.build_circuit_params()?;
+        let circ_params = CircParameters::new(true, cc_params);
+
+        let circ_target = self.circ_target_from_relay(ip, *port, fingerprint).await?;
+        let circ = self.inner_create(&circ_target, &circ_params, ChannelUsage::UserTraffic)
+            .await?;
+
+        for (ip, port, fingerprint) in rest {
+            let circ_target = self.circ_target_from_relay(ip, *port, fingerprint).await?;
+            self.extend_hop(&circ, &circ_target, &circ_params).await?;
+        }
+
+        Ok(circ)
+    }
+
+    /// Pick a geographically coherent guard, middle and exit for a stream
+    /// from `client` to `dest`, each a country code or IP address, on `port`.
+    ///
+    /// See [`tor_geopath::choose_path`].
+    ///
+    /// Relays are weighted by their score as well as their consensus
+    /// weight, so this reads the relay database; don't call it from async
+    /// code.
+    pub fn geo_path(
+        &self,
+        client: &str,
+        dest: Option<&str>,
+        port: u16,
+        limits: &GeoPathLimits,
+    ) -> AnyResult<GeoPath> {
+        let scores = relay_scores(self.relay_db.as_deref());
+
+        self.choose_geo_path(client, dest, port, limits, &scores)
+    }
+
+    /// Like [`Self::geo_path`], with relay scores from [`relay_scores`].
+    fn choose_geo_path(
+        &self,
+        client: &str,
+        dest: Option<&str>,
+        port: u16,
+        limits: &GeoPathLimits,
+        scores: &HashMap<RsaIdentity, f64>,
+    ) -> AnyResult<GeoPath> {
+        let client = tor_geopath::locate(client)?;
+        let dest = dest.map(tor_geopath::locate).transpose()?;
+        let netdir = self.tor_chan_mgr.netdir()?;
+        let unknown = RelayStats::default().score();
+
+        tor_geopath::choose_path(&netdir, &client, dest.as_ref(), port, limits, |relay| {
+            relay.rsa_identity().and_then(|id| scores.get(id)).copied().unwrap_or(unknown)
+        })
+    }
+
+    /// Like [`Self::geo_path`], then build the path and make it the current
+    /// circuit.
+    pub async fn create_geo_path(
+        &mut self,
+        client: &str,
+        dest: Option<&str>,
+        port: u16,
+        limits: &GeoPathLimits,
+    ) -> AnyResult<GeoPath> {
+        let _busy = self.idle.busy();
+        let db = self.relay_db.clone();
+        let scores = tokio::task::spawn_blocking(move || relay_scores(db.as_deref())).await?;
+        let path = self.choose_geo_path(client, dest, port, limits, &scores)?;
+        info!(
+            "Building geo-aware path through {} (estimated RTT {:.0} ms)",
+            path.countries.join(" -> "),
+            path.estimated_rtt_ms,
+        );
+        let circ = self.build_path(&path.hops).await?;
+        self.note_new_circ(&circ);
+
+        self.circ = Some(circ);
+        self.multipath = None;
+
+        Ok(path)
+    }
+
+    /// Build one circuit per hop list in `legs`, all ending at the same exit,
+    /// and open later streams across them.
+    ///
+    /// The first leg also becomes the current circuit.
+    pub async fn create_multipath(
+        &mut self,
+        legs: Vec<Vec<RelaySpec>>,
+    ) -> AnyResult<Arc<MultipathCircSet>> {
+        let _busy = self.idle.busy();
+        let exits: Vec<String> = legs.iter()
+            .map(|hops| hops.last().map_or_else(String::new, |(_, _, fp)| fp.replace(" ", "").to_uppercase()))
+            .collect();
+        if exits.iter().any(|exit| exit.is_empty() || *exit != exits[0]) {
+            return Err(anyhow!("Every leg of a multipath set must end at the same exit"));
+        }
+
+        let circs = futures::future::try_join_all(legs.iter().map(|hops| self.build_path(hops)))
+            .await?;
+        for circ in &circs {
+            self.note_new_circ(circ);
+        }
+        let set = Arc::new(MultipathCircSet::new(circs.clone())?);
+        info!("Built a multipath set of {} circuits", circs.len());
+
+        self.circ = circs.into_iter().next();
+        self.multipath = Some(set.clone());
+
+        Ok(set)
+    }
+
+    /// Return the circuits new streams go on: the multipath set if we have
+    /// one, otherwise just the current circuit.
+    fn stream_circs(&self) -> AnyResult<Arc<MultipathCircSet>> {
+        match &self.multipath {
+            Some(set) => Ok(set.clone()),
+            None => Ok(Arc::new(MultipathCircSet::new(vec![self.get_circ()?])?)),
+        }
+    }
+
+    /// Open a stream to `host:port` on the current circuit, or on the best leg
+    /// of the multipath set.
+    ///
+    /// Return the stream along with the circuit it is on.
+    pub async fn begin_stream(
+        &self,
+        host: &str,
+        port: u16,
+        optimistic: bool,
+    ) -> AnyResult<(ClientStream, Arc<ClientCirc>)> {
+        self.idle.touch();
+        let (stream, circ) = self.stream_circs()?.begin_stream(host, port, optimistic).await?;
+
+        Ok((self.limit_stream(stream, &circ, host, port), circ))
+    }
+
+    /// Return the rate limits for this client.
+    pub fn limiter(&self) -> &Arc<Limiter> {
+        &self.limiter
+    }
+
+    /// Wrap `stream`, on `circ`, in a fresh stream-level rate limiter under
+    /// the limiter for `circ`, and report it as a stream to `host:port`.
+    fn limit_stream(
+        &self,
+        stream: LegStream,
+        circ: &Arc<ClientCirc>,
+        host: &str,
+        port: u16,
+    ) -> ClientStream {
+        let circ_limiter = {
+            let mut limiters = self.circ_limiters.lock().expect("poisoned lock");
+            limiters.retain(|(c, _)| c.strong_count() > 0);
+            match limiters.iter().find(|(c, _)| std::ptr::eq(c.as_ptr(), Arc::as_ptr(circ))) {
+                Some((_, limiter)) => limiter.clone(),
+                None => {
+                    let limiter = self.limiter.child();
+                    limiters.push((Arc::downgrade(circ), limiter.clone()));
+                    limiter
+                }
+            }
+        };
+
+        let stream = LimitedStream::new(stream, circ_limiter.child()).hold(self.idle.busy());
+
+        WatchedStream::new(stream, self.events.clone(), &format!("{}:{}", host, port))
+    }
+
+    /// Go dormant after `quiet_period` without circuit building or open
+    /// streams, or never if `None`; see [`IdleMonitor`].
+    ///
+    /// Dormant channels send no padding, and background probing pauses.
+    /// The next circuit or stream wakes everything up first.
+    pub fn set_idle_timeout(&self, quiet_period: Option<Duration>) -> AnyResult<()> {
+        self.idle.set_quiet_period(quiet_period, &self.runtime)
+    }
+
+    pub fn is_dormant(&self) -> bool {
+        self.idle.is_dormant()
+    }
+
     pub async fn extend(
         &mut self,
         relay_ip: &str,
         relay_port: u16,
         relay_fingerprint: &str
     ) -> AnyResult<Arc<ClientCirc>> {
+        let _busy = self.idle.busy();
         match self.circ {
             Some(_) => {
                 let circ = self.circ.as_ref().unwrap().clone();
@@ -215,7 +724,10 @@ impl<R: Runtime> TorCircuitManager<R> {
                 let cc_params = self.build_circuit_params()?;
                 let circ_params = CircParameters::new(true, cc_params);
 
-                circ.extend_ntor(&circ_target, &circ_params).await?;
+                self.extend_hop(&circ, &circ_target, &circ_params).await?;
+                self.note_built(&circ);
+                // The other legs no longer end where this one does.
+                self.multipath = None;
 
                 Ok(circ)
             },
@@ -223,6 +735,277 @@ impl<R: Runtime> TorCircuitManager<R> {
         }
     }
 
+    pub async fn set_priority(&self, priority: CircPriority) -> AnyResult<()> {
+        for circ in self.stream_circs()?.circs() {
+            circ.set_priority(priority)
+                .await
+                .map_err(|e| anyhow!("Failed to set circuit priority: {}", e))?;
+        }
+
+        Ok(())
+    }
+
+    /// Open a stream to each of `targets` on the current circuit (or
+    /// multipath set).
+    ///
+    /// BEGIN cells go out back to back, with at most `max_in_flight` of them
+    /// waiting for CONNECTED at once, so a batch costs about one round trip
+    /// rather than one per stream. Streams are yielded as they connect, each
+    /// with its circuit and its index in `targets`.
+    pub fn begin_streams(
+        &self,
+        targets: Vec<(String, u16)>,
+        max_in_flight: usize,
+    ) -> AnyResult<impl Stream<Item = (usize, AnyResult<(ClientStream, Arc<ClientCirc>)>)> + '_> {
+        if max_in_flight == 0 {
+            return Err(anyhow!("max_in_flight must be at least 1"));
+        }
+        self.idle.touch();
+        let circs = self.stream_circs()?;
+
+        let opens = futures::stream::iter(targets.into_iter().enumerate())
+            .map(move |(i, (host, port))| {
+                let circs = circs.clone();
+                async move {
+                    let stream = circs.begin_stream(&host, port, false)
+                        .await
+                        .map(|(stream, circ)| (self.limit_stream(stream, &circ, &host, port), circ))
+                        .map_err(|e| anyhow!("{}:{}: {}", host, port, e));
+                    (i, stream)
+                }
+            })
+            .buffer_unordered(max_in_flight);
+
+        Ok(opens)
+    }
+
+    /// Measure `candidate` with a short circuit, and note the results in
+    /// our latency table.
+    ///
+    /// Without `via`, we build a one-hop circuit to the candidate. With it, we
+    /// build a two-hop circuit through `via` to the candidate, which measures
+    /// the link between the two. Either way we time the last hop's handshake,
+    /// then a BEGIN_DIR / CONNECTED round trip to the last hop, if it is a
+    /// directory cache.
+    pub async fn probe_relay(&self, candidate: &RelaySpec, via: Option<&RelaySpec>) -> AnyResult<()> {
+        let cc_params = self.build_circuit_params()?;
+        let circ_params = CircParameters::new(true, cc_params);
+        let (ip, port, fingerprint) = candidate;
+        let target = self.circ_target_from_relay(ip, *port, fingerprint).await?;
+
+        let (circ, handshake) = match via {
+            None => {
+                let pending = self.create_common(&self.runtime, &target, ChannelUsage::UserTraffic)
+                    .await?;
+                let started = Instant::now();
+                let res = pending.create_firsthop_ntor(&target, circ_params).await;
+                self.note_handshake(&target, started, Duration::ZERO, res.is_ok());
+                let circ = res.map_err(|e| anyhow!("Failed to create first hop: {}", e))?;
+
+                (circ, started.elapsed())
+            },
+            Some(via) => {
+                let circ = self.build_path(std::slice::from_ref(via)).await?;
+                // The EXTEND2 goes through `via` first; only the rest is the
+                // candidate's handshake.
+                let path_rtt = self.path_rtt(&circ);
+                let started = Instant::now();
+                self.extend_hop(&circ, &target, &circ_params).await?;
+
+                (circ, started.elapsed().saturating_sub(path_rtt))
+            },
+        };
+
+        let started = Instant::now();
+        let rtt = async {
+            let mut stream = circ.clone().begin_dir_stream().await?;
+            stream.wait_for_connection().await?;
+            Ok::<_, tor_proto::Error>(started.elapsed())
+        }.await;
+        // A relay that isn't a directory cache refuses BEGIN_DIR; its
+        // handshake time is still worth keeping.
+        let rtt = rtt
+            .map_err(|e| info!("No BEGIN_DIR round trip to {}: {}", fingerprint, e))
+            .ok();
+
+        match via {
+            None => self.latency.note_direct(fingerprint, handshake, rtt),
+            Some((_, _, via)) => self.latency.note_via(via, fingerprint, handshake, rtt),
+        }
+        info!("Probed {}: handshake {:?}, rtt {:?}", fingerprint, handshake, rtt);
+
+        Ok(())
+    }
+
+    /// Probe each of `candidates` (see [`Self::probe_relay`]), with at most
+    /// `concurrency` probes in flight. Return how many succeeded.
+    pub async fn probe_relays(
+        &self,
+        candidates: &[RelaySpec],
+        via: Option<&RelaySpec>,
+        concurrency: usize,
+    ) -> usize {
+        futures::stream::iter(candidates)
+            .map(|candidate| async move {
+                let res = self.probe_relay(candidate, via).await;
+                if let Err(e) = &res {
+                    info!("Failed to probe {}: {}", candidate.2, e);
+                }
+                res.is_ok()
+            })
+            .buffer_unordered(concurrency.max(1))
+            .filter(|ok| futures::future::ready(*ok))
+            .count()
+            .await
+    }
+
+    /// Probe `candidates` now, and again every `interval`, in the background,
+    /// until [`Self::stop_probing`] is called or probing is started again.
+    pub fn start_probing(
+        &self,
+        candidates: Vec<RelaySpec>,
+        via: Option<RelaySpec>,
+        interval: Duration,
+        concurrency: usize,
+    ) -> AnyResult<()> {
+        self.probe_generation.send_modify(|generation| *generation += 1);
+        let mut stopped = self.probe_generation.subscribe();
+        let generation = *stopped.borrow();
+        let mgr = self.detached();
+
+        self.runtime.spawn(async move {
+            let rounds = async {
+                loop {
+                    // Probing doesn't count as activity, and doesn't run
+                    // while we're dormant.
+                    if !mgr.idle.is_dormant() {
+                        let n_ok = mgr.probe_relays(&candidates, via.as_ref(), concurrency).await;
+                        info!("Probed {}/{} relays", n_ok, candidates.len());
+                    }
+                    mgr.runtime.sleep(interval).await;
+                }
+            };
+            // Stop as soon as probing is stopped or restarted, even mid-round.
+            tokio::select! {
+                _ = rounds => {}
+                _ = stopped.wait_for(|current| *current != generation) => {}
+            }
+        })
+            .map_err(|_| anyhow!("Failed to spawn relay prober"))
+    }
+
+    /// Stop any background probing.
+    pub fn stop_probing(&self) {
+        self.probe_generation.send_modify(|generation| *generation += 1);
+    }
+
+    /// Measure the bandwidth of `target` by downloading from `server` over a
+    /// two-hop circuit with `helper`, a relay known to be fast.
+    ///
+    /// As in sbws, the helper exits unless the target can itself exit to
+    /// `server`. The rate is recorded against the target only: the helper is
+    /// assumed not to be the bottleneck. Time spent waiting on `budget` is
+    /// left out, but a budget much tighter than the relay's speed still
+    /// skews the result, since the relay keeps sending while we wait.
+    pub async fn measure_bandwidth(
+        &self,
+        target: &RelaySpec,
+        helper: &RelaySpec,
+        server: &ScanServer,
+        budget: &ScanBudget,
+    ) -> AnyResult<BandwidthMeasurement> {
+        let _busy = self.idle.busy();
+        let netdir = self.tor_chan_mgr.netdir()?;
+        let target_id = self.rsa_key_from_fingerprint(&target.2)?;
+        let target_exits = netdir.by_id(&target_id)
+            .map_or(false, |relay| relay.low_level_details().supports_exit_port_ipv4(server.port));
+        let hops = if target_exits {
+            [helper.clone(), target.clone()]
+        } else {
+            [target.clone(), helper.clone()]
+        };
+        // Dropping the circuit closes it without a lifetime being recorded,
+        // which is what we want for a measurement circuit.
+        let circ = self.build_path(&hops).await?;
+
+        let mut stream = circ.begin_stream(&server.host, server.port, None).await
+            .map_err(|e| anyhow!("Failed to begin stream: {}", e))?;
+        let request = format!(
+            "GET {} HTTP/1.1\r\nHost: {}\r\nConnection: close\r\n\r\n",
+            server.path, server.host,
+        );
+        let started = Instant::now();
+        stream.write_all(request.as_bytes()).await?;
+        stream.flush().await?;
+
+        let mut buf = vec![0; 64 * 1024];
+        let mut bytes = 0;
+        let mut paused = Duration::ZERO;
+        let mut elapsed = Duration::ZERO;
+        while bytes < server.max_bytes {
+            let Some(remaining) = server.max_time.checked_sub(started.elapsed()) else {
+                break;
+            };
+            let n = match tokio::time::timeout(remaining, stream.read(&mut buf)).await {
+                Ok(res) => res?,
+                Err(_) => break,
+            };
+            if n == 0 {
+                break;
+            }
+            bytes += n;
+            elapsed = started.elapsed().saturating_sub(paused);
+
+            let wait = budget.take(n);
+            if !wait.is_zero() {
+                self.runtime.sleep(wait).await;
+                paused += wait;
+            }
+        }
+
+        let measurement = BandwidthMeasurement { bytes, elapsed };
+        if bytes < MIN_THROUGHPUT_SAMPLE_BYTES {
+            return Err(anyhow!("Only received {} bytes", bytes));
+        }
+        if let Some(db) = &self.relay_db {
+            db.record(&target_id, ObservationKind::ScannedBandwidth, measurement.bytes_per_sec());
+        }
+        info!("Measured {} at {:.0} KiB/s", target.2, measurement.bytes_per_sec() / 1024.0);
+
+        Ok(measurement)
+    }
+
+    /// Measure each of `targets` (see [`Self::measure_bandwidth`]), with at
+    /// most `concurrency` measurements in flight, all sharing `budget`.
+    ///
+    /// Return each target's fingerprint with its result, in no particular
+    /// order.
+    pub async fn scan_bandwidth(
+        &self,
+        targets: &[RelaySpec],
+        helper: &RelaySpec,
+        server: &ScanServer,
+        concurrency: usize,
+        budget: &ScanBudget,
+    ) -> Vec<(String, AnyResult<BandwidthMeasurement>)> {
+        futures::stream::iter(targets)
+            .map(|target| async move {
+                let res = self.measure_bandwidth(target, helper, server, budget).await;
+                if let Err(e) = &res {
+                    info!("Failed to measure {}: {}", target.2, e);
+                }
+                (target.2.clone(), res)
+            })
+            .buffer_unordered(concurrency.max(1))
+            .collect()
+            .await
+    }
+
+    /// Return the table of relay latencies that probing fills in.
+    pub fn latency_table(&self) -> &LatencyTable {
+        &self.latency
+    }
+
     fn build_circuit_params(&self) -> AnyResult<tor_proto::ccparams::CongestionControlParams> {
         let params = FixedWindowParamsBuilder::default()
             .circ_window_start(1000)
@@ -257,4 +1040,33 @@ impl<R: Runtime> TorCircuitManager<R> {
             .build()
             .map_err(|e| anyhow!("Failed to build CC params: {}", e))
     }
-}
\ No newline at end of file
+}
+
+/// Return the score of every relay in `db` that we have recently observed,
+/// by identity; see [`RelayStats::score`]. Without a database, or if it
+/// can't be read, return none.
+///
+/// This blocks on the disk; don't call it from async code.
+fn relay_scores(db: Option<&RelayPerfDb>) -> HashMap<RsaIdentity, f64> {
+    let Some(db) = db else {
+        return HashMap::new();
+    };
+    match db.all_stats() {
+        Ok(stats) => stats.into_iter()
+            .filter_map(|(rsa_id, stats)| Some((RsaIdentity::from_hex(&rsa_id)?, stats.score())))
+            .collect(),
+        Err(e) => {
+            warn!("Not weighting relays by score: {}", e);
+            HashMap::new()
+        }
+    }
+}
+
+/// Record an observation of `kind` against every relay in `path`.
+fn record_path(db: &RelayPerfDb, path: &Path, kind: ObservationKind, value: f64) {
+    for hop in path.iter() {
+        if let Some(rsa_id) = hop.as_chan_target().and_then(|t| t.rsa_identity()) {
+            db.record(rsa_id, kind, value);
+        }
+    }
+}
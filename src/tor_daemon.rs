@@ -0,0 +1,536 @@
+use crate::tor_circmgr::{RelaySpec, TorCircuitManager};
+
+use log::{info, warn};
+use std::collections::HashMap;
+use std::io;
+use std::mem::size_of;
+use std::os::fd::{AsRawFd, FromRawFd, OwnedFd, RawFd};
+use std::os::unix::fs::{DirBuilderExt, FileTypeExt, MetadataExt, PermissionsExt};
+use std::path::{Path, PathBuf};
+use std::sync::{Arc, Mutex};
+use anyhow::{anyhow, Result as AnyResult};
+use futures::task::SpawnExt;
+use futures::{AsyncRead, AsyncReadExt, AsyncWrite, AsyncWriteExt};
+use tokio::io::{AsyncReadExt as _, AsyncWriteExt as _, Interest};
+use tokio::net::{UnixListener, UnixStream};
+use tokio::sync::oneshot;
+
+use tor_rtcompat::Runtime;
+
+/// Longest request line we accept.
+const MAX_REQUEST_LEN: usize = 4096;
+
+/// Size of the buffers we relay stream data through.
+const RELAY_BUF_LEN: usize = 16 * 1024;
+
+/// Circuits built for daemon clients, by name.
+///
+/// Each is a clone of the daemon's circuit manager, so they share its
+/// channels, relay database and rate limits.
+type NamedCircuits<R> = Mutex<HashMap<String, TorCircuitManager<R>>>;
+
+/// Keeps a daemon running; dropping it stops the daemon and removes its
+/// socket.
+///
+/// Streams already handed out carry on.
+pub struct DaemonHandle {
+    _stop: oneshot::Sender<()>,
+}
+
+/// Listen on `path`, and serve requests with circuits from `mgr` until the
+/// returned handle is dropped.
+///
+/// Clients send one request per line, with fields separated by tabs, and
+/// wait for a one-line reply before sending the next:
+///
+/// - `CIRCUIT name ip port rsa_id [ip port rsa_id ...]` builds a circuit
+///   through the given hops and names it, replacing any circuit of that name.
+/// - `STREAM name host port` opens a stream to `host:port` on the named
+///   circuit. The reply carries one end of a socket pair (as SCM_RIGHTS
+///   ancillary data); we relay between the other end and the stream.
+/// - `CLOSE name` forgets the named circuit; open streams on it carry on.
+///
+/// Replies are `OK`, or `ERR` and a message.
+///
+/// A stale socket at `path` is replaced. The new socket is only accessible
+/// to our own user, from the moment it's bound.
+pub fn serve<R: Runtime>(mgr: TorCircuitManager<R>, path: &Path, runtime: &R) -> AnyResult<DaemonHandle> {
+    match std::fs::symlink_metadata(path) {
+        Ok(meta) if meta.file_type().is_socket() => std::fs::remove_file(path)?,
+        Ok(_) => return Err(anyhow!("{} exists and is not a socket", path.display())),
+        Err(_) => {}
+    }
+    // Bind here, so errors reach the caller; the listener joins the tokio
+    // reactor once the accept loop is running on it.
+    let listener = bind_private(path)?;
+    listener.set_nonblocking(true)?;
+    info!("Serving circuits on {}", path.display());
+
+    let (stop, stopped) = oneshot::channel();
+    let path = path.to_path_buf();
+    runtime.spawn(accept_loop(listener, mgr, path, stopped, runtime.clone()))
+        .map_err(|e| anyhow!("Failed to spawn daemon: {}", e))?;
+
+    Ok(DaemonHandle { _stop: stop })
+}
+
+/// Bind a socket at `path` that only our own user can connect to.
+///
+/// The socket is bound in a fresh directory that only we can enter, made
+/// private there, and then moved into place; so nobody can connect to it
+/// before it's private, whatever our umask.
+fn bind_private(path: &Path) -> AnyResult<std::os::unix::net::UnixListener> {
+    let file_name = path.file_name()
+        .ok_or_else(|| anyhow!("{} is not a socket path", path.display()))?;
+    let parent = match path.parent() {
+        Some(parent) if !parent.as_os_str().is_empty() => parent,
+        _ => Path::new("."),
+    };
+    let staging = parent.join(format!(".{}.{}", file_name.to_string_lossy(), std::process::id()));
+    std::fs::DirBuilder::new().mode(0o700).create(&staging)
+        .map_err(|e| anyhow!("Failed to create {}: {}", staging.display(), e))?;
+
+    let staged = staging.join(file_name);
+    let bound = std::os::unix::net::UnixListener::bind(&staged)
+        .and_then(|listener| {
+            std::fs::set_permissions(&staged, std::fs::Permissions::from_mode(0o600))?;
+            std::fs::rename(&staged, path)?;
+            Ok(listener)
+        });
+    let _ = std::fs::remove_file(&staged);
+    let _ = std::fs::remove_dir(&staging);
+    let listener = bound?;
+
+    let meta = std::fs::symlink_metadata(path)?;
+    // SAFETY: geteuid has no preconditions and can't fail.
+    let uid = unsafe { libc::geteuid() };
+    if !meta.file_type().is_socket() || meta.uid() != uid || meta.mode() & 0o077 != 0 {
+        let _ = std::fs::remove_file(path);
+        return Err(anyhow!("{} is not a private socket of ours", path.display()));
+    }
+
+    Ok(listener)
+}
+
+async fn accept_loop<R: Runtime>(
+    listener: std::os::unix::net::UnixListener,
+    mgr: TorCircuitManager<R>,
+    path: PathBuf,
+    mut stopped: oneshot::Receiver<()>,
+    runtime: R,
+) {
+    let listener = match UnixListener::from_std(listener) {
+        Ok(listener) => listener,
+        Err(e) => {
+            warn!("Failed to listen on {}: {}", path.display(), e);
+            return;
+        }
+    };
+    let circuits: Arc<NamedCircuits<R>> = Arc::new(Mutex::new(HashMap::new()));
+    loop {
+        let conn = tokio::select! {
+            _ = &mut stopped => break,
+            conn = listener.accept() => conn,
+        };
+        match conn {
+            Ok((conn, _)) => {
+                let mgr = mgr.clone();
+                let circuits = circuits.clone();
+                let client_runtime = runtime.clone();
+                let spawned = runtime.spawn(async move {
+                    if let Err(e) = serve_client(conn, mgr, circuits, client_runtime).await {
+                        warn!("Daemon client failed: {}", e);
+                    }
+                });
+                if let Err(e) = spawned {
+                    warn!("Failed to spawn daemon client: {}", e);
+                }
+            }
+            Err(e) => warn!("Failed to accept daemon client: {}", e),
+        }
+    }
+    drop(listener);
+    let _ = std::fs::remove_file(&path);
+    info!("Stopped serving circuits on {}", path.display());
+}
+
+/// Answer requests from one client until it hangs up.
+async fn serve_client<R: Runtime>(
+    conn: UnixStream,
+    mgr: TorCircuitManager<R>,
+    circuits: Arc<NamedCircuits<R>>,
+    runtime: R,
+) -> AnyResult<()> {
+    let mut pending = Vec::new();
+    let mut buf = [0u8; 1024];
+    loop {
+        let Some(end) = pending.iter().position(|b| *b == b'\n') else {
+            if pending.len() > MAX_REQUEST_LEN {
+                return Err(anyhow!("Request too long"));
+            }
+            conn.readable().await?;
+            match conn.try_read(&mut buf) {
+                Ok(0) => return Ok(()),
+                Ok(n) => pending.extend_from_slice(&buf[..n]),
+                Err(e) if e.kind() == io::ErrorKind::WouldBlock => {}
+                Err(e) => return Err(e.into()),
+            }
+            continue;
+        };
+        let line: Vec<u8> = pending.drain(..=end).collect();
+        let line = String::from_utf8_lossy(&line[..end]).into_owned();
+
+        let (reply, fd) = match handle_request(&line, &mgr, &circuits, &runtime).await {
+            Ok(fd) => ("OK\n".to_string(), fd),
+            Err(e) => (format!("ERR\t{}\n", e.to_string().replace(['\n', '\t'], " ")), None),
+        };
+        let fd_raw = fd.as_ref().map(AsRawFd::as_raw_fd);
+        let sent = conn.async_io(Interest::WRITABLE, || send_with_fd(conn.as_raw_fd(), reply.as_bytes(), fd_raw))
+            .await?;
+        if sent != reply.len() {
+            return Err(anyhow!("Short write to daemon client"));
+        }
+        // Our copy of the client's end closes here; theirs stays open.
+    }
+}
+
+/// Carry out one request, returning the descriptor to pass back, if any.
+async fn handle_request<R: Runtime>(
+    line: &str,
+    mgr: &TorCircuitManager<R>,
+    circuits: &NamedCircuits<R>,
+    runtime: &R,
+) -> AnyResult<Option<OwnedFd>> {
+    let fields: Vec<&str> = line.split('\t').collect();
+    match fields.as_slice() {
+        ["CIRCUIT", name, hops @ ..] if !hops.is_empty() && hops.len() % 3 == 0 => {
+            let hops = hops.chunks(3)
+                .map(|hop| {
+                    let port = hop[1].parse().map_err(|_| anyhow!("Invalid port: {}", hop[1]))?;
+                    Ok((hop[0].to_string(), port, hop[2].to_string()))
+                })
+                .collect::<AnyResult<Vec<RelaySpec>>>()?;
+            // Build on a clone, so other clients aren't held up meanwhile.
+            let mut named = mgr.clone();
+            named.create_path(&hops).await?;
+            circuits.lock().expect("poisoned lock").insert(name.to_string(), named);
+
+            Ok(None)
+        }
+        ["STREAM", name, host, port] => {
+            let port = port.parse().map_err(|_| anyhow!("Invalid port: {}", port))?;
+            let named = circuits.lock().expect("poisoned lock")
+                .get(*name)
+                .cloned()
+                .ok_or_else(|| anyhow!("No circuit named {}", name))?;
+            let (stream, _) = named.begin_stream(host, port, false).await?;
+
+            let (ours, theirs) = std::os::unix::net::UnixStream::pair()?;
+            ours.set_nonblocking(true)?;
+            let ours = UnixStream::from_std(ours)?;
+            runtime.spawn(relay(stream, ours))
+                .map_err(|e| anyhow!("Failed to spawn stream relay: {}", e))?;
+
+            Ok(Some(theirs.into()))
+        }
+        ["CLOSE", name] => {
+            circuits.lock().expect("poisoned lock").remove(*name);
+
+            Ok(None)
+        }
+        _ => Err(anyhow!("Malformed request")),
+    }
+}
+
+/// Copy data both ways between a Tor `stream` and a `local` socket until
+/// either side is done.
+async fn relay<S>(stream: S, local: UnixStream)
+where
+    S: AsyncRead + AsyncWrite + Unpin,
+{
+    let (mut tor_read, mut tor_write) = stream.split();
+    let (mut local_read, mut local_write) = local.into_split();
+
+    let upload = async {
+        let mut buf = vec![0u8; RELAY_BUF_LEN];
+        loop {
+            // Tor streams can't be half-closed, so when the client shuts
+            // down its side we just stop sending, and wait for the reply.
+            let n = local_read.read(&mut buf).await?;
+            if n == 0 {
+                return Ok::<_, io::Error>(());
+            }
+            tor_write.write_all(&buf[..n]).await?;
+            tor_write.flush().await?;
+        }
+    };
+    let download = async {
+        let mut buf = vec![0u8; RELAY_BUF_LEN];
+        loop {
+            let n = tor_read.read(&mut buf).await?;
+            if n == 0 {
+                local_write.shutdown().await?;
+                return Ok::<_, io::Error>(());
+            }
+            local_write.write_all(&buf[..n]).await?;
+        }
+    };
+    // The download decides when the stream is over; an upload error (the
+    // client hanging up) ends it early.
+    let res = tokio::select! {
+        res = download => res,
+        Err(e) = upload => Err(e),
+    };
+    if let Err(e) = res {
+        info!("Daemon stream ended: {}", e);
+    }
+}
+
+/// Send `data` on the Unix socket `sock`, along with a copy of `fd` if given.
+fn send_with_fd(sock: RawFd, data: &[u8], fd: Option<RawFd>) -> io::Result<usize> {
+    // Room for one descriptor's control message, suitably aligned.
+    let mut control = [0u64; 4];
+    let mut iov = libc::iovec { iov_base: data.as_ptr() as *mut libc::c_void, iov_len: data.len() };
+    // SAFETY: msghdr is plain old data, for which all zeroes is valid.
+    let mut msg: libc::msghdr = unsafe { std::mem::zeroed() };
+    msg.msg_iov = &mut iov;
+    msg.msg_iovlen = 1;
+    if let Some(fd) = fd {
+        // SAFETY: `control` outlives `msg` and has room for one descriptor,
+        // so the header CMSG_FIRSTHDR gives us, and its data, lie within it.
+        unsafe {
+            msg.msg_control = control.as_mut_ptr() as *mut libc::c_void;
+            msg.msg_controllen = libc::CMSG_SPACE(size_of::<RawFd>() as u32) as _;
+            let cmsg = libc::CMSG_FIRSTHDR(&msg);
+            (*cmsg).cmsg_level = libc::SOL_SOCKET;
+            (*cmsg).cmsg_type = libc::SCM_RIGHTS;
+            (*cmsg).cmsg_len = libc::CMSG_LEN(size_of::<RawFd>() as u32) as _;
+            std::ptr::write_unaligned(libc::CMSG_DATA(cmsg) as *mut RawFd, fd);
+        }
+    }
+
+    // SAFETY: `msg` points only at buffers that live until after the call.
+    let n = unsafe { libc::sendmsg(sock, &msg, libc::MSG_NOSIGNAL) };
+    if n < 0 {
+        Err(io::Error::last_os_error())
+    } else {
+        Ok(n as usize)
+    }
+}
+
+/// Receive data from the Unix socket `sock` into `buf`, along with a
+/// descriptor, if one was sent with it.
+fn recv_with_fd(sock: RawFd, buf: &mut [u8]) -> io::Result<(usize, Option<OwnedFd>)> {
+    let mut control = [0u64; 4];
+    let mut iov = libc::iovec { iov_base: buf.as_mut_ptr() as *mut libc::c_void, iov_len: buf.len() };
+    // SAFETY: as in `send_with_fd`.
+    let mut msg: libc::msghdr = unsafe { std::mem::zeroed() };
+    msg.msg_iov = &mut iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.as_mut_ptr() as *mut libc::c_void;
+    msg.msg_controllen = std::mem::size_of_val(&control) as _;
+
+    // SAFETY: `msg` points only at buffers that live until after the call.
+    let n = unsafe { libc::recvmsg(sock, &mut msg, libc::MSG_CMSG_CLOEXEC) };
+    if n < 0 {
+        return Err(io::Error::last_os_error());
+    }
+
+    let mut fd = None;
+    // SAFETY: the kernel filled in `msg`; we only read the control messages
+    // it reports, and take ownership of descriptors it passed to us.
+    unsafe {
+        let mut cmsg = libc::CMSG_FIRSTHDR(&msg);
+        while !cmsg.is_null() {
+            if (*cmsg).cmsg_level == libc::SOL_SOCKET && (*cmsg).cmsg_type == libc::SCM_RIGHTS {
+                let raw = std::ptr::read_unaligned(libc::CMSG_DATA(cmsg) as *const RawFd);
+                fd = Some(OwnedFd::from_raw_fd(raw));
+            }
+            cmsg = libc::CMSG_NXTHDR(&msg, cmsg);
+        }
+    }
+
+    Ok((n as usize, fd))
+}
+
+/// A connection to a daemon, from a process that doesn't run Tor itself.
+///
+/// Requests block until the daemon answers.
+pub struct DaemonClient {
+    conn: std::os::unix::net::UnixStream,
+}
+
+impl DaemonClient {
+    pub fn connect(path: &Path) -> AnyResult<Self> {
+        let conn = std::os::unix::net::UnixStream::connect(path)
+            .map_err(|e| anyhow!("Failed to connect to daemon at {}: {}", path.display(), e))?;
+
+        Ok(Self { conn })
+    }
+
+    /// Build a circuit through `hops` in the daemon, and call it `name`.
+    pub fn create_circuit(&mut self, name: &str, hops: &[RelaySpec]) -> AnyResult<()> {
+        let mut fields = vec!["CIRCUIT".to_string(), name.to_string()];
+        for (ip, port, rsa_id) in hops {
+            fields.extend([ip.clone(), port.to_string(), rsa_id.clone()]);
+        }
+        self.request(&fields)?;
+
+        Ok(())
+    }
+
+    /// Open a stream to `host:port` on the circuit called `name`, and return
+    /// a socket connected to it.
+    pub fn open_stream(&mut self, name: &str, host: &str, port: u16) -> AnyResult<OwnedFd> {
+        let fields = ["STREAM".to_string(), name.to_string(), host.to_string(), port.to_string()];
+
+        self.request(&fields)?.ok_or_else(|| anyhow!("Daemon sent no socket for the stream"))
+    }
+
+    pub fn close_circuit(&mut self, name: &str) -> AnyResult<()> {
+        self.request(&["CLOSE".to_string(), name.to_string()])?;
+
+        Ok(())
+    }
+
+    /// Send a request, and wait for the reply and any descriptor with it.
+    fn request(&mut self, fields: &[String]) -> AnyResult<Option<OwnedFd>> {
+        if fields.iter().any(|f| f.is_empty() || f.contains(['\t', '\n'])) {
+            return Err(anyhow!("Request fields must be non-empty, without tabs or newlines"));
+        }
+        std::io::Write::write_all(&mut self.conn, format!("{}\n", fields.join("\t")).as_bytes())?;
+
+        let mut reply = Vec::new();
+        let mut fd = None;
+        let mut buf = [0u8; 512];
+        while !reply.ends_with(b"\n") {
+            let (n, passed) = recv_with_fd(self.conn.as_raw_fd(), &mut buf)?;
+            if n == 0 {
+                return Err(anyhow!("Daemon hung up"));
+            }
+            reply.extend_from_slice(&buf[..n]);
+            fd = fd.or(passed);
+        }
+        let reply = String::from_utf8_lossy(&reply);
+        match reply.trim_end().split_once('\t') {
+            None if reply.trim_end() == "OK" => Ok(fd),
+            Some(("ERR", msg)) => Err(anyhow!("{}", msg)),
+            _ => Err(anyhow!("Unexpected reply from daemon: {}", reply.trim_end())),
+        }
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use std::io::{Read, Write};
+    use std::os::unix::net::UnixStream as StdUnixStream;
+    use std::time::Duration;
+
+    #[test]
+    fn data_and_fd() {
+        let (tx, rx) = StdUnixStream::pair().unwrap();
+        let (mut ours, theirs) = StdUnixStream::pair().unwrap();
+        assert_eq!(send_with_fd(tx.as_raw_fd(), b"OK\n", Some(theirs.as_raw_fd())).unwrap(), 3);
+        // The receiver gets its own copy.
+        drop(theirs);
+
+        let mut buf = [0u8; 16];
+        let (n, fd) = recv_with_fd(rx.as_raw_fd(), &mut buf).unwrap();
+        assert_eq!(&buf[..n], b"OK\n");
+        let mut passed = StdUnixStream::from(fd.expect("no descriptor passed"));
+        passed.write_all(b"ping").unwrap();
+        let mut got = [0u8; 4];
+        ours.read_exact(&mut got).unwrap();
+        assert_eq!(&got, b"ping");
+    }
+
+    #[test]
+    fn data_without_fd() {
+        let (tx, rx) = StdUnixStream::pair().unwrap();
+        assert_eq!(send_with_fd(tx.as_raw_fd(), b"ERR\tnope\n", None).unwrap(), 9);
+
+        let mut buf = [0u8; 16];
+        let (n, fd) = recv_with_fd(rx.as_raw_fd(), &mut buf).unwrap();
+        assert_eq!(&buf[..n], b"ERR\tnope\n");
+        assert!(fd.is_none());
+    }
+
+    /// Run a `DaemonClient` request against a fake daemon that reads the
+    /// request and then sends `reply` in pieces, passing `fd` with the first.
+    fn fake_request(
+        reply: &'static [&'static [u8]],
+        fd: Option<StdUnixStream>,
+        request: impl FnOnce(&mut DaemonClient) -> AnyResult<()>,
+    ) -> (AnyResult<()>, Vec<u8>) {
+        let (conn, mut daemon) = StdUnixStream::pair().unwrap();
+        let server = std::thread::spawn(move || {
+            let mut line = Vec::new();
+            let mut byte = [0u8];
+            while !line.ends_with(b"\n") {
+                daemon.read_exact(&mut byte).unwrap();
+                line.push(byte[0]);
+            }
+            let mut fd = fd;
+            for piece in reply {
+                let passing = fd.take();
+                let raw = passing.as_ref().map(AsRawFd::as_raw_fd);
+                send_with_fd(daemon.as_raw_fd(), piece, raw).unwrap();
+                std::thread::sleep(Duration::from_millis(20));
+            }
+            line
+        });
+
+        let res = request(&mut DaemonClient { conn });
+        (res, server.join().unwrap())
+    }
+
+    #[test]
+    fn reply_split_across_reads() {
+        let (mut ours, theirs) = StdUnixStream::pair().unwrap();
+        let (res, line) = fake_request(&[b"O", b"K", b"\n"], Some(theirs), |client| {
+            let mut passed = StdUnixStream::from(client.open_stream("c", "example.com", 80)?);
+            passed.write_all(b"ping")?;
+            Ok(())
+        });
+        res.unwrap();
+        assert_eq!(line, b"STREAM\tc\texample.com\t80\n");
+        let mut got = [0u8; 4];
+        ours.read_exact(&mut got).unwrap();
+        assert_eq!(&got, b"ping");
+    }
+
+    #[test]
+    fn error_reply() {
+        let (res, line) = fake_request(&[b"ERR\tNo circuit", b" named c\n"], None, |client| {
+            client.close_circuit("c")
+        });
+        assert_eq!(res.unwrap_err().to_string(), "No circuit named c");
+        assert_eq!(line, b"CLOSE\tc\n");
+    }
+
+    #[test]
+    fn missing_fd() {
+        let (res, _) = fake_request(&[b"OK\n"], None, |client| {
+            client.open_stream("c", "example.com", 80).map(drop)
+        });
+        assert!(res.is_err());
+    }
+
+    #[test]
+    fn private_socket() {
+        let dir = std::env::temp_dir().join(format!("pyarti-daemon-test-{}", std::process::id()));
+        std::fs::create_dir_all(&dir).unwrap();
+        let path = dir.join("daemon.sock");
+        let _listener = bind_private(&path).unwrap();
+
+        let meta = std::fs::symlink_metadata(&path).unwrap();
+        assert!(meta.file_type().is_socket());
+        assert_eq!(meta.mode() & 0o777, 0o600);
+        // Nothing left behind but the socket.
+        assert_eq!(std::fs::read_dir(&dir).unwrap().count(), 1);
+        StdUnixStream::connect(&path).unwrap();
+
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+}
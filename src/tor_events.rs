@@ -0,0 +1,359 @@
+use std::collections::VecDeque;
+use std::io;
+use std::pin::Pin;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Condvar, Mutex};
+use std::task::{Context, Poll};
+use std::time::{Duration, Instant, SystemTime, UNIX_EPOCH};
+use futures::{AsyncRead, AsyncWrite};
+use tor_netdir::NetDir;
+
+/// Most events we hold for delivery; past this, the oldest are dropped.
+const RING_CAPACITY: usize = 4096;
+
+/// A stream reports a milestone each time this many more bytes have gone
+/// through it, in either direction.
+pub const BYTES_MILESTONE: usize = 1 << 20;
+
+/// A value attached to an event.
+#[derive(Debug, Clone)]
+pub enum EventValue {
+    Int(i64),
+    Float(f64),
+    Str(String),
+}
+
+impl From<u64> for EventValue {
+    fn from(v: u64) -> Self {
+        EventValue::Int(v as i64)
+    }
+}
+
+impl From<usize> for EventValue {
+    fn from(v: usize) -> Self {
+        EventValue::Int(v as i64)
+    }
+}
+
+impl From<f64> for EventValue {
+    fn from(v: f64) -> Self {
+        EventValue::Float(v)
+    }
+}
+
+impl From<String> for EventValue {
+    fn from(v: String) -> Self {
+        EventValue::Str(v)
+    }
+}
+
+impl From<&str> for EventValue {
+    fn from(v: &str) -> Self {
+        EventValue::Str(v.to_string())
+    }
+}
+
+/// Something that happened to a client: `kind` is one of "circuit_built",
+/// "circuit_closed", "stream_opened", "stream_closed", "bytes_milestone",
+/// "bootstrap_progress", "netdir_updated" or "events_dropped".
+#[derive(Debug, Clone)]
+pub struct TorEvent {
+    pub kind: &'static str,
+    pub at: SystemTime,
+    pub fields: Vec<(&'static str, EventValue)>,
+}
+
+impl TorEvent {
+    pub fn new(kind: &'static str) -> Self {
+        Self { kind, at: SystemTime::now(), fields: Vec::new() }
+    }
+
+    pub fn with(mut self, name: &'static str, value: impl Into<EventValue>) -> Self {
+        self.fields.push((name, value.into()));
+        self
+    }
+}
+
+struct Ring {
+    events: VecDeque<TorEvent>,
+    /// Events dropped since the last batch, because nobody took them in time.
+    dropped: u64,
+    /// Whether anybody is taking events; until then we don't keep them.
+    listening: bool,
+}
+
+/// A bounded queue of events, emitted from anywhere (including async code,
+/// which never blocks on it) and taken in batches by one consumer thread.
+pub struct EventBus {
+    ring: Mutex<Ring>,
+    ready: Condvar,
+    /// Number given to the last stream we watched.
+    last_stream: AtomicU64,
+}
+
+impl EventBus {
+    pub fn new() -> Arc<Self> {
+        Arc::new(Self {
+            ring: Mutex::new(Ring { events: VecDeque::new(), dropped: 0, listening: false }),
+            ready: Condvar::new(),
+            last_stream: AtomicU64::new(0),
+        })
+    }
+
+    /// Start keeping events for [`EventBus::next_batch`].
+    pub fn listen(&self) {
+        self.ring.lock().expect("poisoned lock").listening = true;
+    }
+
+    pub fn emit(&self, event: TorEvent) {
+        let mut ring = self.ring.lock().expect("poisoned lock");
+        if !ring.listening {
+            return;
+        }
+        if ring.events.len() >= RING_CAPACITY {
+            ring.events.pop_front();
+            ring.dropped += 1;
+        }
+        ring.events.push_back(event);
+        drop(ring);
+        self.ready.notify_one();
+    }
+
+    /// Wait up to `timeout` for an event, then up to `linger` more for others
+    /// to join it, and return them all (at most `max`).
+    ///
+    /// Lingering lets a burst of events go out as one batch. Return an
+    /// empty batch if nothing happened within `timeout`.
+    pub fn next_batch(&self, max: usize, timeout: Duration, linger: Duration) -> Vec<TorEvent> {
+        let ring = self.ring.lock().expect("poisoned lock");
+        let (mut ring, _) = self.ready
+            .wait_timeout_while(ring, timeout, |r| r.events.is_empty())
+            .expect("poisoned lock");
+        if ring.events.is_empty() {
+            return Vec::new();
+        }
+
+        let deadline = Instant::now() + linger;
+        while ring.events.len() < max {
+            let left = deadline.saturating_duration_since(Instant::now());
+            if left.is_zero() {
+                break;
+            }
+            ring = self.ready.wait_timeout(ring, left).expect("poisoned lock").0;
+        }
+
+        let mut batch = Vec::with_capacity(ring.events.len().min(max) + 1);
+        if ring.dropped > 0 {
+            batch.push(TorEvent::new("events_dropped").with("count", ring.dropped));
+            ring.dropped = 0;
+        }
+        let n = ring.events.len().min(max);
+        batch.extend(ring.events.drain(..n));
+
+        batch
+    }
+}
+
+/// Return a "netdir_updated" event for `netdir`.
+pub fn netdir_updated(netdir: &NetDir) -> TorEvent {
+    let valid_until = netdir.lifetime().valid_until()
+        .duration_since(UNIX_EPOCH)
+        .map_or(0.0, |d| d.as_secs_f64());
+
+    TorEvent::new("netdir_updated")
+        .with("relays", netdir.relays().count())
+        .with("valid_until", valid_until)
+}
+
+/// A stream that reports its opening, byte milestones and closing as events.
+pub struct WatchedStream<T> {
+    inner: T,
+    bus: Arc<EventBus>,
+    stream: u64,
+    opened: Instant,
+    read: usize,
+    written: usize,
+    next_milestone: usize,
+}
+
+impl<T> WatchedStream<T> {
+    /// Report that `inner`, a stream to `target`, has opened.
+    pub fn new(inner: T, bus: Arc<EventBus>, target: &str) -> Self {
+        let stream = bus.last_stream.fetch_add(1, Ordering::Relaxed) + 1;
+        bus.emit(TorEvent::new("stream_opened").with("stream", stream).with("target", target));
+        Self { inner, bus, stream, opened: Instant::now(), read: 0, written: 0, next_milestone: BYTES_MILESTONE }
+    }
+
+    fn note(&mut self, read: usize, written: usize) {
+        self.read += read;
+        self.written += written;
+        let total = self.read + self.written;
+        if total >= self.next_milestone {
+            self.bus.emit(TorEvent::new("bytes_milestone")
+                .with("stream", self.stream)
+                .with("bytes_read", self.read)
+                .with("bytes_written", self.written));
+            self.next_milestone = (total / BYTES_MILESTONE + 1) * BYTES_MILESTONE;
+        }
+    }
+}
+
+impl<T> Drop for WatchedStream<T> {
+    fn drop(&mut self) {
+        self.bus.emit(TorEvent::new("stream_closed")
+            .with("stream", self.stream)
+            .with("bytes_read", self.read)
+            .with("bytes_written", self.written)
+            .with("secs", self.opened.elapsed().as_secs_f64()));
+    }
+}
+
+impl<T: AsyncRead + Unpin> AsyncRead for WatchedStream<T> {
+    fn poll_read(self: Pin<&mut Self>, cx: &mut Context<'_>, buf: &mut [u8]) -> Poll<io::Result<usize>> {
+        let this = self.get_mut();
+        let n = futures::ready!(Pin::new(&mut this.inner).poll_read(cx, buf))?;
+        this.note(n, 0);
+        Poll::Ready(Ok(n))
+    }
+}
+
+impl<T: AsyncWrite + Unpin> AsyncWrite for WatchedStream<T> {
+    fn poll_write(self: Pin<&mut Self>, cx: &mut Context<'_>, buf: &[u8]) -> Poll<io::Result<usize>> {
+        let this = self.get_mut();
+        let n = futures::ready!(Pin::new(&mut this.inner).poll_write(cx, buf))?;
+        this.note(0, n);
+        Poll::Ready(Ok(n))
+    }
+
+    fn poll_flush(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<io::Result<()>> {
+        Pin::new(&mut self.get_mut().inner).poll_flush(cx)
+    }
+
+    fn poll_close(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<io::Result<()>> {
+        Pin::new(&mut self.get_mut().inner).poll_close(cx)
+    }
+}
+
+impl<T: tokio::io::AsyncRead + Unpin> tokio::io::AsyncRead for WatchedStream<T> {
+    fn poll_read(
+        self: Pin<&mut Self>,
+        cx: &mut Context<'_>,
+        buf: &mut tokio::io::ReadBuf<'_>,
+    ) -> Poll<io::Result<()>> {
+        let this = self.get_mut();
+        let before = buf.filled().len();
+        futures::ready!(Pin::new(&mut this.inner).poll_read(cx, buf))?;
+        this.note(buf.filled().len() - before, 0);
+        Poll::Ready(Ok(()))
+    }
+}
+
+impl<T: tokio::io::AsyncWrite + Unpin> tokio::io::AsyncWrite for WatchedStream<T> {
+    fn poll_write(self: Pin<&mut Self>, cx: &mut Context<'_>, buf: &[u8]) -> Poll<io::Result<usize>> {
+        let this = self.get_mut();
+        let n = futures::ready!(Pin::new(&mut this.inner).poll_write(cx, buf))?;
+        this.note(0, n);
+        Poll::Ready(Ok(n))
+    }
+
+    fn poll_flush(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<io::Result<()>> {
+        Pin::new(&mut self.get_mut().inner).poll_flush(cx)
+    }
+
+    fn poll_shutdown(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<io::Result<()>> {
+        Pin::new(&mut self.get_mut().inner).poll_shutdown(cx)
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn kinds(batch: &[TorEvent]) -> Vec<&'static str> {
+        batch.iter().map(|e| e.kind).collect()
+    }
+
+    #[test]
+    fn nothing_kept_until_listening() {
+        let bus = EventBus::new();
+        bus.emit(TorEvent::new("circuit_built"));
+        bus.listen();
+        assert!(bus.next_batch(10, Duration::ZERO, Duration::ZERO).is_empty());
+    }
+
+    #[test]
+    fn overflow_reports_dropped() {
+        let bus = EventBus::new();
+        bus.listen();
+        for i in 0..RING_CAPACITY + 5 {
+            bus.emit(TorEvent::new("stream_opened").with("stream", i));
+        }
+
+        let batch = bus.next_batch(RING_CAPACITY * 2, Duration::ZERO, Duration::ZERO);
+        assert_eq!(batch.len(), RING_CAPACITY + 1);
+        assert_eq!(batch[0].kind, "events_dropped");
+        assert!(matches!(batch[0].fields[..], [("count", EventValue::Int(5))]));
+        // The oldest went first.
+        assert!(matches!(batch[1].fields[..], [("stream", EventValue::Int(5))]));
+
+        // The count starts over once reported.
+        bus.emit(TorEvent::new("circuit_built"));
+        let batch = bus.next_batch(10, Duration::ZERO, Duration::ZERO);
+        assert_eq!(kinds(&batch), ["circuit_built"]);
+    }
+
+    #[test]
+    fn batch_capped_at_max() {
+        let bus = EventBus::new();
+        bus.listen();
+        for _ in 0..5 {
+            bus.emit(TorEvent::new("circuit_built"));
+        }
+
+        assert_eq!(bus.next_batch(3, Duration::ZERO, Duration::from_secs(10)).len(), 3);
+        assert_eq!(bus.next_batch(3, Duration::ZERO, Duration::ZERO).len(), 2);
+    }
+
+    #[test]
+    fn linger_gathers_a_burst() {
+        let bus = EventBus::new();
+        bus.listen();
+        let emitter = {
+            let bus = bus.clone();
+            std::thread::spawn(move || {
+                bus.emit(TorEvent::new("circuit_built"));
+                std::thread::sleep(Duration::from_millis(50));
+                bus.emit(TorEvent::new("circuit_closed"));
+            })
+        };
+
+        // The first event arrives within the timeout; the second joins it
+        // while we linger, and fills the batch, so we stop lingering then.
+        let started = Instant::now();
+        let batch = bus.next_batch(2, Duration::from_secs(10), Duration::from_secs(10));
+        emitter.join().unwrap();
+        assert_eq!(kinds(&batch), ["circuit_built", "circuit_closed"]);
+        assert!(started.elapsed() < Duration::from_secs(10));
+    }
+
+    #[test]
+    fn linger_ends_at_deadline() {
+        let bus = EventBus::new();
+        bus.listen();
+        bus.emit(TorEvent::new("circuit_built"));
+
+        let started = Instant::now();
+        let batch = bus.next_batch(10, Duration::from_secs(10), Duration::from_millis(50));
+        assert_eq!(kinds(&batch), ["circuit_built"]);
+        assert!(started.elapsed() >= Duration::from_millis(50));
+    }
+
+    #[test]
+    fn timeout_gives_empty_batch() {
+        let bus = EventBus::new();
+        bus.listen();
+        let started = Instant::now();
+        assert!(bus.next_batch(10, Duration::from_millis(20), Duration::from_secs(10)).is_empty());
+        assert!(started.elapsed() < Duration::from_secs(10));
+    }
+}
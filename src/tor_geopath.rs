@@ -0,0 +1,424 @@
+use std::collections::HashMap;
+use std::net::IpAddr;
+use std::str::FromStr;
+use anyhow::{anyhow, Result as AnyResult};
+use rand::seq::SliceRandom;
+
+use tor_geoip::{CountryCode, GeoipDb};
+use tor_linkspec::HasAddrs;
+use tor_netdir::{NetDir, Relay, RelayWeight, SubnetConfig, WeightRole};
+
+use crate::tor_circmgr::RelaySpec;
+
+/// Fibre carries light about this many kilometres per millisecond.
+const FIBRE_KM_PER_MS: f64 = 200.0;
+
+/// How much longer than the great circle we assume a route between two
+/// countries to be.
+const ROUTE_STRETCH: f64 = 1.5;
+
+/// Round trip, in milliseconds, that we add for each link on top of the
+/// distance, for queueing and the last mile.
+const LINK_OVERHEAD_MS: f64 = 5.0;
+
+/// Radius of the earth, in kilometres.
+const EARTH_RADIUS_KM: f64 = 6371.0;
+
+/// How many country triples, best first, we try before giving up.
+const MAX_TRIPLES_TRIED: usize = 32;
+
+/// Limits that keep geo-aware paths from getting too predictable.
+#[derive(Debug, Clone)]
+pub struct GeoPathLimits {
+    /// Most hops that may be in the same country.
+    pub max_per_country: usize,
+    /// Fewest usable relays a country must have in a position for us to pick
+    /// a relay there.
+    pub min_country_relays: usize,
+    /// How much slower than the best estimate, as a fraction of it, a path
+    /// may be and still be picked. We pick at random among such paths.
+    pub slack: f64,
+}
+
+impl Default for GeoPathLimits {
+    fn default() -> Self {
+        Self {
+            max_per_country: 2,
+            min_country_relays: 3,
+            slack: 0.25,
+        }
+    }
+}
+
+/// A three-hop path picked by [`choose_path`].
+#[derive(Debug, Clone)]
+pub struct GeoPath {
+    /// Guard, middle and exit.
+    pub hops: Vec<RelaySpec>,
+    /// Their countries, in the same order.
+    pub countries: Vec<String>,
+    /// Estimated round trip from the client through the path to the
+    /// destination, in milliseconds.
+    pub estimated_rtt_ms: f64,
+}
+
+/// A country's code, and its rough middle as (latitude, longitude) if we
+/// know it.
+type Place = (String, Option<(f64, f64)>);
+
+/// Return the rough middle of the country with code `cc`.
+fn centroid(cc: &str) -> Option<(f64, f64)> {
+    CENTROIDS.iter()
+        .find(|(code, _, _)| *code == cc)
+        .map(|(_, lat, lon)| (*lat, *lon))
+}
+
+/// Return the country `place` is in: `place` is either a country code or an
+/// IP address.
+pub fn locate(place: &str) -> AnyResult<Place> {
+    let cc = match IpAddr::from_str(place) {
+        Ok(ip) => GeoipDb::new_embedded()
+            .lookup_country_code(ip)
+            .map(|cc| cc.get().to_string())
+            .ok_or_else(|| anyhow!("No country known for {}", ip))?,
+        Err(_) => CountryCode::from_str(&place.to_uppercase())
+            .map_err(|e| anyhow!("Invalid country code {}: {}", place, e))?
+            .get()
+            .to_string(),
+    };
+    let centroid = centroid(&cc);
+
+    Ok((cc, centroid))
+}
+
+/// Return the code of the country `relay` is in, if we know it.
+fn relay_country(geoip: &GeoipDb, relay: &Relay<'_>) -> Option<String> {
+    geoip.lookup_country_code_multi(relay.addrs().iter().map(|a| a.ip()))
+        .map(|cc| cc.get().to_string())
+}
+
+/// Estimate the round trip, in milliseconds, between places `a` and `b`.
+///
+/// Countries we have no location for are assumed to be a long way away.
+fn estimate_rtt_ms(a: &Place, b: &Place) -> f64 {
+    let ((lat1, lon1), (lat2, lon2)) = match (a.1, b.1) {
+        (Some(a), Some(b)) => (a, b),
+        _ => return LINK_OVERHEAD_MS + 250.0,
+    };
+    let (lat1, lon1, lat2, lon2) =
+        (lat1.to_radians(), lon1.to_radians(), lat2.to_radians(), lon2.to_radians());
+    let h = ((lat2 - lat1) / 2.0).sin().powi(2)
+        + lat1.cos() * lat2.cos() * ((lon2 - lon1) / 2.0).sin().powi(2);
+    let km = 2.0 * EARTH_RADIUS_KM * h.sqrt().asin();
+
+    LINK_OVERHEAD_MS + 2.0 * km * ROUTE_STRETCH / FIBRE_KM_PER_MS
+}
+
+/// Return whether `relay` can go at `position` (0 guard, 1 middle, 2 exit)
+/// of a path whose exit must allow `port`.
+fn suitable(relay: &Relay<'_>, position: usize, port: u16) -> bool {
+    let details = relay.low_level_details();
+    details.is_flagged_fast() && match position {
+        0 => details.is_suitable_as_guard(),
+        1 => true,
+        _ => details.supports_exit_port_ipv4(port),
+    }
+}
+
+/// Return whether `relay` may share a path with the relays in `picked`: it
+/// must not be in the same family or /16 (or /32 for IPv6) as any of them.
+fn compatible(picked: &[Relay<'_>], relay: &Relay<'_>, subnets: &SubnetConfig) -> bool {
+    picked.iter().all(|p| {
+        !p.low_level_details().in_same_family(relay)
+            && !p.low_level_details().in_same_subnet(relay, subnets)
+    })
+}
+
+/// Return an IPv4 address and port for `relay`, and its fingerprint.
+fn relay_spec(relay: &Relay<'_>) -> Option<RelaySpec> {
+    let addr = relay.addrs().iter().find(|a| a.is_ipv4())?;
+
+    Some((addr.ip().to_string(), addr.port(), hex::encode_upper(relay.rsa_id().as_bytes())))
+}
+
+/// Return the relays in `netdir` we could put on a path, by country.
+fn relays_by_country<'a>(netdir: &'a NetDir, geoip: &GeoipDb) -> HashMap<String, Vec<Relay<'a>>> {
+    let mut by_country: HashMap<String, Vec<Relay<'a>>> = HashMap::new();
+    for relay in netdir.relays() {
+        if relay_spec(&relay).is_none() {
+            continue;
+        }
+        if let Some(cc) = relay_country(geoip, &relay) {
+            by_country.entry(cc).or_default().push(relay);
+        }
+    }
+
+    by_country
+}
+
+/// Return every (guard, middle, exit) triple of countries, one from each of
+/// `positions`, that keeps within `limits.max_per_country`, with the
+/// estimated round trip from `client` through it to `dest`. Fastest first.
+fn rank_triples(
+    positions: &[Vec<Place>],
+    client: &Place,
+    dest: Option<&Place>,
+    limits: &GeoPathLimits,
+) -> Vec<([String; 3], f64)> {
+    let mut triples = Vec::new();
+    for g in &positions[0] {
+        for m in &positions[1] {
+            for e in &positions[2] {
+                let most_in_one = if g.0 == m.0 && m.0 == e.0 {
+                    3
+                } else if g.0 == m.0 || m.0 == e.0 || g.0 == e.0 {
+                    2
+                } else {
+                    1
+                };
+                if most_in_one > limits.max_per_country.max(1) {
+                    continue;
+                }
+                let rtt = estimate_rtt_ms(client, g)
+                    + estimate_rtt_ms(g, m)
+                    + estimate_rtt_ms(m, e)
+                    + dest.map_or(0.0, |d| estimate_rtt_ms(e, d));
+                triples.push(([g.0.clone(), m.0.clone(), e.0.clone()], rtt));
+            }
+        }
+    }
+    triples.sort_by(|(_, a), (_, b)| a.total_cmp(b));
+
+    triples
+}
+
+/// Pick a guard, middle and exit from `netdir`, aiming to minimise the
+/// estimated round trip from `client` through the path to `dest`, and to
+/// avoid paths that zig-zag across oceans.
+///
+/// We estimate each link's RTT from the distance between the countries at
+/// either end, choose a (guard, middle, exit) triple of countries within
+/// `limits`, then pick relays in those countries by consensus weight, as tor
+/// would, scaled by each relay's `score`. The usual family and /16 rules
+/// still apply between hops.
+pub fn choose_path(
+    netdir: &NetDir,
+    client: &Place,
+    dest: Option<&Place>,
+    port: u16,
+    limits: &GeoPathLimits,
+    score: impl Fn(&Relay<'_>) -> f64,
+) -> AnyResult<GeoPath> {
+    let geoip = GeoipDb::new_embedded();
+    let mut rng = rand::thread_rng();
+    // Look up each relay's country once, rather than once per candidate.
+    let by_country = relays_by_country(netdir, &geoip);
+
+    // Countries with enough relays for each position.
+    let positions: Vec<Vec<Place>> = (0..3)
+        .map(|position| {
+            by_country.iter()
+                .filter(|(_, relays)| {
+                    relays.iter().filter(|r| suitable(r, position, port)).count()
+                        >= limits.min_country_relays.max(1)
+                })
+                .map(|(cc, _)| (cc.clone(), centroid(cc)))
+                .collect()
+        })
+        .collect();
+
+    let mut triples = rank_triples(&positions, client, dest, limits);
+    let best = triples.first()
+        .map(|(_, rtt)| *rtt)
+        .ok_or_else(|| anyhow!("No countries have enough relays within the limits"))?;
+
+    // Try the triples within the slack in random order, then the rest.
+    let in_slack = triples.iter()
+        .take_while(|(_, rtt)| *rtt <= best * (1.0 + limits.slack.max(0.0)))
+        .count();
+    triples[..in_slack].shuffle(&mut rng);
+
+    let subnets = SubnetConfig::default();
+    let roles = [WeightRole::Guard, WeightRole::Middle, WeightRole::Exit];
+    for (countries, rtt) in triples.iter().take(MAX_TRIPLES_TRIED.max(in_slack)) {
+        let mut picked: Vec<Relay<'_>> = Vec::with_capacity(3);
+        for (position, cc) in countries.iter().enumerate() {
+            let candidates: Vec<&Relay<'_>> = by_country[cc].iter()
+                .filter(|r| suitable(r, position, port) && compatible(&picked, r, &subnets))
+                .collect();
+            let relay = candidates
+                .choose_weighted(&mut rng, |r| {
+                    // The weight as a plain number: its ratio to a weight of 1.
+                    let weight = netdir.relay_weight(r, roles[position])
+                        .checked_div(RelayWeight::from(1))
+                        .unwrap_or(0.0);
+                    weight * score(r)
+                })
+                .ok();
+            match relay {
+                Some(relay) => picked.push((*relay).clone()),
+                None => break,
+            }
+        }
+        if picked.len() < 3 {
+            continue;
+        }
+
+        let hops = picked.iter().filter_map(relay_spec).collect();
+        let countries = countries.to_vec();
+        return Ok(GeoPath { hops, countries, estimated_rtt_ms: *rtt });
+    }
+
+    Err(anyhow!("No path fits the limits"))
+}
+
+/// Rough middle of each country, as (code, latitude, longitude).
+///
+/// This only needs to be good enough to tell a transatlantic link from a
+/// local one; for big countries it is the middle of where people live.
+#[rustfmt::skip]
+const CENTROIDS: &[(&str, f64, f64)] = &[
+    ("AD", 42.5, 1.5), ("AE", 24.0, 54.0), ("AF", 33.0, 65.0), ("AG", 17.1, -61.8),
+    ("AL", 41.0, 20.0), ("AM", 40.0, 45.0), ("AO", -12.5, 18.5), ("AR", -34.0, -64.0),
+    ("AT", 47.3, 13.3), ("AU", -33.0, 147.0), ("AZ", 40.5, 47.5), ("BA", 44.0, 18.0),
+    ("BB", 13.2, -59.5), ("BD", 24.0, 90.0), ("BE", 50.8, 4.0), ("BF", 13.0, -2.0),
+    ("BG", 43.0, 25.0), ("BH", 26.0, 50.6), ("BI", -3.5, 30.0), ("BJ", 9.5, 2.3),
+    ("BN", 4.5, 114.7), ("BO", -17.0, -65.0), ("BR", -19.0, -46.0), ("BS", 24.3, -76.0),
+    ("BT", 27.5, 90.5), ("BW", -22.0, 24.0), ("BY", 53.0, 28.0), ("BZ", 17.3, -88.8),
+    ("CA", 45.5, -75.0), ("CD", -4.0, 22.0), ("CF", 7.0, 21.0), ("CG", -1.0, 15.0),
+    ("CH", 47.0, 8.0), ("CI", 7.5, -5.5), ("CL", -33.5, -70.7), ("CM", 6.0, 12.0),
+    ("CN", 32.0, 114.0), ("CO", 4.6, -74.1), ("CR", 10.0, -84.0), ("CU", 21.5, -80.0),
+    ("CV", 16.0, -24.0), ("CY", 35.0, 33.0), ("CZ", 49.8, 15.5), ("DE", 51.0, 9.0),
+    ("DJ", 11.5, 43.0), ("DK", 56.0, 10.0), ("DM", 15.4, -61.3), ("DO", 19.0, -70.7),
+    ("DZ", 35.0, 3.0), ("EC", -1.5, -78.5), ("EE", 59.0, 26.0), ("EG", 30.0, 31.0),
+    ("ER", 15.0, 39.0), ("ES", 40.0, -4.0), ("ET", 9.0, 39.0), ("FI", 61.0, 25.0),
+    ("FJ", -18.0, 178.0), ("FR", 46.5, 2.5), ("GA", -1.0, 11.8), ("GB", 52.5, -1.5),
+    ("GD", 12.1, -61.7), ("GE", 42.0, 43.5), ("GH", 7.5, -1.5), ("GI", 36.1, -5.4),
+    ("GL", 64.2, -51.7), ("GM", 13.5, -15.5), ("GN", 10.0, -11.0), ("GQ", 2.0, 10.0),
+    ("GR", 39.0, 22.0), ("GT", 15.5, -90.3), ("GW", 12.0, -15.0), ("GY", 5.0, -59.0),
+    ("HK", 22.3, 114.2), ("HN", 15.0, -86.5), ("HR", 45.2, 15.5), ("HT", 19.0, -72.4),
+    ("HU", 47.0, 20.0), ("ID", -6.2, 106.8), ("IE", 53.0, -8.0), ("IL", 31.5, 34.8),
+    ("IM", 54.2, -4.5), ("IN", 22.0, 79.0), ("IQ", 33.0, 44.0), ("IR", 32.0, 53.0),
+    ("IS", 64.5, -19.0), ("IT", 42.8, 12.8), ("JE", 49.2, -2.1), ("JM", 18.2, -77.3),
+    ("JO", 31.0, 36.0), ("JP", 36.0, 138.0), ("KE", -1.0, 37.5), ("KG", 41.0, 75.0),
+    ("KH", 12.5, 105.0), ("KR", 37.0, 127.5), ("KW", 29.3, 47.7), ("KZ", 48.0, 68.0),
+    ("LA", 18.0, 105.0), ("LB", 33.8, 35.8), ("LC", 13.9, -61.0), ("LI", 47.2, 9.5),
+    ("LK", 7.0, 81.0), ("LR", 6.5, -9.5), ("LS", -29.5, 28.5), ("LT", 55.0, 24.0),
+    ("LU", 49.8, 6.1), ("LV", 57.0, 25.0), ("LY", 32.0, 17.0), ("MA", 32.0, -6.0),
+    ("MC", 43.7, 7.4), ("MD", 47.0, 29.0), ("ME", 42.5, 19.3), ("MG", -20.0, 47.0),
+    ("MK", 41.8, 22.0), ("ML", 14.0, -5.0), ("MM", 20.0, 96.0), ("MN", 47.0, 105.0),
+    ("MO", 22.2, 113.5), ("MR", 18.0, -12.0), ("MT", 35.9, 14.4), ("MU", -20.3, 57.6),
+    ("MV", 3.2, 73.2), ("MW", -13.5, 34.0), ("MX", 21.0, -100.0), ("MY", 3.5, 102.0),
+    ("MZ", -18.3, 35.0), ("NA", -22.0, 17.0), ("NC", -21.5, 165.5), ("NE", 16.0, 8.0),
+    ("NG", 9.0, 8.0), ("NI", 13.0, -85.0), ("NL", 52.3, 5.5), ("NO", 61.0, 9.0),
+    ("NP", 28.0, 84.0), ("NZ", -39.0, 175.0), ("OM", 21.0, 57.0), ("PA", 9.0, -80.0),
+    ("PE", -10.0, -76.0), ("PG", -6.0, 147.0), ("PH", 13.0, 122.0), ("PK", 30.0, 70.0),
+    ("PL", 52.0, 19.5), ("PR", 18.2, -66.5), ("PS", 32.0, 35.2), ("PT", 39.5, -8.0),
+    ("PY", -23.0, -58.0), ("QA", 25.5, 51.2), ("RE", -21.1, 55.5), ("RO", 46.0, 25.0),
+    ("RS", 44.0, 21.0), ("RU", 55.8, 40.0), ("RW", -2.0, 30.0), ("SA", 24.0, 45.0),
+    ("SC", -4.6, 55.5), ("SD", 15.0, 30.0), ("SE", 60.0, 16.0), ("SG", 1.4, 103.8),
+    ("SI", 46.1, 14.8), ("SK", 48.7, 19.5), ("SL", 8.5, -11.5), ("SM", 43.9, 12.4),
+    ("SN", 14.0, -14.0), ("SO", 5.0, 46.0), ("SR", 4.0, -56.0), ("SS", 7.0, 30.0),
+    ("SV", 13.8, -88.9), ("SY", 35.0, 38.0), ("SZ", -26.5, 31.5), ("TD", 15.0, 19.0),
+    ("TG", 8.0, 1.2), ("TH", 15.0, 101.0), ("TJ", 39.0, 71.0), ("TL", -8.8, 125.7),
+    ("TM", 40.0, 60.0), ("TN", 34.0, 9.0), ("TR", 39.0, 35.0), ("TT", 10.7, -61.2),
+    ("TW", 24.0, 121.0), ("TZ", -6.0, 35.0), ("UA", 49.0, 32.0), ("UG", 1.0, 32.0),
+    ("US", 38.0, -90.0), ("UY", -33.0, -56.0), ("UZ", 41.0, 64.0), ("VC", 13.2, -61.2),
+    ("VE", 8.0, -66.0), ("VG", 18.4, -64.6), ("VN", 16.0, 106.0), ("VU", -16.0, 167.0),
+    ("WS", -13.6, -172.3), ("XK", 42.6, 21.0), ("YE", 15.5, 47.5), ("ZA", -28.0, 25.0),
+    ("ZM", -15.0, 28.0), ("ZW", -19.0, 30.0),
+];
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use tor_llcrypto::pk::ed25519::Ed25519Identity;
+
+    fn place(cc: &str) -> Place {
+        (cc.to_string(), centroid(cc))
+    }
+
+    #[test]
+    fn rtt_estimate() {
+        // (a, b, expected ms, tolerance)
+        let cases = [
+            ("DE", "DE", LINK_OVERHEAD_MS, 1e-9),
+            // About 690 km apart.
+            ("DE", "FR", 15.4, 0.5),
+            // About 7,400 km apart.
+            ("DE", "US", 115.7, 1.0),
+            // Nearly opposite sides of the earth.
+            ("ES", "NZ", 303.1, 2.0),
+            // No centroid for either end.
+            ("ZZ", "DE", LINK_OVERHEAD_MS + 250.0, 1e-9),
+        ];
+        for (a, b, expected, tolerance) in cases {
+            let (a, b) = (place(a), place(b));
+            let rtt = estimate_rtt_ms(&a, &b);
+            assert!((rtt - expected).abs() <= tolerance, "{} to {}: {}", a.0, b.0, rtt);
+            assert_eq!(rtt, estimate_rtt_ms(&b, &a));
+        }
+    }
+
+    #[test]
+    fn triple_choice() {
+        let positions = vec![
+            vec![place("DE"), place("US")],
+            vec![place("DE"), place("FR"), place("US")],
+            vec![place("DE"), place("US")],
+        ];
+        // (client, dest, max per country, expected best triple)
+        let cases = [
+            ("DE", None, 3, ["DE", "DE", "DE"]),
+            ("DE", None, 2, ["DE", "FR", "DE"]),
+            ("DE", None, 1, ["DE", "FR", "US"]),
+            ("US", None, 1, ["US", "FR", "DE"]),
+            ("DE", Some("US"), 1, ["DE", "FR", "US"]),
+            ("US", Some("US"), 2, ["US", "FR", "US"]),
+        ];
+        for (client, dest, max_per_country, expected) in cases {
+            let limits = GeoPathLimits { max_per_country, ..Default::default() };
+            let dest = dest.map(place);
+            let triples = rank_triples(&positions, &place(client), dest.as_ref(), &limits);
+            assert_eq!(triples[0].0, expected, "{} to {:?}, max {}", client, dest, max_per_country);
+            assert!(triples.windows(2).all(|w| w[0].1 <= w[1].1));
+            assert!(triples.iter().all(|(countries, _)| {
+                countries.iter().all(|cc| countries.iter().filter(|c| *c == cc).count() <= max_per_country)
+            }));
+        }
+    }
+
+    #[test]
+    fn family_and_subnet_exclusion() {
+        // In the test network, relays 2n and 2n+1 are a family, and relay i
+        // has the address (i % 5).0.0.3.
+        let netdir = tor_netdir::testnet::construct_netdir()
+            .unwrap_if_sufficient()
+            .unwrap();
+        let relay = |idx: u8| netdir.by_id(&Ed25519Identity::from([idx; 32])).unwrap();
+        let subnets = SubnetConfig::default();
+
+        // (picked, candidate, compatible)
+        let cases: &[(&[u8], u8, bool)] = &[
+            (&[], 0, true),
+            (&[0], 2, true),
+            // Same family.
+            (&[0], 1, false),
+            (&[2], 3, false),
+            // Same /16.
+            (&[0], 5, false),
+            (&[3], 8, false),
+            // Fine with the first hop, not with the second.
+            (&[2, 11], 1, false),
+            (&[2, 11], 4, true),
+        ];
+        for (picked, candidate, expected) in cases {
+            let picked: Vec<_> = picked.iter().map(|idx| relay(*idx)).collect();
+            assert_eq!(
+                compatible(&picked, &relay(*candidate), &subnets),
+                *expected,
+                "{:?} then {}", picked.iter().map(|r| r.rsa_id().to_string()).collect::<Vec<_>>(), candidate,
+            );
+        }
+    }
+}
@@ -1,4 +1,7 @@
+use crate::tor_events::{EventBus, WatchedStream};
 use crate::tor_hs_connector::{TorHSConnector, OnionCertificateVerifier};
+use crate::tor_idle::IdleMonitor;
+use crate::tor_ratelimit::{LimitedStream, Limiter};
 
 use log::info;
 use std::sync::Arc;
@@ -6,12 +9,18 @@ use std::time::Duration;
 use std::convert::TryFrom;
 use std::collections::HashMap;
 use anyhow::{anyhow, Result as AnyResult};
+use futures::task::Spawn;
 use rustls::{ClientConfig, ServerName};
 use tokio_rustls::TlsConnector;
 use tokio::io::{AsyncReadExt, AsyncWriteExt};
 
 pub struct TorHSClient {
     hs_client: TorHSConnector,
+    /// Puts the Tor client to sleep when we've been idle for a while.
+    idle: Arc<IdleMonitor>,
+    /// Rate limits for this client, under the process-wide ones.
+    limiter: Arc<Limiter>,
+    events: Arc<EventBus>,
 }
 
 impl TorHSClient {
@@ -19,12 +28,38 @@ impl TorHSClient {
         let hs_client = TorHSConnector::new()?;
 
         Ok(Self {
-            hs_client
+            hs_client,
+            idle: IdleMonitor::new(),
+            limiter: Limiter::process().child(),
+            events: EventBus::new(),
         })
     }
 
     pub async fn init(&mut self, storage: Option<&HashMap<String, String>>) -> AnyResult<()> {
-        self.hs_client.init(storage).await
+        self.hs_client.init(storage, &self.events).await?;
+        self.idle.on_dormancy_change(self.hs_client.dormancy_hook()?);
+
+        Ok(())
+    }
+
+    /// Go dormant after `quiet_period` without connections, or never if
+    /// `None`; see [`IdleMonitor`]. The next connection wakes us first.
+    pub fn set_idle_timeout<S: Spawn>(&self, quiet_period: Option<Duration>, spawner: &S) -> AnyResult<()> {
+        self.idle.set_quiet_period(quiet_period, spawner)
+    }
+
+    pub fn is_dormant(&self) -> bool {
+        self.idle.is_dormant()
+    }
+
+    /// Return the rate limits for this client.
+    pub fn limiter(&self) -> &Arc<Limiter> {
+        &self.limiter
+    }
+
+    /// Return the events this client reports.
+    pub fn events(&self) -> &Arc<EventBus> {
+        &self.events
     }
 
     #[allow(dead_code)]
@@ -43,12 +78,41 @@ impl TorHSClient {
         Ok(())
     }
 
-    pub async fn connect_to_hs(&self, hs_addr: &str, hs_port: u16) -> AnyResult<String> {
-        // Create a new stream to the hidden service
-        let tcp_stream = match self.hs_client.connect_to_hs(hs_addr, hs_port).await {
+    /// See [`TorHSConnector::set_pow_threads`].
+    pub fn set_pow_threads(&self, threads: usize) {
+        self.hs_client.set_pow_threads(threads);
+    }
+
+    /// See [`TorHSConnector::set_hsdir_hedging`].
+    pub fn set_hsdir_hedging(&self, parallel: usize) {
+        self.hs_client.set_hsdir_hedging(parallel);
+    }
+
+    /// See [`TorHSConnector::precompute_keys`].
+    pub fn precompute_keys(&self, hs_addrs: &[String]) -> AnyResult<usize> {
+        self.hs_client.precompute_keys(hs_addrs)
+    }
+
+    /// See [`TorHSConnector::prefetch`]. Wakes the client if it was dormant.
+    pub fn prefetch(&self, hs_addrs: &[String]) -> AnyResult<()> {
+        if !hs_addrs.is_empty() {
+            self.idle.touch();
+        }
+        self.hs_client.prefetch(hs_addrs)
+    }
+
+    pub async fn connect_to_hs(&self, hs_addr: &str, hs_port: u16, optimistic: bool) -> AnyResult<String> {
+        let busy = self.idle.busy();
+        // Create a new stream to the hidden service. If it's optimistic, a
+        // refused BEGIN only shows up once we read the response.
+        let tcp_stream = match self.hs_client.connect_to_hs(hs_addr, hs_port, optimistic).await {
             Ok(stream) => stream,
             Err(e) => return Err(anyhow!("Failed to begin stream: {}", e)),
         };
+        // We don't see the rendezvous circuit, so give each connection its
+        // own circuit-level limiter.
+        let tcp_stream = LimitedStream::new(tcp_stream, self.limiter.child().child()).hold(busy);
+        let tcp_stream = WatchedStream::new(tcp_stream, self.events.clone(), &format!("{}:{}", hs_addr, hs_port));
 
         if hs_port == 443 {
             // For HTTPS, we need a TLS connection
@@ -1,25 +1,56 @@
 use anyhow::Result as AnyResult;
-use log::info;
+use futures::task::SpawnExt;
+use futures::StreamExt;
+use log::{info, warn};
 use rustls::ServerName;
+use std::sync::atomic::{AtomicBool, Ordering};
+use std::time::Duration;
 use std::{collections::HashMap, sync::Arc};
+use tokio::sync::watch;
 
 use arti_client::config::TorClientConfigBuilder;
-use arti_client::{DataStream, StreamPrefs, TorClient, TorClientConfig};
+use arti_client::{DataStream, DormantMode, StreamPrefs, TorClient, TorClientConfig};
 use tor_circmgr::path::CustomHSRelaySetting;
+use tor_hsclient::{HsDescFetchHedging, HsKeyCache, PowSolverThreads};
+use tor_hscrypto::pk::HsId;
 use tor_linkspec::HasAddrs;
 use tor_llcrypto::pk::rsa::RsaIdentity;
-use tor_rtcompat::PreferredRuntime;
+use tor_netdir::DirEvent;
+use tor_rtcompat::{PreferredRuntime, SleepProvider};
+
+use crate::tor_events::{self, EventBus, TorEvent};
+
+/// How many onion services `prefetch` works on at once.
+const PREFETCH_CONCURRENCY: usize = 32;
+
+/// How often `prefetch` renews its circuits. Arti closes onion service
+/// circuits that have gone unused for ten minutes.
+const PREFETCH_REFRESH: Duration = Duration::from_secs(5 * 60);
 
 pub struct TorHSConnector {
     arti_client: Option<Arc<TorClient<PreferredRuntime>>>,
+    /// Bumped by each `prefetch` call, to stop the previous one's refreshes.
+    prefetch_generation: watch::Sender<u64>,
+    /// Whether the client is dormant, as last set through `dormancy_hook`.
+    dormant: Arc<AtomicBool>,
 }
 
 impl TorHSConnector {
     pub fn new() -> AnyResult<Self> {
-        Ok(Self { arti_client: None })
+        Ok(Self {
+            arti_client: None,
+            prefetch_generation: watch::Sender::new(0),
+            dormant: Arc::new(AtomicBool::new(false)),
+        })
     }
 
-    pub async fn init(&mut self, storage: Option<&HashMap<String, String>>) -> AnyResult<()> {
+    /// Set up and bootstrap the client, reporting its progress and later
+    /// directory updates to `events`.
+    pub async fn init(
+        &mut self,
+        storage: Option<&HashMap<String, String>>,
+        events: &Arc<EventBus>,
+    ) -> AnyResult<()> {
         let config = if let Some(storage_map) = storage {
             let state_dir = storage_map.get("state_dir").unwrap();
             let cache_dir = storage_map.get("cache_dir").unwrap();
@@ -37,12 +68,26 @@ impl TorHSConnector {
             .config(config)
             .create_unbootstrapped()?
         );
-        
+        report_events(&arti_client, events);
+
         info!("load directory from cache");
         arti_client.load_cache().await?;
         if !arti_client.dirmgr().timely_netdir().is_ok() {
             info!("bootstrap manually");
             arti_client.bootstrap().await?;
+        } else {
+            // Bootstrapping also starts the directory refreshes, which fetch
+            // diffs against the cached consensus. Start them now rather than
+            // on our first connection, when the cache may be out of date.
+            let client = arti_client.clone();
+            let res = arti_client.runtime().spawn(async move {
+                if let Err(e) = client.bootstrap().await {
+                    warn!("Failed to start directory refreshes: {}", e);
+                }
+            });
+            if let Err(e) = res {
+                warn!("Failed to spawn directory refreshes: {}", e);
+            }
         }
 
         self.arti_client = Some(arti_client);
@@ -50,13 +95,124 @@ impl TorHSConnector {
         Ok(())
     }
 
+    /// Return a function that suspends the client's background tasks
+    /// (directory refresh, channel padding and expiry, and prefetching) when
+    /// passed `true`, and resumes them when passed `false`.
+    pub fn dormancy_hook(&self) -> AnyResult<impl Fn(bool) + Send + Sync + 'static> {
+        let arti_client = self
+            .arti_client
+            .clone()
+            .ok_or_else(|| anyhow::anyhow!("Arti client not initialized"))?;
+        let is_dormant = self.dormant.clone();
+
+        Ok(move |dormant| {
+            is_dormant.store(dormant, Ordering::Relaxed);
+            arti_client.set_dormant(if dormant { DormantMode::Soft } else { DormantMode::Normal });
+        })
+    }
+
     pub fn set_custom_hs_relay_ids(&self, rsa_ids: Vec<String>) {
         CustomHSRelaySetting::set(rsa_ids);
     }
 
-    pub async fn connect_to_hs(&self, hs_addr: &str, hs_port: u16) -> AnyResult<DataStream> {
+    /// Solve onion service proof of work puzzles on `threads` threads, or on
+    /// one per core if 0. This applies to every client in the process.
+    pub fn set_pow_threads(&self, threads: usize) {
+        PowSolverThreads::set(threads);
+    }
+
+    /// Ask up to `parallel` HSDirs at once for each onion service descriptor,
+    /// querying another whenever the outstanding ones are slower than usual.
+    /// 1 asks one at a time. This applies to every client in the process.
+    pub fn set_hsdir_hedging(&self, parallel: usize) {
+        HsDescFetchHedging::set(parallel);
+    }
+
+    /// Derive the blinded keys and responsible HSDirs of `hs_addrs` for the
+    /// current time period in bulk, on one thread per core, so that later
+    /// connections to them skip that work. Returns how many were cached.
+    pub fn precompute_keys(&self, hs_addrs: &[String]) -> AnyResult<usize> {
+        let arti_client = self
+            .arti_client
+            .as_ref()
+            .ok_or_else(|| anyhow::anyhow!("Arti client not initialized"))?;
+
+        let hsids = parse_hs_addrs(hs_addrs)?;
+        let netdir = arti_client.dirmgr().timely_netdir()?;
+
+        Ok(HsKeyCache::precompute(&netdir, &hsids))
+    }
+
+    /// Make `hs_addrs` the onion services to keep ready for connections,
+    /// replacing any earlier list; an empty list stops prefetching.
+    ///
+    /// In the background, fetches each service's descriptor and completes
+    /// the introduction and rendezvous handshakes, PREFETCH_CONCURRENCY
+    /// services at a time. Arti keeps the resulting rendezvous circuits,
+    /// and `connect_to_hs` begins its stream on them directly. They are
+    /// refreshed every PREFETCH_REFRESH, before Arti would expire them.
+    ///
+    /// Refreshing doesn't count as activity: while the client is dormant we
+    /// skip it, and let the circuits expire.
+    pub fn prefetch(&self, hs_addrs: &[String]) -> AnyResult<()> {
+        let arti_client = self
+            .arti_client
+            .clone()
+            .ok_or_else(|| anyhow::anyhow!("Arti client not initialized"))?;
+
+        let hsids = parse_hs_addrs(hs_addrs)?;
+        self.prefetch_generation.send_modify(|generation| *generation += 1);
+        let mut stopped = self.prefetch_generation.subscribe();
+        let generation = *stopped.borrow();
+        if hsids.is_empty() {
+            return Ok(());
+        }
+        if let Ok(netdir) = arti_client.dirmgr().timely_netdir() {
+            HsKeyCache::precompute(&netdir, &hsids);
+        }
+
+        let dormant = self.dormant.clone();
+        let runtime = arti_client.runtime().clone();
+        runtime.spawn(async move {
+            let mut prefs = StreamPrefs::new();
+            prefs.connect_to_onion_services(arti_client::config::BoolOrAuto::Explicit(true));
+
+            let rounds = async {
+                loop {
+                    if !dormant.load(Ordering::Relaxed) {
+                        futures::stream::iter(&hsids)
+                            .for_each_concurrent(PREFETCH_CONCURRENCY, |hsid| {
+                                let arti_client = &arti_client;
+                                let prefs = &prefs;
+                                async move {
+                                    if let Err(e) = arti_client.prefetch_onion_service(*hsid, prefs).await {
+                                        warn!("Failed to prefetch {}: {}", hsid, e);
+                                    }
+                                }
+                            })
+                            .await;
+                        info!("Prefetched {} onion services", hsids.len());
+                    }
+                    arti_client.runtime().sleep(PREFETCH_REFRESH).await;
+                }
+            };
+            // Stop as soon as a later call replaces our list or the connector
+            // is gone, even mid-round.
+            tokio::select! {
+                _ = rounds => {}
+                _ = stopped.wait_for(|current| *current != generation) => {}
+            }
+        })?;
+
+        Ok(())
+    }
+
+    pub async fn connect_to_hs(&self, hs_addr: &str, hs_port: u16, optimistic: bool) -> AnyResult<DataStream> {
         let mut s_prefs = StreamPrefs::new();
         s_prefs.connect_to_onion_services(arti_client::config::BoolOrAuto::Explicit(true));
+        if optimistic {
+            s_prefs.optimistic();
+        }
 
         let hs_addr = hs_addr.to_string();
         let arti_client = self
@@ -105,6 +261,52 @@ impl TorHSConnector {
     }
 }
 
+/// Parse onion addresses like "xxx.onion" into service identities.
+fn parse_hs_addrs(hs_addrs: &[String]) -> AnyResult<Vec<HsId>> {
+    hs_addrs
+        .iter()
+        .map(|addr| {
+            addr.parse::<HsId>()
+                .map_err(|e| anyhow::anyhow!("Invalid onion address {}: {}", addr, e))
+        })
+        .collect()
+}
+
+/// Forward `arti_client`'s bootstrap progress and directory updates to
+/// `events`, for as long as the client lives.
+fn report_events(arti_client: &TorClient<PreferredRuntime>, events: &Arc<EventBus>) {
+    let mut progress = arti_client.bootstrap_events();
+    let bootstrap_events = events.clone();
+    let res = arti_client.runtime().spawn(async move {
+        while let Some(status) = progress.next().await {
+            bootstrap_events.emit(TorEvent::new("bootstrap_progress")
+                .with("fraction", f64::from(status.as_frac()))
+                .with("status", status.to_string()));
+        }
+    });
+    if let Err(e) = res {
+        warn!("Failed to spawn bootstrap progress reporter: {}", e);
+    }
+
+    let dirmgr = arti_client.dirmgr().clone();
+    let mut updates = dirmgr.events();
+    let events = events.clone();
+    let res = arti_client.runtime().spawn(async move {
+        while let Some(update) = updates.next().await {
+            // New descriptors come in often, and don't change the relay list.
+            if update != DirEvent::NewConsensus {
+                continue;
+            }
+            if let Ok(netdir) = dirmgr.timely_netdir() {
+                events.emit(tor_events::netdir_updated(&netdir));
+            }
+        }
+    });
+    if let Err(e) = res {
+        warn!("Failed to spawn directory update reporter: {}", e);
+    }
+}
+
 pub struct OnionCertificateVerifier {}
 
 impl rustls::client::ServerCertVerifier for OnionCertificateVerifier {
@@ -0,0 +1,327 @@
+use log::info;
+use std::sync::{Arc, Mutex};
+use std::time::{Duration, Instant};
+use anyhow::{anyhow, Result as AnyResult};
+use futures::task::{Spawn, SpawnExt};
+use futures::Future;
+use tokio::sync::Notify;
+
+/// While dormant, or with no quiet period set, how often the monitor task
+/// checks whether its client is gone.
+const DORMANT_RECHECK: Duration = Duration::from_secs(600);
+
+/// Something to tell when a client goes dormant (`true`) or wakes (`false`).
+type DormancyHook = Box<dyn Fn(bool) + Send + Sync>;
+
+struct IdleState {
+    quiet_period: Option<Duration>,
+    last_active: Instant,
+    /// Operations in progress, which keep us awake however long they take.
+    busy: usize,
+    dormant: bool,
+    monitor_running: bool,
+}
+
+/// Puts a client's background machinery to sleep once it has been idle for
+/// a while, and wakes it as soon as it's used again.
+///
+/// Callers mark activity with [`IdleMonitor::touch`] or hold a
+/// [`BusyGuard`] for the length of an operation. A monitor task notices
+/// when nothing has happened for the quiet period and runs the dormancy
+/// hooks; the next activity runs them again to wake up, before the
+/// activity goes ahead.
+///
+/// Going dormant and waking each happen whole, under `transition`, so the
+/// hooks always see the two alternate, in order, however activity and the
+/// monitor task race.
+pub struct IdleMonitor {
+    state: Mutex<IdleState>,
+    /// Held across each change of `state.dormant` and the hooks it runs.
+    transition: Mutex<()>,
+    /// Wakes the monitor task early: on waking up, or on a new quiet period.
+    notify: Arc<Notify>,
+    hooks: Mutex<Vec<DormancyHook>>,
+}
+
+impl IdleMonitor {
+    pub fn new() -> Arc<Self> {
+        Arc::new(Self {
+            state: Mutex::new(IdleState {
+                quiet_period: None,
+                last_active: Instant::now(),
+                busy: 0,
+                dormant: false,
+                monitor_running: false,
+            }),
+            transition: Mutex::new(()),
+            notify: Arc::new(Notify::new()),
+            hooks: Mutex::new(Vec::new()),
+        })
+    }
+
+    /// Call `hook` now with whether we're dormant, then with `true` whenever
+    /// we go dormant, and `false` whenever we wake.
+    ///
+    /// The hook runs with the monitor mid-transition, so it must not use the
+    /// monitor itself.
+    pub fn on_dormancy_change(&self, hook: impl Fn(bool) + Send + Sync + 'static) {
+        let _transition = self.transition.lock().expect("poisoned lock");
+        hook(self.is_dormant());
+        self.hooks.lock().expect("poisoned lock").push(Box::new(hook));
+    }
+
+    /// Tell each hook that we are going dormant (or waking, if `dormant` is
+    /// false). The caller holds `transition`.
+    ///
+    /// `state.dormant` stays true throughout either transition; if it
+    /// somehow isn't, the transition is stale and we stop.
+    fn run_hooks(&self, dormant: bool) {
+        for hook in self.hooks.lock().expect("poisoned lock").iter() {
+            if !self.is_dormant() {
+                return;
+            }
+            hook(dormant);
+        }
+    }
+
+    /// Go dormant after `quiet_period` without activity, or never if `None`.
+    ///
+    /// The first call starts the monitor task on `spawner`.
+    pub fn set_quiet_period<S: Spawn>(
+        self: &Arc<Self>,
+        quiet_period: Option<Duration>,
+        spawner: &S,
+    ) -> AnyResult<()> {
+        let start = {
+            let mut state = self.state.lock().expect("poisoned lock");
+            state.quiet_period = quiet_period;
+            !std::mem::replace(&mut state.monitor_running, true)
+        };
+        if start {
+            // Hold the monitor weakly, so the task ends once the client is gone.
+            let monitor = Arc::downgrade(self);
+            let spawned = spawner.spawn(async move {
+                // Only hold the monitor while checking, not while waiting.
+                while let Some(wait) = monitor.upgrade().map(|monitor| monitor.check()) {
+                    wait.await;
+                }
+            });
+            if let Err(e) = spawned {
+                self.state.lock().expect("poisoned lock").monitor_running = false;
+                return Err(anyhow!("Failed to spawn idle monitor: {}", e));
+            }
+        }
+        self.notify.notify_one();
+
+        Ok(())
+    }
+
+    /// Go dormant if we've been idle long enough, and return a future that
+    /// waits until there's something to check again.
+    ///
+    /// The future doesn't hold the monitor, so the client can go away while
+    /// it waits.
+    fn check(self: &Arc<Self>) -> impl Future<Output = ()> + Send + 'static {
+        let transition = self.transition.lock().expect("poisoned lock");
+        let (go_dormant, wait) = {
+            let mut state = self.state.lock().expect("poisoned lock");
+            match state.quiet_period {
+                Some(quiet) if !state.dormant && state.busy == 0 => {
+                    let idle = state.last_active.elapsed();
+                    if idle >= quiet {
+                        state.dormant = true;
+                        (true, DORMANT_RECHECK)
+                    } else {
+                        (false, quiet - idle)
+                    }
+                }
+                // Busy: whoever is busy touches us when done, and we'll
+                // look again after another quiet period.
+                Some(quiet) if !state.dormant => (false, quiet),
+                _ => (false, DORMANT_RECHECK),
+            }
+        };
+        if go_dormant {
+            info!("Idle; going dormant");
+            self.run_hooks(true);
+        }
+        drop(transition);
+
+        let notify = self.notify.clone();
+        async move {
+            let _ = tokio::time::timeout(wait, notify.notified()).await;
+        }
+    }
+
+    /// Note activity now, waking up first if we were dormant.
+    ///
+    /// If we're going dormant or waking, this waits for that to finish.
+    pub fn touch(&self) {
+        {
+            let mut state = self.state.lock().expect("poisoned lock");
+            state.last_active = Instant::now();
+            if !state.dormant {
+                return;
+            }
+        }
+
+        let _transition = self.transition.lock().expect("poisoned lock");
+        // Someone else may have woken us while we waited.
+        if !self.is_dormant() {
+            return;
+        }
+        info!("Activity; waking up");
+        self.run_hooks(false);
+        {
+            let mut state = self.state.lock().expect("poisoned lock");
+            state.last_active = Instant::now();
+            state.dormant = false;
+        }
+        self.notify.notify_one();
+    }
+
+    /// Note activity that lasts until the returned guard is dropped.
+    pub fn busy(self: &Arc<Self>) -> BusyGuard {
+        // Count ourselves busy first, so we can't go dormant once awake.
+        self.state.lock().expect("poisoned lock").busy += 1;
+        let guard = BusyGuard { monitor: self.clone() };
+        self.touch();
+        guard
+    }
+
+    pub fn is_dormant(&self) -> bool {
+        self.state.lock().expect("poisoned lock").dormant
+    }
+}
+
+impl Drop for IdleMonitor {
+    fn drop(&mut self) {
+        // Let the monitor task notice we're gone, rather than sleeping on.
+        self.notify.notify_one();
+    }
+}
+
+/// Keeps an [`IdleMonitor`] awake while held.
+pub struct BusyGuard {
+    monitor: Arc<IdleMonitor>,
+}
+
+impl Drop for BusyGuard {
+    fn drop(&mut self) {
+        let mut state = self.monitor.state.lock().expect("poisoned lock");
+        state.busy -= 1;
+        state.last_active = Instant::now();
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use std::sync::atomic::{AtomicBool, Ordering};
+    use futures::future::FutureObj;
+    use futures::task::SpawnError;
+    use tor_rtcompat::PreferredRuntime;
+
+    const QUIET: Duration = Duration::from_millis(50);
+
+    /// Spawns on a runtime, and notes when the (one) task it spawned ends.
+    struct TrackedSpawner {
+        runtime: PreferredRuntime,
+        done: Arc<AtomicBool>,
+    }
+
+    impl TrackedSpawner {
+        fn new() -> Self {
+            Self {
+                runtime: PreferredRuntime::create().unwrap(),
+                done: Arc::new(AtomicBool::new(false)),
+            }
+        }
+    }
+
+    impl Spawn for TrackedSpawner {
+        fn spawn_obj(&self, future: FutureObj<'static, ()>) -> Result<(), SpawnError> {
+            let done = self.done.clone();
+            self.runtime.spawn(async move {
+                future.await;
+                done.store(true, Ordering::SeqCst);
+            })
+        }
+    }
+
+    /// Return a monitor, and the log of what its hook was told.
+    fn monitor() -> (Arc<IdleMonitor>, Arc<Mutex<Vec<bool>>>) {
+        let monitor = IdleMonitor::new();
+        let calls = Arc::new(Mutex::new(Vec::new()));
+        let log = calls.clone();
+        monitor.on_dormancy_change(move |dormant| log.lock().unwrap().push(dormant));
+        (monitor, calls)
+    }
+
+    /// Wait up to `limit` for `cond` to hold.
+    fn eventually(limit: Duration, cond: impl Fn() -> bool) -> bool {
+        let deadline = Instant::now() + limit;
+        while Instant::now() < deadline {
+            if cond() {
+                return true;
+            }
+            std::thread::sleep(Duration::from_millis(10));
+        }
+        cond()
+    }
+
+    #[test]
+    fn dormant_after_quiet_period() {
+        let spawner = TrackedSpawner::new();
+        let (monitor, calls) = monitor();
+        monitor.set_quiet_period(Some(QUIET), &spawner).unwrap();
+
+        assert!(eventually(QUIET * 20, || monitor.is_dormant()));
+        assert_eq!(*calls.lock().unwrap(), [false, true]);
+    }
+
+    #[test]
+    fn touch_wakes() {
+        let spawner = TrackedSpawner::new();
+        let (monitor, calls) = monitor();
+        monitor.set_quiet_period(Some(QUIET), &spawner).unwrap();
+        assert!(eventually(QUIET * 20, || monitor.is_dormant()));
+
+        // We're awake, hooks and all, by the time touch returns.
+        monitor.touch();
+        assert!(!monitor.is_dormant());
+        assert_eq!(*calls.lock().unwrap(), [false, true, false]);
+
+        // And we go dormant again after another quiet period.
+        assert!(eventually(QUIET * 20, || monitor.is_dormant()));
+        assert_eq!(*calls.lock().unwrap(), [false, true, false, true]);
+    }
+
+    #[test]
+    fn busy_blocks_dormancy() {
+        let spawner = TrackedSpawner::new();
+        let (monitor, calls) = monitor();
+        let guard = monitor.busy();
+        monitor.set_quiet_period(Some(QUIET), &spawner).unwrap();
+
+        std::thread::sleep(QUIET * 4);
+        assert!(!monitor.is_dormant());
+        assert_eq!(*calls.lock().unwrap(), [false]);
+
+        drop(guard);
+        assert!(eventually(QUIET * 20, || monitor.is_dormant()));
+    }
+
+    #[test]
+    fn task_ends_with_monitor() {
+        let spawner = TrackedSpawner::new();
+        let (monitor, _calls) = monitor();
+        // Without a quiet period, the task would sleep for DORMANT_RECHECK.
+        monitor.set_quiet_period(None, &spawner).unwrap();
+        std::thread::sleep(QUIET);
+        assert!(!spawner.done.load(Ordering::SeqCst));
+
+        drop(monitor);
+        assert!(eventually(Duration::from_secs(1), || spawner.done.load(Ordering::SeqCst)));
+    }
+}
@@ -0,0 +1,332 @@
+use log::info;
+use std::io;
+use std::pin::Pin;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::{Arc, Mutex};
+use std::task::{Context, Poll};
+use std::time::{Duration, Instant};
+use anyhow::{anyhow, Result as AnyResult};
+use futures::future::BoxFuture;
+use futures::{AsyncRead, AsyncWrite, FutureExt};
+
+use tor_proto::circuit::ClientCirc;
+use tor_proto::stream::{DataStream, StreamParameters};
+
+/// Weight given to each new measurement in a leg's RTT average.
+const RTT_EWMA_ALPHA: f64 = 0.3;
+
+/// How long a leg has to answer a BEGIN before we try the next one.
+const BEGIN_TIMEOUT: Duration = Duration::from_secs(10);
+
+/// What choosing a leg goes by.
+#[derive(Debug, Clone, Copy)]
+struct LegLoad {
+    rtt: Option<Duration>,
+    streams: usize,
+    /// Whether the leg is open, and not already tried for this stream.
+    usable: bool,
+}
+
+/// Return the index of the best usable leg in `legs`, going round-robin
+/// from `next` among equally good ones.
+///
+/// Unmeasured legs with nothing on them come first, so every leg gets
+/// measured. The rest go by RTT × (streams + 1), costing unmeasured legs
+/// as the slowest measured one; if none is measured, RTT drops out and we
+/// go by load alone.
+fn best_leg(legs: &[LegLoad], next: usize) -> Option<usize> {
+    let fallback = legs.iter()
+        .filter_map(|leg| leg.rtt)
+        .max()
+        .unwrap_or(Duration::from_nanos(1));
+    let n = legs.len();
+
+    legs.iter()
+        .enumerate()
+        .filter(|(_, leg)| leg.usable)
+        .min_by_key(|(i, leg)| {
+            let cost = leg.rtt.unwrap_or(fallback).as_nanos() * (leg.streams as u128 + 1);
+            (leg.rtt.is_some() || leg.streams > 0, cost, (i + n - next % n) % n)
+        })
+        .map(|(i, _)| i)
+}
+
+/// One circuit of a [`MultipathCircSet`].
+struct Leg {
+    circ: Arc<ClientCirc>,
+    /// Smoothed time from BEGIN to CONNECTED on this leg, once measured.
+    rtt: Mutex<Option<Duration>>,
+    /// Streams on this leg that are waiting for CONNECTED or still open.
+    streams: AtomicUsize,
+}
+
+impl Leg {
+    fn rtt(&self) -> Option<Duration> {
+        *self.rtt.lock().expect("poisoned lock")
+    }
+
+    fn note_rtt(&self, sample: Duration) {
+        let mut rtt = self.rtt.lock().expect("poisoned lock");
+        *rtt = Some(match *rtt {
+            Some(avg) => avg.mul_f64(1.0 - RTT_EWMA_ALPHA) + sample.mul_f64(RTT_EWMA_ALPHA),
+            None => sample,
+        });
+    }
+}
+
+/// A set of circuits over different paths that all end at the same exit.
+///
+/// Each new stream goes on the live leg with the lowest RTT × load, where
+/// the load is the number of streams already on the leg. Legs we haven't
+/// measured yet, and that have no streams, are tried first, in turn, so
+/// every leg gets a measurement. If a BEGIN on a leg fails or goes
+/// unanswered for BEGIN_TIMEOUT, we fail over to the next leg; only a
+/// refusal from the exit itself fails the stream outright.
+///
+/// This is stream-level multipath, not conflux: a stream stays on the leg
+/// it was opened on, so it spreads many streams across paths but gives a
+/// single bulk transfer no more throughput than one circuit.
+pub struct MultipathCircSet {
+    legs: Vec<Arc<Leg>>,
+    /// Leg to start from among equally good ones; held while choosing a leg
+    /// and counting the new stream on it, so concurrent opens see each other.
+    next: Mutex<usize>,
+}
+
+impl MultipathCircSet {
+    pub fn new(circs: Vec<Arc<ClientCirc>>) -> AnyResult<Self> {
+        if circs.is_empty() {
+            return Err(anyhow!("A multipath set needs at least one circuit"));
+        }
+
+        let legs = circs.into_iter()
+            .map(|circ| Arc::new(Leg { circ, rtt: Mutex::new(None), streams: AtomicUsize::new(0) }))
+            .collect();
+
+        Ok(Self { legs, next: Mutex::new(0) })
+    }
+
+    /// Return every circuit in the set, closed or not.
+    pub fn circs(&self) -> impl Iterator<Item = &Arc<ClientCirc>> {
+        self.legs.iter().map(|leg| &leg.circ)
+    }
+
+    /// Pick the best live leg not in `tried`, and count a new stream on it.
+    fn claim_leg(&self, tried: &[usize]) -> Option<(usize, LegClaim)> {
+        let mut next = self.next.lock().expect("poisoned lock");
+        let loads: Vec<LegLoad> = self.legs.iter()
+            .enumerate()
+            .map(|(i, leg)| LegLoad {
+                rtt: leg.rtt(),
+                streams: leg.streams.load(Ordering::Relaxed),
+                usable: !tried.contains(&i) && !leg.circ.is_closing(),
+            })
+            .collect();
+        let i = best_leg(&loads, *next)?;
+
+        *next = (i + 1) % self.legs.len();
+        Some((i, LegClaim::new(self.legs[i].clone())))
+    }
+
+    /// Return the smoothed RTT of each leg, or `None` for legs that are closed
+    /// or not yet measured.
+    pub fn leg_rtts(&self) -> Vec<Option<Duration>> {
+        self.legs.iter()
+            .map(|leg| if leg.circ.is_closing() { None } else { leg.rtt() })
+            .collect()
+    }
+
+    /// Open a stream to `host:port` on the best live leg.
+    ///
+    /// Return the stream along with the circuit it is on.
+    pub async fn begin_stream(
+        &self,
+        host: &str,
+        port: u16,
+        optimistic: bool,
+    ) -> AnyResult<(LegStream, Arc<ClientCirc>)> {
+        let mut last_err = anyhow!("All circuits are closed");
+        let mut tried = Vec::new();
+
+        while let Some((i, claim)) = self.claim_leg(&tried) {
+            tried.push(i);
+            let leg = claim.leg.clone();
+            let mut params = StreamParameters::default();
+            params.optimistic(optimistic);
+            let started = Instant::now();
+            let begun = tokio::time::timeout(BEGIN_TIMEOUT, leg.circ.begin_stream(host, port, Some(params)));
+            match begun.await {
+                Ok(Ok(stream)) => {
+                    // An optimistic stream returns before CONNECTED; it
+                    // takes its sample once the reader sees CONNECTED.
+                    let begun = if optimistic {
+                        Some(started)
+                    } else {
+                        leg.note_rtt(started.elapsed());
+                        None
+                    };
+                    return Ok((LegStream::new(stream, claim, begun), leg.circ.clone()));
+                }
+                // The exit refused the stream; another leg won't do better.
+                Ok(Err(e @ tor_proto::Error::EndReceived(_))) => {
+                    return Err(anyhow!("Failed to begin stream: {}", e));
+                }
+                Ok(Err(e)) => {
+                    info!("Multipath leg {} failed; failing over: {}", i, e);
+                    last_err = anyhow!("Failed to begin stream: {}", e);
+                }
+                Err(_) => {
+                    info!("Multipath leg {} didn't answer; failing over", i);
+                    last_err = anyhow!("Failed to begin stream: timed out");
+                }
+            }
+        }
+
+        Err(last_err)
+    }
+}
+
+/// A stream counted against the load of its leg until dropped.
+struct LegClaim {
+    leg: Arc<Leg>,
+}
+
+impl LegClaim {
+    fn new(leg: Arc<Leg>) -> Self {
+        leg.streams.fetch_add(1, Ordering::Relaxed);
+        Self { leg }
+    }
+}
+
+impl Drop for LegClaim {
+    fn drop(&mut self) {
+        self.leg.streams.fetch_sub(1, Ordering::Relaxed);
+    }
+}
+
+/// What a [`LegStream`] is doing with its underlying stream.
+enum LegStreamState {
+    Ready(DataStream),
+    /// Waiting for CONNECTED, to time it.
+    Connecting(BoxFuture<'static, (DataStream, tor_proto::Result<()>)>),
+}
+
+/// A stream opened by a [`MultipathCircSet`].
+///
+/// It counts towards its leg's load for as long as it lives. An optimistic
+/// stream also times its leg's RTT: the first read waits for CONNECTED
+/// before reading data, and notes how long that took since BEGIN.
+pub struct LegStream {
+    /// Always `Some`, except while being moved between states.
+    state: Option<LegStreamState>,
+    claim: LegClaim,
+    /// When we sent BEGIN, if we still have to time CONNECTED.
+    begun: Option<Instant>,
+}
+
+impl LegStream {
+    fn new(stream: DataStream, claim: LegClaim, begun: Option<Instant>) -> Self {
+        Self { state: Some(LegStreamState::Ready(stream)), claim, begun }
+    }
+
+    /// Return the underlying stream once it's free to use. If `time_connect`,
+    /// first wait for CONNECTED if we still have to time it.
+    fn poll_stream(&mut self, cx: &mut Context<'_>, time_connect: bool) -> Poll<io::Result<&mut DataStream>> {
+        if time_connect && self.begun.is_some() && matches!(self.state, Some(LegStreamState::Ready(_))) {
+            if let Some(LegStreamState::Ready(mut stream)) = self.state.take() {
+                self.state = Some(LegStreamState::Connecting(async move {
+                    let res = stream.wait_for_connection().await;
+                    (stream, res)
+                }.boxed()));
+            }
+        }
+        if let Some(LegStreamState::Connecting(connecting)) = &mut self.state {
+            let (stream, res) = futures::ready!(connecting.poll_unpin(cx));
+            self.state = Some(LegStreamState::Ready(stream));
+            if let Some(begun) = self.begun.take() {
+                if res.is_ok() {
+                    self.claim.leg.note_rtt(begun.elapsed());
+                }
+            }
+            res?;
+        }
+        match &mut self.state {
+            Some(LegStreamState::Ready(stream)) => Poll::Ready(Ok(stream)),
+            _ => Poll::Ready(Err(io::Error::new(io::ErrorKind::Other, "stream state lost"))),
+        }
+    }
+}
+
+impl AsyncRead for LegStream {
+    fn poll_read(self: Pin<&mut Self>, cx: &mut Context<'_>, buf: &mut [u8]) -> Poll<io::Result<usize>> {
+        let stream = futures::ready!(self.get_mut().poll_stream(cx, true))?;
+        Pin::new(stream).poll_read(cx, buf)
+    }
+}
+
+impl AsyncWrite for LegStream {
+    fn poll_write(self: Pin<&mut Self>, cx: &mut Context<'_>, buf: &[u8]) -> Poll<io::Result<usize>> {
+        let stream = futures::ready!(self.get_mut().poll_stream(cx, false))?;
+        Pin::new(stream).poll_write(cx, buf)
+    }
+
+    fn poll_flush(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<io::Result<()>> {
+        let stream = futures::ready!(self.get_mut().poll_stream(cx, false))?;
+        Pin::new(stream).poll_flush(cx)
+    }
+
+    fn poll_close(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<io::Result<()>> {
+        let stream = futures::ready!(self.get_mut().poll_stream(cx, false))?;
+        Pin::new(stream).poll_close(cx)
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn leg(rtt_ms: Option<u64>, streams: usize) -> LegLoad {
+        LegLoad { rtt: rtt_ms.map(Duration::from_millis), streams, usable: true }
+    }
+
+    #[test]
+    fn unmeasured_legs_first() {
+        let legs = [leg(Some(10), 0), leg(None, 0), leg(Some(5), 0)];
+        assert_eq!(best_leg(&legs, 0), Some(1));
+
+        // Once it has a stream in flight, it's costed as the slowest leg.
+        let legs = [leg(Some(10), 0), leg(None, 1), leg(Some(5), 0)];
+        assert_eq!(best_leg(&legs, 0), Some(2));
+    }
+
+    #[test]
+    fn rtt_times_load() {
+        // 10ms × 1 beats 4ms × 3.
+        let legs = [leg(Some(4), 2), leg(Some(10), 0)];
+        assert_eq!(best_leg(&legs, 0), Some(1));
+        // 4ms × 2 beats 10ms × 1.
+        let legs = [leg(Some(4), 1), leg(Some(10), 0)];
+        assert_eq!(best_leg(&legs, 0), Some(0));
+    }
+
+    #[test]
+    fn ties_go_round_robin() {
+        let legs = [leg(None, 0), leg(None, 0), leg(None, 0)];
+        assert_eq!(best_leg(&legs, 0), Some(0));
+        assert_eq!(best_leg(&legs, 1), Some(1));
+        assert_eq!(best_leg(&legs, 2), Some(2));
+
+        let legs = [leg(Some(5), 1), leg(Some(20), 0), leg(Some(5), 1)];
+        assert_eq!(best_leg(&legs, 1), Some(2));
+        assert_eq!(best_leg(&legs, 0), Some(0));
+    }
+
+    #[test]
+    fn skips_unusable_legs() {
+        let mut legs = [leg(Some(1), 0), leg(Some(50), 3)];
+        legs[0].usable = false;
+        assert_eq!(best_leg(&legs, 0), Some(1));
+        legs[1].usable = false;
+        assert_eq!(best_leg(&legs, 0), None);
+    }
+}
@@ -0,0 +1,193 @@
+use std::collections::HashMap;
+use std::sync::Mutex;
+use std::time::{Duration, SystemTime};
+
+/// Weight given to each new probe in a relay's averages.
+const PROBE_EWMA_ALPHA: f64 = 0.3;
+
+/// A relay we, or some other relay, have probed.
+#[derive(Debug, Clone, Default)]
+pub struct RelayLatency {
+    /// Smoothed CREATE2 (or EXTEND2) handshake time, in milliseconds.
+    pub handshake_ms: Option<f64>,
+    /// Smoothed round trip time for a cell to the relay and back, in
+    /// milliseconds, over a one-hop circuit from us.
+    pub rtt_ms: Option<f64>,
+    /// When we last probed the relay successfully.
+    pub probed_at: Option<SystemTime>,
+}
+
+/// Fold `sample` into the moving average `avg`.
+fn ewma(avg: &mut Option<f64>, sample: f64) {
+    *avg = Some(match *avg {
+        Some(avg) => avg * (1.0 - PROBE_EWMA_ALPHA) + sample * PROBE_EWMA_ALPHA,
+        None => sample,
+    });
+}
+
+/// Normalise a relay fingerprint for use as a key.
+fn key(rsa_id: &str) -> String {
+    rsa_id.replace(' ', "").to_uppercase()
+}
+
+/// Latencies measured by probing relays with short circuits.
+///
+/// We keep the RTT from us to each relay probed over a one-hop circuit, and
+/// the RTT of each link between two relays probed over a two-hop circuit.
+#[derive(Debug, Default)]
+pub struct LatencyTable {
+    relays: Mutex<HashMap<String, RelayLatency>>,
+    /// Smoothed RTT of the link between two relays, keyed by their
+    /// fingerprints in path order.
+    links: Mutex<HashMap<(String, String), f64>>,
+}
+
+impl LatencyTable {
+    /// Record a one-hop probe of `rsa_id`, with its round trip time if we got
+    /// one.
+    pub fn note_direct(&self, rsa_id: &str, handshake: Duration, rtt: Option<Duration>) {
+        let mut relays = self.relays.lock().expect("poisoned lock");
+        let entry = relays.entry(key(rsa_id)).or_default();
+        ewma(&mut entry.handshake_ms, handshake.as_secs_f64() * 1000.0);
+        if let Some(rtt) = rtt {
+            ewma(&mut entry.rtt_ms, rtt.as_secs_f64() * 1000.0);
+        }
+        entry.probed_at = Some(SystemTime::now());
+    }
+
+    /// Record a two-hop probe of `rsa_id` through `via`.
+    ///
+    /// `handshake` is the EXTEND2 time, less the round trip to `via`, and
+    /// `rtt` the round trip through both hops, if we got one. We estimate the
+    /// link between them by taking off our own RTT to `via`, if we know it.
+    pub fn note_via(&self, via: &str, rsa_id: &str, handshake: Duration, rtt: Option<Duration>) {
+        let (via, rsa_id) = (key(via), key(rsa_id));
+
+        let via_rtt_ms = {
+            let mut relays = self.relays.lock().expect("poisoned lock");
+            let entry = relays.entry(rsa_id.clone()).or_default();
+            ewma(&mut entry.handshake_ms, handshake.as_secs_f64() * 1000.0);
+            entry.probed_at = Some(SystemTime::now());
+            relays.get(&via).and_then(|v| v.rtt_ms)
+        };
+
+        let Some(rtt) = rtt else {
+            return;
+        };
+        let rtt_ms = rtt.as_secs_f64() * 1000.0;
+        let link_ms = (rtt_ms - via_rtt_ms.unwrap_or(0.0)).max(0.0);
+        let mut links = self.links.lock().expect("poisoned lock");
+        let mut avg = links.get(&(via.clone(), rsa_id.clone())).copied();
+        ewma(&mut avg, link_ms);
+        if let Some(avg) = avg {
+            links.insert((via, rsa_id), avg);
+        }
+    }
+
+    /// Return a copy of what we know about every relay we've probed.
+    pub fn relays(&self) -> HashMap<String, RelayLatency> {
+        self.relays.lock().expect("poisoned lock").clone()
+    }
+
+    /// Return our best estimate of the RTT, in milliseconds, that `rsa_id`
+    /// adds to a path right after `prev` (or as the first hop, if `prev` is
+    /// `None`).
+    fn hop_rtt_ms(&self, prev: Option<&str>, rsa_id: &str) -> Option<f64> {
+        if let Some(prev) = prev {
+            let links = self.links.lock().expect("poisoned lock");
+            if let Some(ms) = links.get(&(key(prev), key(rsa_id))) {
+                return Some(*ms);
+            }
+        }
+        // Without a measurement of the link, fall back to our own distance
+        // to the relay: a relay that is far from us is usually far from
+        // other relays near us too.
+        self.relays.lock().expect("poisoned lock").get(&key(rsa_id)).and_then(|r| r.rtt_ms)
+    }
+
+    /// Pick one relay from each position of `template`, aiming to minimise
+    /// the path's end-to-end RTT.
+    ///
+    /// We choose greedily, hop by hop, preferring measured relays; unmeasured
+    /// ones are only picked if nothing at that position has been measured.
+    /// Return `None` if some position has no candidates, or if the same
+    /// relay would be needed twice.
+    pub fn choose_path(&self, template: &[Vec<String>]) -> Option<Vec<String>> {
+        let mut path: Vec<String> = Vec::with_capacity(template.len());
+        for candidates in template {
+            let prev = path.last().map(String::as_str);
+            let best = candidates.iter()
+                .filter(|c| !path.iter().any(|p| key(p) == key(c)))
+                .min_by(|a, b| {
+                    let a = self.hop_rtt_ms(prev, a).unwrap_or(f64::INFINITY);
+                    let b = self.hop_rtt_ms(prev, b).unwrap_or(f64::INFINITY);
+                    a.total_cmp(&b)
+                })?;
+            path.push(best.clone());
+        }
+
+        Some(path)
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn ms(ms: u64) -> Duration {
+        Duration::from_millis(ms)
+    }
+
+    fn path(names: &[&str]) -> Vec<String> {
+        names.iter().map(|n| n.to_string()).collect()
+    }
+
+    #[test]
+    fn link_estimate_clamped() {
+        let table = LatencyTable::default();
+        table.note_direct("AA", ms(50), Some(ms(100)));
+        // Jitter can make the two-hop RTT less than our RTT to `via`.
+        table.note_via("AA", "BB", ms(40), Some(ms(80)));
+        assert_eq!(table.hop_rtt_ms(Some("AA"), "BB"), Some(0.0));
+
+        table.note_via("AA", "CC", ms(40), Some(ms(130)));
+        assert_eq!(table.hop_rtt_ms(Some("AA"), "CC"), Some(30.0));
+    }
+
+    #[test]
+    fn falls_back_to_direct_rtt() {
+        let table = LatencyTable::default();
+        table.note_direct("AA", ms(50), Some(ms(100)));
+        table.note_direct("BB", ms(50), Some(ms(70)));
+
+        assert_eq!(table.hop_rtt_ms(None, "bb"), Some(70.0));
+        // No link from AA to BB has been measured.
+        assert_eq!(table.hop_rtt_ms(Some("AA"), "BB"), Some(70.0));
+        assert_eq!(table.hop_rtt_ms(Some("AA"), "CC"), None);
+    }
+
+    #[test]
+    fn path_never_repeats_a_relay() {
+        let table = LatencyTable::default();
+        table.note_direct("AA", ms(50), Some(ms(10)));
+        table.note_direct("BB", ms(50), Some(ms(90)));
+        let template = vec![path(&["AA"]), path(&["aa", "BB"])];
+        assert_eq!(table.choose_path(&template), Some(path(&["AA", "BB"])));
+
+        // Only AA can fill the second position, and it's already used.
+        let template = vec![path(&["AA"]), path(&["A A"])];
+        assert_eq!(table.choose_path(&template), None);
+    }
+
+    #[test]
+    fn unmeasured_relays_last() {
+        let table = LatencyTable::default();
+        table.note_direct("BB", ms(50), Some(ms(500)));
+        let template = vec![path(&["AA", "BB"])];
+        assert_eq!(table.choose_path(&template), Some(path(&["BB"])));
+
+        // With nothing measured, we still pick something.
+        let template = vec![path(&["CC", "DD"])];
+        assert!(table.choose_path(&template).is_some());
+    }
+}
@@ -0,0 +1,412 @@
+use std::io;
+use std::pin::Pin;
+use std::sync::{Arc, Mutex, OnceLock, Weak};
+use std::task::{Context, Poll};
+use std::time::{Duration, Instant};
+use anyhow::{anyhow, Result as AnyResult};
+use futures::{AsyncRead, AsyncWrite, Future};
+
+use crate::tor_idle::BusyGuard;
+
+/// A rate, and the burst allowed above it.
+#[derive(Debug, Clone, Copy, PartialEq)]
+pub struct TrafficRateLimit {
+    pub bytes_per_sec: u64,
+    /// Most bytes that may pass at once after a quiet spell.
+    pub burst: u64,
+}
+
+impl TrafficRateLimit {
+    pub fn new(bytes_per_sec: u64, burst: Option<u64>) -> AnyResult<Self> {
+        if bytes_per_sec == 0 {
+            return Err(anyhow!("A rate limit must allow at least one byte per second"));
+        }
+        // By default, allow a second's worth of traffic in one go.
+        let burst = burst.unwrap_or(bytes_per_sec).max(1);
+
+        Ok(Self { bytes_per_sec, burst })
+    }
+}
+
+/// Which way traffic is going, from our side.
+#[derive(Debug, Clone, Copy)]
+pub enum Direction {
+    Upload,
+    Download,
+}
+
+#[derive(Debug)]
+struct BucketState {
+    limit: Option<TrafficRateLimit>,
+    /// Bytes we may still pass. Negative once traffic has run ahead of the
+    /// limit; the debt is paid off by waiting.
+    tokens: f64,
+    /// When we last refilled `tokens`.
+    refilled: Instant,
+}
+
+/// A token bucket, which may be unlimited.
+#[derive(Debug)]
+struct TokenBucket {
+    state: Mutex<BucketState>,
+}
+
+impl TokenBucket {
+    fn new(limit: Option<TrafficRateLimit>) -> Self {
+        Self {
+            state: Mutex::new(BucketState {
+                limit,
+                tokens: limit.map_or(0.0, |l| l.burst as f64),
+                refilled: Instant::now(),
+            }),
+        }
+    }
+
+    fn set_limit(&self, limit: Option<TrafficRateLimit>) {
+        let mut state = self.state.lock().expect("poisoned lock");
+        let burst = limit.map_or(0.0, |l| l.burst as f64);
+        if state.limit.is_none() {
+            // Coming off unlimited, start full, as a new bucket would.
+            state.tokens = burst;
+            state.refilled = Instant::now();
+        } else {
+            // Keep any debt, but don't hand out more than the new burst.
+            state.tokens = state.tokens.min(burst);
+        }
+        state.limit = limit;
+    }
+
+    /// Take `n` bytes' worth of tokens, and return how long to wait before
+    /// passing more traffic.
+    fn take(&self, n: usize, now: Instant) -> Duration {
+        let mut state = self.state.lock().expect("poisoned lock");
+        let Some(limit) = state.limit else {
+            return Duration::ZERO;
+        };
+        let rate = limit.bytes_per_sec as f64;
+        let refill = now.saturating_duration_since(state.refilled).as_secs_f64() * rate;
+        state.tokens = (state.tokens + refill).min(limit.burst as f64) - n as f64;
+        state.refilled = now;
+
+        if state.tokens >= 0.0 {
+            Duration::ZERO
+        } else {
+            Duration::from_secs_f64(-state.tokens / rate)
+        }
+    }
+}
+
+/// Rate limits for one level of the process → client → circuit → stream
+/// hierarchy, plus the limits it hands down to the levels below it.
+///
+/// Traffic through a limiter is charged to it and to every ancestor, and
+/// must wait for whichever of them is the most in debt.
+#[derive(Debug)]
+pub struct Limiter {
+    upload: TokenBucket,
+    download: TokenBucket,
+    parent: Option<Arc<Limiter>>,
+    descendants: Mutex<Descendants>,
+}
+
+#[derive(Debug)]
+struct Descendants {
+    /// Limit for each level below this one, nearest first. New children get
+    /// the first, and pass the rest on.
+    limits: Vec<Option<TrafficRateLimit>>,
+    children: Vec<Weak<Limiter>>,
+}
+
+impl Limiter {
+    fn new(
+        limit: Option<TrafficRateLimit>,
+        parent: Option<Arc<Limiter>>,
+        limits: Vec<Option<TrafficRateLimit>>,
+    ) -> Arc<Self> {
+        Arc::new(Self {
+            upload: TokenBucket::new(limit),
+            download: TokenBucket::new(limit),
+            parent,
+            descendants: Mutex::new(Descendants { limits, children: Vec::new() }),
+        })
+    }
+
+    /// Return the limiter at the top of the hierarchy, shared by every client
+    /// in this process.
+    pub fn process() -> Arc<Limiter> {
+        static PROCESS: OnceLock<Arc<Limiter>> = OnceLock::new();
+        // Below the process are clients, circuits and streams.
+        PROCESS.get_or_init(|| Limiter::new(None, None, vec![None; 3])).clone()
+    }
+
+    /// Make a limiter for the next level down.
+    pub fn child(self: &Arc<Self>) -> Arc<Limiter> {
+        let mut descendants = self.descendants.lock().expect("poisoned lock");
+        let mut limits = descendants.limits.clone();
+        let limit = if limits.is_empty() { None } else { limits.remove(0) };
+        let child = Limiter::new(limit, Some(self.clone()), limits);
+
+        descendants.children.retain(|c| c.strong_count() > 0);
+        descendants.children.push(Arc::downgrade(&child));
+
+        child
+    }
+
+    /// Set the limit `depth` levels below this one (0 for this one) for
+    /// every limiter there now, and every one made there from now on.
+    pub fn set_limit(&self, depth: usize, limit: Option<TrafficRateLimit>) -> AnyResult<()> {
+        if depth == 0 {
+            self.upload.set_limit(limit);
+            self.download.set_limit(limit);
+            return Ok(());
+        }
+
+        let children: Vec<Arc<Limiter>> = {
+            let mut descendants = self.descendants.lock().expect("poisoned lock");
+            *descendants.limits.get_mut(depth - 1)
+                .ok_or_else(|| anyhow!("No level {} below this limiter", depth))? = limit;
+            descendants.children.iter().filter_map(Weak::upgrade).collect()
+        };
+        for child in children {
+            child.set_limit(depth - 1, limit)?;
+        }
+
+        Ok(())
+    }
+
+    /// Charge `n` bytes going in `direction` to this limiter and its
+    /// ancestors, and return how long to wait before passing more.
+    pub fn take(&self, direction: Direction, n: usize) -> Duration {
+        let now = Instant::now();
+        let mut wait = Duration::ZERO;
+        let mut limiter = Some(self);
+        while let Some(l) = limiter {
+            let bucket = match direction {
+                Direction::Upload => &l.upload,
+                Direction::Download => &l.download,
+            };
+            wait = wait.max(bucket.take(n, now));
+            limiter = l.parent.as_deref();
+        }
+
+        wait
+    }
+}
+
+/// A stream whose reads and writes are paced by a [`Limiter`].
+///
+/// Each read or write goes through at once and is then charged; if that
+/// puts some level in debt, the next read (or write) waits it out. So a
+/// stream never stalls before its first byte, and the long-run rate still
+/// holds.
+pub struct LimitedStream<T> {
+    inner: T,
+    limiter: Arc<Limiter>,
+    read_pause: Option<Pin<Box<tokio::time::Sleep>>>,
+    write_pause: Option<Pin<Box<tokio::time::Sleep>>>,
+    /// Keeps the client awake while the stream is open.
+    _busy: Option<BusyGuard>,
+}
+
+impl<T> LimitedStream<T> {
+    pub fn new(inner: T, limiter: Arc<Limiter>) -> Self {
+        Self { inner, limiter, read_pause: None, write_pause: None, _busy: None }
+    }
+
+    /// Hold `busy` for as long as the stream lives.
+    pub fn hold(mut self, busy: BusyGuard) -> Self {
+        self._busy = Some(busy);
+        self
+    }
+}
+
+/// Wait out `pause`, if any; return `Pending` until it's over.
+fn poll_pause(pause: &mut Option<Pin<Box<tokio::time::Sleep>>>, cx: &mut Context<'_>) -> Poll<()> {
+    if let Some(sleep) = pause {
+        if sleep.as_mut().poll(cx).is_pending() {
+            return Poll::Pending;
+        }
+        *pause = None;
+    }
+    Poll::Ready(())
+}
+
+/// Charge `n` bytes to `limiter`, and set `pause` if we must wait before
+/// passing more.
+fn charge(
+    limiter: &Limiter,
+    pause: &mut Option<Pin<Box<tokio::time::Sleep>>>,
+    direction: Direction,
+    n: usize,
+) {
+    let wait = limiter.take(direction, n);
+    if !wait.is_zero() {
+        *pause = Some(Box::pin(tokio::time::sleep(wait)));
+    }
+}
+
+impl<T: AsyncRead + Unpin> AsyncRead for LimitedStream<T> {
+    fn poll_read(self: Pin<&mut Self>, cx: &mut Context<'_>, buf: &mut [u8]) -> Poll<io::Result<usize>> {
+        let this = self.get_mut();
+        futures::ready!(poll_pause(&mut this.read_pause, cx));
+        let n = futures::ready!(Pin::new(&mut this.inner).poll_read(cx, buf))?;
+        charge(&this.limiter, &mut this.read_pause, Direction::Download, n);
+        Poll::Ready(Ok(n))
+    }
+}
+
+impl<T: AsyncWrite + Unpin> AsyncWrite for LimitedStream<T> {
+    fn poll_write(self: Pin<&mut Self>, cx: &mut Context<'_>, buf: &[u8]) -> Poll<io::Result<usize>> {
+        let this = self.get_mut();
+        futures::ready!(poll_pause(&mut this.write_pause, cx));
+        let n = futures::ready!(Pin::new(&mut this.inner).poll_write(cx, buf))?;
+        charge(&this.limiter, &mut this.write_pause, Direction::Upload, n);
+        Poll::Ready(Ok(n))
+    }
+
+    fn poll_flush(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<io::Result<()>> {
+        Pin::new(&mut self.get_mut().inner).poll_flush(cx)
+    }
+
+    fn poll_close(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<io::Result<()>> {
+        Pin::new(&mut self.get_mut().inner).poll_close(cx)
+    }
+}
+
+impl<T: tokio::io::AsyncRead + Unpin> tokio::io::AsyncRead for LimitedStream<T> {
+    fn poll_read(
+        self: Pin<&mut Self>,
+        cx: &mut Context<'_>,
+        buf: &mut tokio::io::ReadBuf<'_>,
+    ) -> Poll<io::Result<()>> {
+        let this = self.get_mut();
+        futures::ready!(poll_pause(&mut this.read_pause, cx));
+        let before = buf.filled().len();
+        futures::ready!(Pin::new(&mut this.inner).poll_read(cx, buf))?;
+        let n = buf.filled().len() - before;
+        charge(&this.limiter, &mut this.read_pause, Direction::Download, n);
+        Poll::Ready(Ok(()))
+    }
+}
+
+impl<T: tokio::io::AsyncWrite + Unpin> tokio::io::AsyncWrite for LimitedStream<T> {
+    fn poll_write(self: Pin<&mut Self>, cx: &mut Context<'_>, buf: &[u8]) -> Poll<io::Result<usize>> {
+        let this = self.get_mut();
+        futures::ready!(poll_pause(&mut this.write_pause, cx));
+        let n = futures::ready!(Pin::new(&mut this.inner).poll_write(cx, buf))?;
+        charge(&this.limiter, &mut this.write_pause, Direction::Upload, n);
+        Poll::Ready(Ok(n))
+    }
+
+    fn poll_flush(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<io::Result<()>> {
+        Pin::new(&mut self.get_mut().inner).poll_flush(cx)
+    }
+
+    fn poll_shutdown(self: Pin<&mut Self>, cx: &mut Context<'_>) -> Poll<io::Result<()>> {
+        Pin::new(&mut self.get_mut().inner).poll_shutdown(cx)
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+
+    fn limit(bytes_per_sec: u64, burst: u64) -> Option<TrafficRateLimit> {
+        Some(TrafficRateLimit::new(bytes_per_sec, Some(burst)).unwrap())
+    }
+
+    fn limit_of(limiter: &Limiter) -> Option<TrafficRateLimit> {
+        limiter.download.state.lock().unwrap().limit
+    }
+
+    /// Assert that `wait` is `expected`, give or take the time a test takes.
+    fn assert_about(wait: Duration, expected: Duration) {
+        let slop = Duration::from_millis(50);
+        assert!(wait + slop >= expected && wait <= expected + slop, "{:?} vs {:?}", wait, expected);
+    }
+
+    #[test]
+    fn debt_carries_over() {
+        let bucket = TokenBucket::new(limit(1000, 1000));
+        let t0 = Instant::now();
+        let secs = Duration::from_secs;
+
+        // (seconds after t0, bytes taken, expected wait in ms)
+        let steps = [(0, 3000, 2000), (1, 0, 1000), (2, 500, 500), (3, 0, 0), (4, 1000, 0)];
+        for (at, n, wait_ms) in steps {
+            assert_eq!(bucket.take(n, t0 + secs(at)), Duration::from_millis(wait_ms), "at {}s", at);
+        }
+    }
+
+    #[test]
+    fn burst_clamp() {
+        let bucket = TokenBucket::new(limit(1000, 500));
+        let t0 = Instant::now();
+        let later = t0 + Duration::from_secs(10);
+
+        // A long quiet spell only saves up one burst.
+        assert_eq!(bucket.take(500, later), Duration::ZERO);
+        assert_eq!(bucket.take(1, later), Duration::from_millis(1));
+
+        // Lowering the burst takes away saved-up tokens.
+        let bucket = TokenBucket::new(limit(1000, 1000));
+        bucket.set_limit(limit(1000, 100));
+        assert_eq!(bucket.take(200, t0), Duration::from_millis(100));
+    }
+
+    #[test]
+    fn unlimited_to_limited_starts_full() {
+        let bucket = TokenBucket::new(None);
+        assert_eq!(bucket.take(1_000_000, Instant::now()), Duration::ZERO);
+
+        bucket.set_limit(limit(1000, 1000));
+        assert_eq!(bucket.take(1000, Instant::now()), Duration::ZERO);
+    }
+
+    #[test]
+    fn later_limit_reaches_existing_children() {
+        let process = Limiter::new(None, None, vec![None; 3]);
+        let client = process.child();
+        let circ = client.child();
+        let stream = circ.child();
+
+        // (depth below the process, which of process/client/circ/stream
+        // should then have the limit)
+        let cases = [(0, [true, false, false, false]), (2, [false, false, true, false]), (3, [false, false, false, true])];
+        for (depth, expected) in cases {
+            for l in [&process, &client, &circ, &stream] {
+                l.upload.set_limit(None);
+                l.download.set_limit(None);
+            }
+            process.set_limit(depth, limit(1000, 1000)).unwrap();
+            let got: Vec<bool> = [&process, &client, &circ, &stream].iter()
+                .map(|l| limit_of(l).is_some())
+                .collect();
+            assert_eq!(got, expected, "depth {}", depth);
+        }
+
+        // Limiters made later get the limits for their level too.
+        process.set_limit(2, limit(2000, 2000)).unwrap();
+        assert_eq!(limit_of(&client.child()), limit(2000, 2000));
+        assert_eq!(limit_of(&client.child().child()), limit(1000, 1000));
+
+        assert!(process.set_limit(4, limit(1000, 1000)).is_err());
+    }
+
+    #[test]
+    fn wait_is_max_across_ancestors() {
+        let process = Limiter::new(None, None, vec![None; 3]);
+        process.set_limit(1, limit(1000, 1000)).unwrap();
+        process.set_limit(2, limit(2000, 2000)).unwrap();
+        let client = process.child();
+        let circ = client.child();
+
+        // The circuit owes 3000 bytes at 2000/s, the client 4000 at 1000/s.
+        assert_about(circ.take(Direction::Download, 5000), Duration::from_secs(4));
+        // Uploads are charged separately.
+        assert_eq!(circ.take(Direction::Upload, 1000), Duration::ZERO);
+        // A sibling circuit only waits for the client.
+        let sibling = client.child();
+        assert_about(sibling.take(Direction::Download, 0), Duration::from_secs(4));
+    }
+}
@@ -0,0 +1,505 @@
+use log::{info, warn};
+use std::collections::HashMap;
+use std::path::Path;
+use std::sync::mpsc::{self, Receiver, RecvTimeoutError, Sender};
+use std::sync::Mutex;
+use std::thread;
+use std::time::{Duration, Instant, SystemTime, UNIX_EPOCH};
+use anyhow::{anyhow, Result as AnyResult};
+use rusqlite::{params, Connection};
+
+use tor_llcrypto::pk::rsa::RsaIdentity;
+
+/// Name of the database file, under the state directory.
+const DB_FILE: &str = "pyarti/relay_perf.sqlite3";
+
+/// Most observations we write in one transaction.
+const BATCH_MAX: usize = 256;
+
+/// Longest we hold an observation before writing it.
+const BATCH_DELAY: Duration = Duration::from_secs(2);
+
+/// Observations older than this don't count towards a relay's stats.
+const STATS_WINDOW: Duration = Duration::from_secs(30 * 24 * 60 * 60);
+
+/// How often the writer thread deletes observations older than `STATS_WINDOW`.
+const PRUNE_INTERVAL: Duration = Duration::from_secs(60 * 60);
+
+/// Handshake latency, in milliseconds, that we assume for a relay we haven't
+/// measured, and at which a relay scores half marks for latency.
+const REFERENCE_HANDSHAKE_MS: f64 = 500.0;
+
+/// Columns of a relay's stats, in the order `stats_from_row` reads them.
+const STATS_COLUMNS: &str = "
+    COALESCE(SUM(kind = 'build_ok'), 0),
+    COALESCE(SUM(kind = 'build_fail'), 0),
+    AVG(CASE WHEN kind = 'handshake_ms' THEN value END),
+    AVG(CASE WHEN kind = 'throughput_bps' THEN value END),
+    AVG(CASE WHEN kind = 'lifetime_s' THEN value END),
+    AVG(CASE WHEN kind = 'scanned_bps' THEN value END)";
+
+/// Throughput, in bytes per second, that we assume for a relay we haven't
+/// measured, and at which a relay scores half marks for throughput.
+const REFERENCE_THROUGHPUT_BPS: f64 = 500.0 * 1024.0;
+
+/// Something we can observe about a relay.
+#[derive(Debug, Clone, Copy)]
+pub enum ObservationKind {
+    /// The relay completed its hop of a circuit build. (Value unused.)
+    BuildSucceeded,
+    /// The relay's hop of a circuit build failed. (Value unused.)
+    BuildFailed,
+    /// Milliseconds the relay's CREATE or EXTEND handshake took.
+    HandshakeLatency,
+    /// Bytes per second a stream through a circuit using the relay received.
+    StreamThroughput,
+    /// Seconds a circuit using the relay stayed open before it closed.
+    CircuitLifetime,
+    /// Bytes per second a bandwidth scan through the relay received.
+    ScannedBandwidth,
+}
+
+impl ObservationKind {
+    fn as_str(self) -> &'static str {
+        match self {
+            ObservationKind::BuildSucceeded => "build_ok",
+            ObservationKind::BuildFailed => "build_fail",
+            ObservationKind::HandshakeLatency => "handshake_ms",
+            ObservationKind::StreamThroughput => "throughput_bps",
+            ObservationKind::CircuitLifetime => "lifetime_s",
+            ObservationKind::ScannedBandwidth => "scanned_bps",
+        }
+    }
+}
+
+struct Observation {
+    rsa_id: String,
+    kind: ObservationKind,
+    value: f64,
+    /// Seconds since the epoch.
+    at: i64,
+}
+
+enum Command {
+    Record(Observation),
+    /// Write everything queued so far, then reply.
+    Flush(Sender<()>),
+}
+
+/// What we have recently observed about one relay.
+#[derive(Debug, Clone, Default)]
+pub struct RelayStats {
+    pub builds_succeeded: u64,
+    pub builds_failed: u64,
+    pub handshake_ms: Option<f64>,
+    pub throughput_bps: Option<f64>,
+    pub lifetime_secs: Option<f64>,
+    pub scanned_bps: Option<f64>,
+}
+
+impl RelayStats {
+    /// Return a score in (0, 1) for use in relay selection; higher is better.
+    ///
+    /// It's the product of the relay's smoothed build success rate and of
+    /// factors for its handshake latency and throughput. A bandwidth scan
+    /// measures the relay alone, so its result is preferred over stream
+    /// throughput, which is shared with the rest of the path. A relay we know
+    /// nothing about scores 0.125.
+    pub fn score(&self) -> f64 {
+        let ok = self.builds_succeeded as f64;
+        let failed = self.builds_failed as f64;
+        let success = (ok + 1.0) / (ok + failed + 2.0);
+
+        let handshake_ms = self.handshake_ms.unwrap_or(REFERENCE_HANDSHAKE_MS);
+        let latency = REFERENCE_HANDSHAKE_MS / (REFERENCE_HANDSHAKE_MS + handshake_ms);
+
+        let throughput_bps = self.scanned_bps
+            .or(self.throughput_bps)
+            .unwrap_or(REFERENCE_THROUGHPUT_BPS);
+        let throughput = throughput_bps / (REFERENCE_THROUGHPUT_BPS + throughput_bps);
+
+        success * latency * throughput
+    }
+}
+
+/// An SQLite database of relay observations, kept in the state directory.
+///
+/// Recording only queues the observation: a background thread owns the
+/// write connection and writes observations in batches, so callers on the
+/// circuit-building path never wait for the disk. That thread also deletes
+/// observations once they are too old to count. Reads share a second
+/// connection.
+pub struct RelayPerfDb {
+    tx: Mutex<Sender<Command>>,
+    reader: Mutex<Connection>,
+}
+
+impl RelayPerfDb {
+    /// Open (or create) the database under `state_dir`.
+    pub fn open(state_dir: &Path) -> AnyResult<Self> {
+        let path = state_dir.join(DB_FILE);
+        if let Some(parent) = path.parent() {
+            std::fs::create_dir_all(parent)?;
+        }
+
+        let conn = Connection::open(&path)?;
+        // WAL lets `stats` read while the writer thread writes.
+        conn.pragma_update_and_check(None, "journal_mode", "WAL", |_| Ok(()))?;
+        conn.execute_batch(
+            "CREATE TABLE IF NOT EXISTS observations (
+                rsa_id TEXT NOT NULL,
+                kind TEXT NOT NULL,
+                value REAL NOT NULL,
+                at INTEGER NOT NULL
+            );
+            CREATE INDEX IF NOT EXISTS observations_by_relay
+                ON observations (rsa_id, kind, at);",
+        )?;
+
+        let reader = Connection::open(&path)?;
+
+        let (tx, rx) = mpsc::channel();
+        thread::Builder::new()
+            .name("pyarti-relaydb".to_string())
+            .spawn(move || run_writer(conn, rx))?;
+
+        info!("Recording relay performance in {}", path.display());
+
+        Ok(Self {
+            tx: Mutex::new(tx),
+            reader: Mutex::new(reader),
+        })
+    }
+
+    /// Queue an observation of `kind` about the relay `rsa_id`.
+    pub fn record(&self, rsa_id: &RsaIdentity, kind: ObservationKind, value: f64) {
+        let at = SystemTime::now()
+            .duration_since(UNIX_EPOCH)
+            .map_or(0, |d| d.as_secs() as i64);
+        let obs = Observation {
+            rsa_id: hex::encode_upper(rsa_id.as_bytes()),
+            kind,
+            value,
+            at,
+        };
+
+        // If the writer thread is gone, there's nothing useful to do.
+        let _ = self.tx.lock().expect("poisoned lock").send(Command::Record(obs));
+    }
+
+    /// Block until everything recorded so far is on disk.
+    pub fn flush(&self) -> AnyResult<()> {
+        let (done_tx, done_rx) = mpsc::channel();
+        self.tx.lock().expect("poisoned lock")
+            .send(Command::Flush(done_tx))
+            .map_err(|_| anyhow!("Relay database writer has stopped"))?;
+        done_rx.recv()
+            .map_err(|_| anyhow!("Relay database writer has stopped"))
+    }
+
+    /// Return what we have recently observed about the relay with the
+    /// fingerprint `rsa_id`.
+    ///
+    /// This blocks on the disk; don't call it from async code.
+    pub fn stats(&self, rsa_id: &str) -> AnyResult<RelayStats> {
+        let mut stats = self.stats_many(std::slice::from_ref(&rsa_id))?;
+
+        Ok(stats.remove(0))
+    }
+
+    /// Like [`Self::stats`], for each relay in `rsa_ids`, in order.
+    pub fn stats_many<S: AsRef<str>>(&self, rsa_ids: &[S]) -> AnyResult<Vec<RelayStats>> {
+        self.flush()?;
+
+        let since = window_start();
+        let conn = self.reader.lock().expect("poisoned lock");
+        let mut query = conn.prepare_cached(&format!(
+            "SELECT {} FROM observations WHERE rsa_id = ?1 AND at >= ?2",
+            STATS_COLUMNS,
+        ))?;
+
+        let stats = rsa_ids.iter()
+            .map(|rsa_id| {
+                let rsa_id = rsa_id.as_ref().replace(' ', "").to_uppercase();
+                query.query_row(params![rsa_id, since], |row| stats_from_row(row, 0))
+            })
+            .collect::<rusqlite::Result<Vec<_>>>()?;
+
+        Ok(stats)
+    }
+
+    /// Return what we have recently observed about every relay we have
+    /// recently observed at all, by fingerprint (upper-case hex, without
+    /// spaces).
+    ///
+    /// This blocks on the disk; don't call it from async code.
+    pub fn all_stats(&self) -> AnyResult<HashMap<String, RelayStats>> {
+        self.flush()?;
+
+        let conn = self.reader.lock().expect("poisoned lock");
+        let mut query = conn.prepare_cached(&format!(
+            "SELECT rsa_id, {} FROM observations WHERE at >= ?1 GROUP BY rsa_id",
+            STATS_COLUMNS,
+        ))?;
+        let stats = query
+            .query_map(params![window_start()], |row| Ok((row.get(0)?, stats_from_row(row, 1)?)))?
+            .collect::<rusqlite::Result<HashMap<_, _>>>()?;
+
+        Ok(stats)
+    }
+}
+
+/// Read a relay's stats from `row`, starting at column `first`.
+fn stats_from_row(row: &rusqlite::Row<'_>, first: usize) -> rusqlite::Result<RelayStats> {
+    Ok(RelayStats {
+        builds_succeeded: row.get::<_, i64>(first)? as u64,
+        builds_failed: row.get::<_, i64>(first + 1)? as u64,
+        handshake_ms: row.get(first + 2)?,
+        throughput_bps: row.get(first + 3)?,
+        lifetime_secs: row.get(first + 4)?,
+        scanned_bps: row.get(first + 5)?,
+    })
+}
+
+/// Return the time, in seconds since the epoch, before which observations
+/// no longer count.
+fn window_start() -> i64 {
+    SystemTime::now()
+        .checked_sub(STATS_WINDOW)
+        .and_then(|t| t.duration_since(UNIX_EPOCH).ok())
+        .map_or(0, |d| d.as_secs() as i64)
+}
+
+/// Body of the writer thread: write observations from `rx` to `conn` in
+/// batches, until every sender is gone.
+fn run_writer(mut conn: Connection, rx: Receiver<Command>) {
+    let mut batch = Vec::new();
+    // When we must write the oldest observation in `batch`.
+    let mut deadline: Option<Instant> = None;
+    prune(&conn);
+    let mut next_prune = Instant::now() + PRUNE_INTERVAL;
+
+    loop {
+        let cmd = match deadline {
+            Some(deadline) => rx.recv_timeout(deadline.saturating_duration_since(Instant::now())),
+            None => rx.recv().map_err(|_| RecvTimeoutError::Disconnected),
+        };
+
+        let mut flushed = None;
+        match cmd {
+            Ok(Command::Record(obs)) => {
+                batch.push(obs);
+                deadline.get_or_insert_with(|| Instant::now() + BATCH_DELAY);
+                if batch.len() < BATCH_MAX {
+                    continue;
+                }
+            }
+            Ok(Command::Flush(done)) => flushed = Some(done),
+            Err(RecvTimeoutError::Timeout) => {}
+            Err(RecvTimeoutError::Disconnected) => {
+                write_batch(&mut conn, &mut batch);
+                return;
+            }
+        }
+
+        write_batch(&mut conn, &mut batch);
+        deadline = None;
+        if let Some(done) = flushed {
+            let _ = done.send(());
+        }
+        if Instant::now() >= next_prune {
+            prune(&conn);
+            next_prune = Instant::now() + PRUNE_INTERVAL;
+        }
+    }
+}
+
+/// Delete observations too old to count towards any relay's stats.
+fn prune(conn: &Connection) {
+    match conn.execute("DELETE FROM observations WHERE at < ?1", params![window_start()]) {
+        Ok(0) => {}
+        Ok(n) => info!("Pruned {} old relay observations", n),
+        Err(e) => warn!("Failed to prune old relay observations: {}", e),
+    }
+}
+
+/// Write and clear `batch`, in one transaction.
+fn write_batch(conn: &mut Connection, batch: &mut Vec<Observation>) {
+    if batch.is_empty() {
+        return;
+    }
+
+    let result = (|| -> rusqlite::Result<()> {
+        let tx = conn.transaction()?;
+        {
+            let mut insert = tx.prepare_cached(
+                "INSERT INTO observations (rsa_id, kind, value, at) VALUES (?1, ?2, ?3, ?4)",
+            )?;
+            for obs in batch.iter() {
+                insert.execute(params![obs.rsa_id, obs.kind.as_str(), obs.value, obs.at])?;
+            }
+        }
+        tx.commit()
+    })();
+
+    if let Err(e) = result {
+        warn!("Failed to write {} relay observations: {}", batch.len(), e);
+    }
+    batch.clear();
+}
+
+#[cfg(test)]
+mod test {
+    use super::*;
+    use std::path::PathBuf;
+
+    /// Return an empty state directory for the test `name`.
+    fn state_dir(name: &str) -> PathBuf {
+        let dir = std::env::temp_dir().join(format!("pyarti-relaydb-{}-{}", name, std::process::id()));
+        let _ = std::fs::remove_dir_all(&dir);
+        dir
+    }
+
+    fn relay(byte: u8) -> RsaIdentity {
+        RsaIdentity::from_bytes(&[byte; 20]).unwrap()
+    }
+
+    fn fingerprint(byte: u8) -> String {
+        hex::encode_upper([byte; 20])
+    }
+
+    /// Count the observations on disk, through a connection of our own.
+    fn rows_on_disk(dir: &Path) -> i64 {
+        Connection::open(dir.join(DB_FILE)).unwrap()
+            .query_row("SELECT COUNT(*) FROM observations", [], |row| row.get(0))
+            .unwrap()
+    }
+
+    /// Wait up to `limit` for `n` observations to be on disk.
+    fn wait_for_rows(dir: &Path, n: i64, limit: Duration) -> bool {
+        let deadline = Instant::now() + limit;
+        while Instant::now() < deadline {
+            if rows_on_disk(dir) >= n {
+                return true;
+            }
+            thread::sleep(Duration::from_millis(20));
+        }
+        false
+    }
+
+    #[test]
+    fn round_trip() {
+        let dir = state_dir("round-trip");
+        let db = RelayPerfDb::open(&dir).unwrap();
+        db.record(&relay(1), ObservationKind::BuildSucceeded, 1.0);
+        db.record(&relay(1), ObservationKind::BuildSucceeded, 1.0);
+        db.record(&relay(1), ObservationKind::BuildFailed, 1.0);
+        db.record(&relay(1), ObservationKind::HandshakeLatency, 100.0);
+        db.record(&relay(1), ObservationKind::HandshakeLatency, 300.0);
+        db.record(&relay(2), ObservationKind::ScannedBandwidth, 1000.0);
+
+        // stats flushes first, so nothing is lost to batching.
+        let stats = db.stats(&fingerprint(1)).unwrap();
+        assert_eq!(stats.builds_succeeded, 2);
+        assert_eq!(stats.builds_failed, 1);
+        assert_eq!(stats.handshake_ms, Some(200.0));
+        assert_eq!(stats.throughput_bps, None);
+        assert_eq!(stats.scanned_bps, None);
+
+        let all = db.all_stats().unwrap();
+        assert_eq!(all.len(), 2);
+        assert_eq!(all[&fingerprint(2)].scanned_bps, Some(1000.0));
+
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn full_batch_written_at_once() {
+        let dir = state_dir("full-batch");
+        let db = RelayPerfDb::open(&dir).unwrap();
+        for _ in 0..BATCH_MAX {
+            db.record(&relay(1), ObservationKind::BuildSucceeded, 1.0);
+        }
+        // A full batch doesn't wait for BATCH_DELAY.
+        assert!(wait_for_rows(&dir, BATCH_MAX as i64, BATCH_DELAY / 2));
+
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn partial_batch_written_after_delay() {
+        let dir = state_dir("partial-batch");
+        let db = RelayPerfDb::open(&dir).unwrap();
+        let started = Instant::now();
+        db.record(&relay(1), ObservationKind::BuildSucceeded, 1.0);
+
+        assert!(wait_for_rows(&dir, 1, BATCH_DELAY * 3));
+        assert!(started.elapsed() >= BATCH_DELAY);
+
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn old_observations_dont_count() {
+        let dir = state_dir("window");
+        let db = RelayPerfDb::open(&dir).unwrap();
+        db.record(&relay(1), ObservationKind::HandshakeLatency, 100.0);
+        db.flush().unwrap();
+
+        let conn = Connection::open(dir.join(DB_FILE)).unwrap();
+        let old = window_start() - 60;
+        conn.execute(
+            "INSERT INTO observations (rsa_id, kind, value, at) VALUES (?1, 'handshake_ms', 900.0, ?2)",
+            params![fingerprint(1), old],
+        ).unwrap();
+
+        assert_eq!(db.stats(&fingerprint(1)).unwrap().handshake_ms, Some(100.0));
+        assert_eq!(rows_on_disk(&dir), 2);
+        prune(&conn);
+        assert_eq!(rows_on_disk(&dir), 1);
+        assert_eq!(db.stats(&fingerprint(1)).unwrap().handshake_ms, Some(100.0));
+
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn fingerprints_normalised() {
+        let dir = state_dir("fingerprints");
+        let db = RelayPerfDb::open(&dir).unwrap();
+        db.record(&relay(0xab), ObservationKind::BuildSucceeded, 1.0);
+
+        let spaced = "abab abab abab abab abab abab abab abab abab abab";
+        let ids = [spaced.to_string(), fingerprint(0xab), fingerprint(0xcd)];
+        let stats = db.stats_many(&ids).unwrap();
+        assert_eq!(stats.len(), 3);
+        assert_eq!(stats[0].builds_succeeded, 1);
+        assert_eq!(stats[1].builds_succeeded, 1);
+        assert_eq!(stats[2].builds_succeeded, 0);
+
+        std::fs::remove_dir_all(&dir).unwrap();
+    }
+
+    #[test]
+    fn score_order() {
+        let unknown = RelayStats::default();
+        assert_eq!(unknown.score(), 0.125);
+
+        let fast = RelayStats { handshake_ms: Some(100.0), ..Default::default() };
+        let slow = RelayStats { handshake_ms: Some(2000.0), ..Default::default() };
+        assert!(fast.score() > unknown.score());
+        assert!(slow.score() < unknown.score());
+
+        let reliable = RelayStats { builds_succeeded: 20, ..Default::default() };
+        let flaky = RelayStats { builds_succeeded: 10, builds_failed: 10, ..Default::default() };
+        assert!(reliable.score() > unknown.score());
+        assert!(flaky.score() < reliable.score());
+
+        // A scan beats stream throughput, which is shared with the path.
+        let scanned_slow = RelayStats {
+            throughput_bps: Some(10.0 * REFERENCE_THROUGHPUT_BPS),
+            scanned_bps: Some(0.1 * REFERENCE_THROUGHPUT_BPS),
+            ..Default::default()
+        };
+        assert!(scanned_slow.score() < unknown.score());
+    }
+}